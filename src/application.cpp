@@ -1,4 +1,17 @@
 #include "application.hpp"
+#include "bvh.hpp"
+#include "compiled_scene.hpp"
+#include "emitters.hpp"
+#include "gpu_scene.hpp"
+#include "grid.hpp"
+#ifndef __EMSCRIPTEN__
+#include "checkpoint.hpp"
+#include "cpu_tracer.hpp"
+#include "exr.hpp"
+#include "thread_pool.hpp"
+#include "tiled_image.hpp"
+#include "tiles.hpp"
+#endif
 #include "scene.hpp"
 #include "unique_resource.hpp"
 #include "vec.hpp"
@@ -15,6 +28,7 @@
 
 #ifdef __EMSCRIPTEN__
 #define NO_COMPUTE_SHADER
+#define NO_STORAGE_BUFFER
 #endif
 
 #include <imgui.h>
@@ -25,7 +39,10 @@
 #include <stb_image_write.h>
 
 #include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <concepts>
 #include <cstdint>
@@ -33,15 +50,21 @@
 #include <cstring>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <initializer_list>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <numbers>
+#include <numeric>
 #include <optional>
 #include <source_location>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -74,6 +97,8 @@ namespace
     f(PFNGLBINDTEXTUREPROC, glBindTexture);                                    \
     f(PFNGLTEXPARAMETERIPROC, glTexParameteri);                                \
     f(PFNGLTEXIMAGE2DPROC, glTexImage2D);                                      \
+    f(PFNGLTEXSUBIMAGE2DPROC, glTexSubImage2D);                                \
+    f(PFNGLPIXELSTOREIPROC, glPixelStorei);                                    \
     f(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers);                            \
     f(PFNGLDELETEFRAMEBUFFERSPROC, glDeleteFramebuffers);                      \
     f(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer);                            \
@@ -84,6 +109,7 @@ namespace
     f(PFNGLBINDBUFFERPROC, glBindBuffer);                                      \
     f(PFNGLBUFFERDATAPROC, glBufferData);                                      \
     f(PFNGLBINDBUFFERBASEPROC, glBindBufferBase);                              \
+    f(PFNGLBINDBUFFERRANGEPROC, glBindBufferRange);                            \
     f(PFNGLBUFFERSUBDATAPROC, glBufferSubData);                                \
     f(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays);                            \
     f(PFNGLDELETEVERTEXARRAYSPROC, glDeleteVertexArrays);                      \
@@ -91,7 +117,8 @@ namespace
     f(PFNGLUNIFORMBLOCKBINDINGPROC, glUniformBlockBinding);                    \
     f(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer);                    \
     f(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray);            \
-    f(PFNGLDRAWELEMENTSPROC, glDrawElements);                                  \
+    f(PFNGLVERTEXATTRIBDIVISORPROC, glVertexAttribDivisor);                    \
+    f(PFNGLDRAWARRAYSINSTANCEDPROC, glDrawArraysInstanced);                    \
     f(PFNGLDRAWARRAYSPROC, glDrawArrays);                                      \
     f(PFNGLUSEPROGRAMPROC, glUseProgram);                                      \
     f(PFNGLVIEWPORTPROC, glViewport);                                          \
@@ -110,12 +137,22 @@ namespace
     f(PFNGLDEBUGMESSAGECALLBACKPROC, glDebugMessageCallback);                  \
     f(PFNGLGETTEXIMAGEPROC, glGetTexImage);                                    \
     f(PFNGLDISPATCHCOMPUTEPROC, glDispatchCompute);                            \
+    f(PFNGLDISPATCHCOMPUTEINDIRECTPROC, glDispatchComputeIndirect);            \
     f(PFNGLMEMORYBARRIERPROC, glMemoryBarrier);                                \
     f(PFNGLBINDIMAGETEXTUREPROC, glBindImageTexture);                          \
     f(PFNGLGENQUERIESPROC, glGenQueries);                                      \
     f(PFNGLDELETEQUERIESPROC, glDeleteQueries);                                \
     f(PFNGLQUERYCOUNTERPROC, glQueryCounter);                                  \
-    f(PFNGLGETQUERYOBJECTUI64VPROC, glGetQueryObjectui64v);
+    f(PFNGLGETQUERYOBJECTUI64VPROC, glGetQueryObjectui64v);                    \
+    f(PFNGLGETPROGRAMRESOURCEINDEXPROC, glGetProgramResourceIndex);            \
+    f(PFNGLGETBUFFERSUBDATAPROC, glGetBufferSubData);                          \
+    f(PFNGLCLEARBUFFERDATAPROC, glClearBufferData);                            \
+    f(PFNGLSHADERSTORAGEBLOCKBINDINGPROC, glShaderStorageBlockBinding);        \
+    f(PFNGLFENCESYNCPROC, glFenceSync);                                        \
+    f(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync);                              \
+    f(PFNGLDELETESYNCPROC, glDeleteSync);                                      \
+    f(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange);                              \
+    f(PFNGLUNMAPBUFFERPROC, glUnmapBuffer);
 
 #ifndef __EMSCRIPTEN__
 #define ENUMERATE_GL_FUNCTIONS(f)                                              \
@@ -267,28 +304,162 @@ struct Window_state
     float scroll_offset;
 };
 
-struct Vertex
+// Per-instance data of the overlay. Each instance is drawn as a quad generated
+// in the vertex shaders and expanded by the stroke thickness there, so the
+// instances do not depend on the view.
+struct Circle_instance
+{
+    vec2 center;
+    float radius;
+    vec3 color;
+};
+
+struct Line_instance
+{
+    vec2 a;
+    vec2 b;
+    vec3 color;
+};
+
+struct Arc_instance
 {
-    vec2 position;
-    vec4 local;
+    vec2 center;
+    float radius;
+    float b;
+    vec2 a;
     vec3 color;
 };
 
 struct Raster_geometry
 {
-    std::size_t circle_indices_offset;
-    std::size_t circle_indices_size;
-    std::size_t line_indices_offset;
-    std::size_t line_indices_size;
-    std::size_t arc_indices_offset;
-    std::size_t arc_indices_size;
-    std::vector<Vertex> vertices;
-    std::vector<std::uint32_t> indices;
+    std::vector<Circle_instance> circles;
+    std::vector<Line_instance> lines;
+    std::vector<Arc_instance> arcs;
+};
+
+// Half-open range of array elements modified since they were last uploaded,
+// empty if begin >= end
+struct Dirty_range
+{
+    std::size_t begin;
+    std::size_t end;
+};
+
+// Acceleration structure the trace programs are compiled for
+enum struct Accelerator
+{
+    none,
+    bvh,
+    grid
 };
 
+struct Scene_edits
+{
+    Dirty_range circles;
+    Dirty_range lines;
+    Dirty_range arcs;
+};
+
+#ifndef NO_COMPUTE_SHADER
+// Locations of the uniforms shared by the trace and wavefront kernels
+struct Trace_uniforms
+{
+    GLint sample_index;
+    GLint samples_per_frame;
+    GLint first_sample;
+    GLint error_threshold;
+    GLint view_position;
+    GLint view_size;
+    GLint image_size;
+    GLint tile_offset;
+    GLint tile_size;
+};
+
+// Kernels of the wavefront path tracer, see wavefront.glsl
+struct Wavefront_programs
+{
+    Unique_resource<GLuint, GL_deleter> generate;
+    Unique_resource<GLuint, GL_deleter> intersect;
+    // Indexed by Material_type
+    std::array<Unique_resource<GLuint, GL_deleter>, 3> shade;
+    Unique_resource<GLuint, GL_deleter> accumulate;
+    Unique_resource<GLuint, GL_deleter> prepare;
+    GLint loc_wave_index;
+    GLint loc_intersect_ray_queue;
+    std::array<GLint, 3> loc_shade_ray_queue;
+    GLint loc_consumed_queues;
+    // In the order of trace_uniform_programs()
+    std::array<Trace_uniforms, 6> loc_trace_uniforms;
+};
+
+// The wavefront kernels that read the uniforms of Trace_uniforms
+[[nodiscard]] std::array<GLuint, 6>
+trace_uniform_programs(const Wavefront_programs &programs)
+{
+    return {programs.generate.get(),
+            programs.intersect.get(),
+            programs.shade[0].get(),
+            programs.shade[1].get(),
+            programs.shade[2].get(),
+            programs.accumulate.get()};
+}
+
+// These must match wavefront.glsl
+constexpr GLuint wavefront_ray_queue {0};
+constexpr GLuint wavefront_material_queue {2};
+constexpr GLuint wavefront_num_queues {5};
+constexpr GLintptr wavefront_queue_size {4 * sizeof(GLuint)};
+constexpr GLsizeiptr wavefront_path_size {80};
+constexpr GLuint wavefront_paths_binding {8};
+// This must match trace.glsl
+constexpr GLuint ray_counts_binding {7};
+// Pairs of ray counters shared by the work groups of a dispatch
+constexpr std::size_t ray_count_pairs {1024};
+// Every bounce of a path up to MAX_DEPTH of trace.glsl
+constexpr GLuint wavefront_max_depth {32};
+
+// Persistent threads only need to fill the GPU, the work groups that start
+// after all pixels have been pulled simply exit
+constexpr unsigned int persistent_num_groups {2048};
+#endif
+
 struct Application
 {
     void init();
+#ifndef __EMSCRIPTEN__
+    void init_headless(const Render_options &options);
+    void load_tile(const Tile &tile, const Tiled_image &image);
+    void store_tile(const Tile &tile, const Tiled_image &image);
+    void read_target_tile(const Tile &tile, std::vector<std::uint8_t> &pixels);
+    void resume(const Checkpoint &checkpoint);
+    void start_checkpoint();
+    void update_checkpoint(bool wait);
+    void start_export(std::string file_name);
+    void update_export(bool wait);
+#endif
+    void init_context(bool visible);
+    void init_renderer();
+    void upload_scene();
+    void set_scene(Scene new_scene);
+    void select_trace_program(const std::string &scene_declarations);
+    void upload_scene_edits();
+    void trace(unsigned int samples);
+#ifndef NO_COMPUTE_SHADER
+    void create_light_sums_buffer();
+    void create_wavefront_buffers();
+    void trace_wavefront(unsigned int samples);
+    void read_ray_counts();
+#endif
+    void post_process();
+#ifndef NO_COMPUTE_SHADER
+    [[nodiscard]] float measure_error();
+#endif
+    [[nodiscard]] bool has_converged() const noexcept;
+    [[nodiscard]] unsigned int
+    dispatch_samples(unsigned int max_samples) const noexcept;
+    void update_workload(unsigned int samples,
+                         double target_compute_per_frame);
+    void print_statistics();
     void main_loop_update();
 
     Unique_resource<bool, GLFW_deleter> glfw_context {};
@@ -300,19 +471,75 @@ struct Application
     bool auto_workload {};
     int texture_width {};
     int texture_height {};
+    // Size of the rendered image. When rendering in tiles, the accumulation
+    // textures only hold the tile of tile_width by tile_height pixels at
+    // tile_x, tile_y, otherwise the tile is the whole image.
+    int image_width {};
+    int image_height {};
+    int tile_x {};
+    int tile_y {};
+    int tile_width {};
+    int tile_height {};
     Scene scene {};
     Unique_resource<GLuint, GL_array_deleter> accumulation_texture {};
+#ifndef NO_COMPUTE_SHADER
+    Unique_resource<GLuint, GL_array_deleter> moment_texture {};
+#endif
     Unique_resource<GLuint, GL_array_deleter> target_texture {};
-    Unique_resource<GLuint, GL_deleter> trace_program {};
+    // Trace programs only depend on the shape of the scene, keyed by the
+    // source code that differs between them
+    std::unordered_map<std::string, Unique_resource<GLuint, GL_deleter>>
+        trace_programs {};
+    GLuint trace_program {};
 #ifdef NO_COMPUTE_SHADER
     Unique_resource<GLuint, GL_array_deleter> empty_vao {};
+#endif
     GLint loc_image_size {};
+    GLint loc_tile_offset {};
+#ifndef NO_COMPUTE_SHADER
+    GLint loc_tile_size {};
 #endif
     GLint loc_sample_index {};
     GLint loc_samples_per_frame {};
+    GLint loc_first_sample {};
+#ifndef NO_COMPUTE_SHADER
+    GLint loc_error_threshold {};
+#endif
     GLint loc_view_position {};
     GLint loc_view_size {};
     Unique_resource<GLuint, GL_deleter> post_program {};
+#ifndef NO_COMPUTE_SHADER
+    Unique_resource<GLuint, GL_deleter> reduce_program {};
+    Unique_resource<GLuint, GL_deleter> reduce_final_program {};
+    GLint loc_reduce_tile_size {};
+    GLint loc_num_partial_sums {};
+    Unique_resource<GLuint, GL_array_deleter> partial_sums_buffer {};
+    // Light tracing splats into light_sums_buffer, which resolve_program
+    // averages into the accumulation texture
+    bool light_tracing {};
+    Unique_resource<GLuint, GL_deleter> resolve_program {};
+    GLint loc_resolve_sample_index {};
+    Unique_resource<GLuint, GL_array_deleter> light_sums_buffer {};
+    // The wavefront kernels replace trace_program for camera paths. They are
+    // cached like the trace programs, with the state of one path per pixel
+    // in paths_buffer and the queues of path indices in queues_buffer.
+    bool wavefront {};
+    bool wavefront_supported {};
+    std::unordered_map<std::string, Wavefront_programs> wavefront_programs {};
+    const Wavefront_programs *wavefront_program {};
+    Unique_resource<GLuint, GL_array_deleter> paths_buffer {};
+    Unique_resource<GLuint, GL_array_deleter> queues_buffer {};
+    // A fixed number of persistent threads pull the pixels to trace from the
+    // counter in work_counter_buffer, instead of one invocation per pixel
+    bool persistent_threads {};
+    Unique_resource<GLuint, GL_array_deleter> work_counter_buffer {};
+    // The trace kernels count the rays they trace in ray_counts_buffer, which
+    // is read back after every dispatch into the totals below
+    bool count_rays {};
+    Unique_resource<GLuint, GL_array_deleter> ray_counts_buffer {};
+    std::uint64_t path_rays {};
+    std::uint64_t shadow_rays {};
+#endif
 #ifdef NO_COMPUTE_SHADER
     Unique_resource<GLuint, GL_array_deleter> float_fbo {};
 #endif
@@ -320,27 +547,79 @@ struct Application
 #ifndef __EMSCRIPTEN__
     Unique_resource<GLuint, GL_array_deleter> query_start {};
     Unique_resource<GLuint, GL_array_deleter> query_end {};
+    // Checkpoints are read back into checkpoint_buffer without stalling, then
+    // written to checkpoint_path by another thread while the buffer stays
+    // mapped. At most one checkpoint is in flight.
+    std::filesystem::path checkpoint_path {};
+    Checkpoint_info checkpoint_info {};
+    Unique_resource<GLuint, GL_array_deleter> checkpoint_buffer {};
+    GLsync checkpoint_fence {};
+    std::future<void> checkpoint_write {};
+    // Exported images go through export_buffer in the same way, so that
+    // saving the image does not stall the frame loop
+    Unique_resource<GLuint, GL_array_deleter> export_buffer {};
+    GLsync export_fence {};
+    std::future<void> export_write {};
+    std::string export_file_name {};
+    int export_width {};
+    int export_height {};
+    // Seconds between automatic exports of the image, 0 to disable
+    float auto_save_interval {};
+    double last_auto_save_time {};
+#endif
+    Unique_resource<GLuint, GL_array_deleter> materials_buffer {};
+    Unique_resource<GLuint, GL_array_deleter> primitives_buffer {};
+    Unique_resource<GLuint, GL_array_deleter> bvh_nodes_buffer {};
+    Unique_resource<GLuint, GL_array_deleter> grid_cells_buffer {};
+    Unique_resource<GLuint, GL_array_deleter> grid_primitives_buffer {};
+    Unique_resource<GLuint, GL_array_deleter> emitters_buffer {};
+    // Kept to be updated when primitives move
+    Compiled_scene compiled_scene {};
+    Gpu_primitives gpu_primitives {};
+    Accelerator accelerator {};
+    Bvh bvh {};
+#ifndef __EMSCRIPTEN__
+    // Builds the grids, created on first use
+    std::unique_ptr<Thread_pool> grid_pool {};
 #endif
-    Unique_resource<GLuint, GL_array_deleter> materials_ubo {};
-    Unique_resource<GLuint, GL_array_deleter> circles_ubo {};
-    Unique_resource<GLuint, GL_array_deleter> lines_ubo {};
-    Unique_resource<GLuint, GL_array_deleter> arcs_ubo {};
+    Scene_edits scene_edits {};
     float thickness {}; // In fraction of the view height
     Raster_geometry raster_geometry {};
-    Unique_resource<GLuint, GL_array_deleter> vao {};
-    Unique_resource<GLuint, GL_array_deleter> vbo {};
-    Unique_resource<GLuint, GL_array_deleter> ibo {};
+    Unique_resource<GLuint, GL_array_deleter> circle_vao {};
+    Unique_resource<GLuint, GL_array_deleter> circle_vbo {};
+    Unique_resource<GLuint, GL_array_deleter> line_vao {};
+    Unique_resource<GLuint, GL_array_deleter> line_vbo {};
+    Unique_resource<GLuint, GL_array_deleter> arc_vao {};
+    Unique_resource<GLuint, GL_array_deleter> arc_vbo {};
     Unique_resource<GLuint, GL_deleter> circle_program {};
     Unique_resource<GLuint, GL_deleter> line_program {};
     Unique_resource<GLuint, GL_deleter> arc_program {};
     GLint loc_view_position_draw_circle {};
     GLint loc_view_size_draw_circle {};
+    GLint loc_thickness_draw_circle {};
     GLint loc_view_position_draw_line {};
     GLint loc_view_size_draw_line {};
+    GLint loc_thickness_draw_line {};
     GLint loc_view_position_draw_arc {};
     GLint loc_view_size_draw_arc {};
+    GLint loc_thickness_draw_arc {};
+    // Number of samples of the pixels that did not stop sampling early
     unsigned int sample_index {};
     unsigned int samples_per_frame {};
+    // Offset of the samples in the sequences of random numbers, so that
+    // distributed workers trace different samples
+    unsigned int first_sample {};
+    // Relative error under which pixels stop sampling, 0 to always sample all
+    // pixels. Only supported with compute shaders.
+    float error_threshold {};
+    // Mean relative error of all pixels at which rendering stops, 0 to render
+    // up to the maximum number of samples. Only supported with compute
+    // shaders.
+    float target_error {};
+    // Last result of measure_error(), infinite if not measured since the last
+    // reset of the accumulation
+    float current_error {};
+    double last_error_time {};
     double last_time {};
     unsigned int sum_samples {};
     int num_frames {};
@@ -348,9 +627,13 @@ struct Application
     bool s_pressed {};
     bool l_pressed {};
     bool dragging {};
+    bool editing {};
     bool draw_geometry {};
     float drag_source_mouse_x {};
     float drag_source_mouse_y {};
+    float edit_source_mouse_x {};
+    float edit_source_mouse_y {};
+    std::optional<std::uint32_t> picked_primitive {};
 };
 
 template <std::invocable C, std::invocable<GLuint> D>
@@ -394,7 +677,12 @@ struct Viewport
     int height;
 };
 
-constexpr unsigned int max_ubo_size {16'384};
+#ifdef __EMSCRIPTEN__
+// WebGL 2.0
+constexpr auto glsl_version_directive = "#version 300 es";
+#else
+constexpr auto glsl_version_directive = "#version 430 core";
+#endif
 
 void glfw_error_callback(int error, const char *description)
 {
@@ -575,29 +863,125 @@ create_shader(GLenum type, std::size_t size, const char *const code[])
     return program;
 }
 
+[[nodiscard]] const char *accelerator_define(Accelerator accelerator) noexcept
+{
+    switch (accelerator)
+    {
+    case Accelerator::bvh: return "#define USE_BVH\n";
+    case Accelerator::grid: return "#define USE_GRID\n";
+    case Accelerator::none: break;
+    }
+    return "";
+}
+
 #ifndef __EMSCRIPTEN__
 [[nodiscard]] auto create_trace_compute_program(const char *glsl_version,
-                                                const Scene &scene)
+                                                Accelerator accelerator,
+                                                bool light_tracing,
+                                                bool persistent_threads,
+                                                bool count_rays)
 {
+    const auto scene_code = read_file("shaders/scene.glsl");
     const auto shader_code = read_file("shaders/trace.glsl");
     std::ostringstream header;
     header << glsl_version << '\n'
            << "#define COMPUTE_SHADER\n"
-           << "#define MATERIAL_COUNT " << scene.materials.size() << '\n'
-           << "#define CIRCLE_COUNT " << scene.circles.size() << '\n'
-           << "#define LINE_COUNT " << scene.lines.size() << '\n'
-           << "#define ARC_COUNT " << scene.arcs.size() << '\n';
+           << accelerator_define(accelerator);
+    if (light_tracing)
+    {
+        header << "#define LIGHT_TRACING\n";
+    }
+    if (persistent_threads)
+    {
+        header << "#define PERSISTENT_THREADS\n";
+    }
+    if (count_rays)
+    {
+        header << "#define COUNT_RAYS\n";
+    }
     const auto header_str = header.str();
-    const char *const sources[] {header_str.c_str(), shader_code.c_str()};
+    const char *const sources[] {
+        header_str.c_str(), scene_code.c_str(), shader_code.c_str()};
     const auto shader =
         create_shader(GL_COMPUTE_SHADER, std::size(sources), sources);
 
     return create_program(shader.get());
 }
+
+// Compiles every stage of wavefront.glsl, which follows the same sources as
+// the trace compute program
+[[nodiscard]] Wavefront_programs create_wavefront_programs(
+    const char *glsl_version, Accelerator accelerator, bool count_rays)
+{
+    const auto scene_code = read_file("shaders/scene.glsl");
+    const auto trace_code = read_file("shaders/trace.glsl");
+    const auto shader_code = read_file("shaders/wavefront.glsl");
+    const auto create_stage = [&](const std::string &stage)
+    {
+        std::ostringstream header;
+        header << glsl_version << '\n'
+               << "#define COMPUTE_SHADER\n#define WAVEFRONT\n" << stage
+               << accelerator_define(accelerator);
+        if (count_rays)
+        {
+            header << "#define COUNT_RAYS\n";
+        }
+        const auto header_str = header.str();
+        const char *const sources[] {header_str.c_str(),
+                                     scene_code.c_str(),
+                                     trace_code.c_str(),
+                                     shader_code.c_str()};
+        const auto shader =
+            create_shader(GL_COMPUTE_SHADER, std::size(sources), sources);
+        return create_program(shader.get());
+    };
+
+    Wavefront_programs programs {};
+    programs.generate = create_stage("#define WAVEFRONT_GENERATE\n");
+    programs.intersect = create_stage("#define WAVEFRONT_INTERSECT\n");
+    for (std::size_t i {0}; i < programs.shade.size(); ++i)
+    {
+        programs.shade[i] =
+            create_stage("#define WAVEFRONT_SHADE\n#define SHADE_MATERIAL " +
+                         std::to_string(i) + '\n');
+        programs.loc_shade_ray_queue[i] =
+            glGetUniformLocation(programs.shade[i].get(), "ray_queue");
+    }
+    programs.accumulate = create_stage("#define WAVEFRONT_ACCUMULATE\n");
+    programs.prepare = create_stage("#define WAVEFRONT_PREPARE\n");
+
+    programs.loc_wave_index =
+        glGetUniformLocation(programs.generate.get(), "wave_index");
+    programs.loc_intersect_ray_queue =
+        glGetUniformLocation(programs.intersect.get(), "ray_queue");
+    programs.loc_consumed_queues =
+        glGetUniformLocation(programs.prepare.get(), "consumed_queues");
+    const auto kernels = trace_uniform_programs(programs);
+    for (std::size_t i {0}; i < kernels.size(); ++i)
+    {
+        const auto program = kernels[i];
+        programs.loc_trace_uniforms[i] = {
+            .sample_index = glGetUniformLocation(program, "sample_index"),
+            .samples_per_frame =
+                glGetUniformLocation(program, "samples_per_frame"),
+            .first_sample = glGetUniformLocation(program, "first_sample"),
+            .error_threshold = glGetUniformLocation(program, "error_threshold"),
+            .view_position = glGetUniformLocation(program, "view_position"),
+            .view_size = glGetUniformLocation(program, "view_size"),
+            .image_size = glGetUniformLocation(program, "image_size"),
+            .tile_offset = glGetUniformLocation(program, "tile_offset"),
+            .tile_size = glGetUniformLocation(program, "tile_size")};
+    }
+
+    return programs;
+}
 #endif
 
-[[nodiscard]] auto create_trace_graphics_program(const char *glsl_version,
-                                                 const Scene &scene)
+// The scene_declarations are inserted between scene.glsl and trace.glsl
+[[nodiscard]] auto
+create_trace_graphics_program(const char *glsl_version,
+                              Accelerator accelerator,
+                              const std::string &scene_declarations)
 {
     const auto vertex_shader_code = read_file("shaders/fullscreen.vert");
     const char *const vertex_shader_sources[] {
@@ -606,15 +990,18 @@ create_shader(GLenum type, std::size_t size, const char *const code[])
                                              std::size(vertex_shader_sources),
                                              vertex_shader_sources);
 
+    const auto scene_code = read_file("shaders/scene.glsl");
     const auto fragment_shader_code = read_file("shaders/trace.glsl");
     std::ostringstream header;
-    header << glsl_version << '\n'
-           << "#define MATERIAL_COUNT " << scene.materials.size() << '\n'
-           << "#define CIRCLE_COUNT " << scene.circles.size() << '\n'
-           << "#define LINE_COUNT " << scene.lines.size() << '\n'
-           << "#define ARC_COUNT " << scene.arcs.size() << '\n';
+    header << glsl_version << '\n';
+#ifdef NO_STORAGE_BUFFER
+    header << "#define NO_STORAGE_BUFFER\n";
+#endif
+    header << accelerator_define(accelerator);
     const auto header_str = header.str();
     const char *const fragment_shader_sources[] {header_str.c_str(),
+                                                 scene_code.c_str(),
+                                                 scene_declarations.c_str(),
                                                  fragment_shader_code.c_str()};
     const auto fragment_shader =
         create_shader(GL_FRAGMENT_SHADER,
@@ -635,6 +1022,30 @@ create_shader(GLenum type, std::size_t size, const char *const code[])
 
     return create_program(shader.get());
 }
+
+[[nodiscard]] auto create_reduce_program(const char *glsl_version,
+                                         bool final_pass)
+{
+    const auto shader_code = read_file("shaders/reduce.glsl");
+    const char *const sources[] {
+        glsl_version,
+        final_pass ? "\n#define FINAL_PASS\n" : "\n",
+        shader_code.c_str()};
+    const auto shader =
+        create_shader(GL_COMPUTE_SHADER, std::size(sources), sources);
+
+    return create_program(shader.get());
+}
+
+[[nodiscard]] auto create_resolve_program(const char *glsl_version)
+{
+    const auto shader_code = read_file("shaders/resolve.glsl");
+    const char *const sources[] {glsl_version, "\n", shader_code.c_str()};
+    const auto shader =
+        create_shader(GL_COMPUTE_SHADER, std::size(sources), sources);
+
+    return create_program(shader.get());
+}
 #endif
 
 [[nodiscard]] auto
@@ -666,7 +1077,10 @@ create_graphics_program(const char *glsl_version,
         glsl_version, "shaders/fullscreen.vert", "shaders/post.glsl");
 }
 
-[[nodiscard]] auto create_accumulation_texture(GLsizei width, GLsizei height)
+[[nodiscard]] auto create_float_texture(GLsizei width,
+                                        GLsizei height,
+                                        GLint internal_format,
+                                        GLenum format)
 {
     auto texture = create_object(glGenTextures, glDeleteTextures);
 
@@ -677,11 +1091,11 @@ create_graphics_program(const char *glsl_version,
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexImage2D(GL_TEXTURE_2D,
                  0,
-                 GL_RGBA32F,
+                 internal_format,
                  width,
                  height,
                  0,
-                 GL_RGBA,
+                 format,
                  GL_FLOAT,
                  nullptr);
     glBindTexture(GL_TEXTURE_2D, 0);
@@ -764,94 +1178,335 @@ create_graphics_program(const char *glsl_version,
     return fbo;
 }
 
-[[nodiscard]] auto create_vertex_index_buffers(const Raster_geometry &geometry)
+struct Instance_attribute
 {
-    auto vao = create_object(glGenVertexArrays, glDeleteVertexArrays);
-    glBindVertexArray(vao.get());
+    GLuint location;
+    GLint size;
+    std::size_t offset;
+};
 
+// Creates a vertex array reading all its attributes once per instance from a
+// single buffer of T
+template <typename T>
+[[nodiscard]] auto
+create_instance_buffer(std::initializer_list<Instance_attribute> attributes)
+{
+    auto vao = create_object(glGenVertexArrays, glDeleteVertexArrays);
     auto vbo = create_object(glGenBuffers, glDeleteBuffers);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo.get());
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        static_cast<GLsizei>(geometry.vertices.size() * sizeof(Vertex)),
-        geometry.vertices.data(),
-        GL_DYNAMIC_DRAW);
-
-    auto ibo = create_object(glGenBuffers, glDeleteBuffers);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo.get());
-    glBufferData(
-        GL_ELEMENT_ARRAY_BUFFER,
-        static_cast<GLsizei>(geometry.indices.size() * sizeof(std::uint32_t)),
-        geometry.indices.data(),
-        GL_STATIC_DRAW);
-
-    glVertexAttribPointer(0,
-                          sizeof(Vertex::position) / sizeof(float),
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          reinterpret_cast<void *>(offsetof(Vertex, position)));
-    glVertexAttribPointer(1,
-                          sizeof(Vertex::local) / sizeof(float),
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          reinterpret_cast<void *>(offsetof(Vertex, local)));
-    glVertexAttribPointer(2,
-                          sizeof(Vertex::color) / sizeof(float),
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          reinterpret_cast<void *>(offsetof(Vertex, color)));
-    glEnableVertexAttribArray(0);
-    glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
 
+    glBindVertexArray(vao.get());
+    glBindBuffer(GL_ARRAY_BUFFER, vbo.get());
+    for (const auto &attribute : attributes)
+    {
+        glVertexAttribPointer(attribute.location,
+                              attribute.size,
+                              GL_FLOAT,
+                              GL_FALSE,
+                              sizeof(T),
+                              reinterpret_cast<void *>(attribute.offset));
+        glVertexAttribDivisor(attribute.location, 1);
+        glEnableVertexAttribArray(attribute.location);
+    }
     glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    return std::tuple {std::move(vao), std::move(vbo), std::move(ibo)};
+    return std::pair {std::move(vao), std::move(vbo)};
 }
 
-void update_vertex_buffer(GLuint vao,
-                          GLuint vbo,
-                          const Raster_geometry &geometry)
+// (Re-)specifies an instance buffer, for a geometry with a different number of
+// primitives
+template <typename T>
+void upload_instances(GLuint vbo, const std::vector<T> &instances)
 {
-    glBindVertexArray(vao);
-
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferSubData(
-        GL_ARRAY_BUFFER,
-        0,
-        static_cast<GLsizei>(geometry.vertices.size() * sizeof(Vertex)),
-        geometry.vertices.data());
+    glBufferData(GL_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(instances.size() * sizeof(T)),
+                 instances.data(),
+                 GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-    glBindVertexArray(0);
+constexpr void mark_dirty(Dirty_range &range, std::size_t index) noexcept
+{
+    if (range.begin >= range.end)
+    {
+        range = {index, index + 1};
+    }
+    else
+    {
+        range.begin = std::min(range.begin, index);
+        range.end = std::max(range.end, index + 1);
+    }
 }
 
+// Updates the elements of the buffer in the given range. Small updates are
+// cheap for the driver to pipeline, unlike re-specifying the whole buffer.
+template <typename T>
+void upload_range(GLenum target,
+                  GLuint buffer,
+                  const std::vector<T> &data,
+                  const Dirty_range &range)
+{
+    if (range.begin >= range.end)
+    {
+        return;
+    }
+    glBindBuffer(target, buffer);
+    glBufferSubData(target,
+                    static_cast<GLintptr>(range.begin * sizeof(T)),
+                    static_cast<GLsizeiptr>((range.end - range.begin) *
+                                            sizeof(T)),
+                    data.data() + range.begin);
+    glBindBuffer(target, 0);
+}
+
+// An array of scene data, read in trace.glsl through the accessor function
+struct Scene_array
+{
+    const char *block_name;
+    const char *array_name;
+    const char *type_name;
+    const char *accessor_name;
+    const void *data;
+    std::size_t element_size;
+    std::size_t size;
+    GLuint buffer;
+    // Number of elements the buffer and the shader declarations are sized for
+    std::size_t capacity;
+    // Maximum number of elements per uniform block, without storage buffers
+    std::size_t chunk_size;
+};
+
 template <typename T>
-[[nodiscard]] auto create_uniform_buffer(const std::vector<T> &data)
+[[nodiscard]] Scene_array make_scene_array(const char *block_name,
+                                           const char *array_name,
+                                           const char *type_name,
+                                           const char *accessor_name,
+                                           const std::vector<T> &data,
+                                           GLuint buffer)
+{
+    return {.block_name = block_name,
+            .array_name = array_name,
+            .type_name = type_name,
+            .accessor_name = accessor_name,
+            .data = data.data(),
+            .element_size = sizeof(T),
+            .size = data.size(),
+            .buffer = buffer,
+            .capacity = data.size(),
+            .chunk_size = 0};
+}
+
+// Packs the values four per uvec4, as std140 would otherwise pad each of them
+// to 16 bytes
+[[nodiscard]] std::vector<std::array<std::uint32_t, 4>>
+pack_uvec4(const std::vector<std::uint32_t> &values)
+{
+    std::vector<std::array<std::uint32_t, 4>> packed((values.size() + 3) / 4);
+    for (std::size_t i {0}; i < values.size(); ++i)
+    {
+        packed[i / 4][i % 4] = values[i];
+    }
+    return packed;
+}
+
+// Sets the USE_GRID uniforms of trace.glsl, which the program must be using
+void set_grid_uniforms(GLuint program, const Grid &grid)
+{
+    glUniform2f(glGetUniformLocation(program, "grid_origin"),
+                grid.origin.x,
+                grid.origin.y);
+    glUniform2f(glGetUniformLocation(program, "grid_cell_size"),
+                grid.cell_size.x,
+                grid.cell_size.y);
+    glUniform2ui(
+        glGetUniformLocation(program, "grid_size"), grid.width, grid.height);
+}
+
+#ifndef NO_STORAGE_BUFFER
+constexpr GLenum scene_buffer_target {GL_SHADER_STORAGE_BUFFER};
+#else
+constexpr GLenum scene_buffer_target {GL_UNIFORM_BUFFER};
+#endif
+
+// Re-specifies the whole buffer storage rather than updating it, so that the
+// driver does not have to wait for draws still reading the previous scene.
+// Elements are at the same offsets whether or not the array is split into
+// uniform chunks, so edits can then be uploaded with upload_range.
+void upload_scene_array(const Scene_array &array)
+{
+    glBindBuffer(scene_buffer_target, array.buffer);
+    glBufferData(scene_buffer_target,
+                 static_cast<GLsizeiptr>(array.capacity * array.element_size),
+                 nullptr,
+                 GL_DYNAMIC_DRAW);
+    glBufferSubData(scene_buffer_target,
+                    0,
+                    static_cast<GLsizeiptr>(array.size * array.element_size),
+                    array.data);
+    glBindBuffer(scene_buffer_target, 0);
+}
+
+#ifndef NO_STORAGE_BUFFER
+
+void bind_storage_buffers(GLuint program,
+                          const std::vector<Scene_array> &arrays)
+{
+    GLint max_block_size {};
+    glGetIntegerv(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &max_block_size);
+
+    for (std::size_t i {0}; i < arrays.size(); ++i)
+    {
+        const auto &array = arrays[i];
+        const auto data_size = array.size * array.element_size;
+        if (data_size > static_cast<std::size_t>(max_block_size))
+        {
+            std::ostringstream oss;
+            oss << "Storage buffer too big (" << data_size << "B > "
+                << max_block_size << "B)";
+            throw std::runtime_error(oss.str());
+        }
+
+        const auto binding = static_cast<GLuint>(i + 1);
+        const auto block_index = glGetProgramResourceIndex(
+            program, GL_SHADER_STORAGE_BLOCK, array.block_name);
+        // Some wavefront kernels do not read every array
+        if (block_index != GL_INVALID_INDEX)
+        {
+            glShaderStorageBlockBinding(program, block_index, binding);
+        }
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, array.buffer);
+    }
+}
+
+#else
+
+[[nodiscard]] constexpr std::size_t
+num_uniform_chunks(const Scene_array &array) noexcept
 {
-    auto ubo = create_object(glGenBuffers, glDeleteBuffers);
+    return (array.capacity + array.chunk_size - 1) / array.chunk_size;
+}
 
-    glBindBuffer(GL_UNIFORM_BUFFER, ubo.get());
+// Uniform block arrays have a fixed size in the shader. Rounding it up to a
+// power of two means most scene edits do not require a new program, since the
+// actual counts are passed as uniforms.
+//
+// The arrays are then split into as many uniform blocks as required by the
+// size limit of a single block. Each chunk is bound to a range of the same
+// buffer, so chunks must start at a multiple of the offset alignment.
+void split_uniform_arrays(std::vector<Scene_array> &arrays)
+{
+    GLint max_block_size {};
+    GLint offset_alignment {};
+    GLint max_blocks {};
+    glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &max_block_size);
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+    glGetIntegerv(GL_MAX_FRAGMENT_UNIFORM_BLOCKS, &max_blocks);
+
+    std::size_t num_blocks {0};
+    for (auto &array : arrays)
+    {
+        const auto step = std::lcm(
+            array.element_size, static_cast<std::size_t>(offset_alignment));
+        array.chunk_size = static_cast<std::size_t>(max_block_size) / step *
+                           step / array.element_size;
+        assert(array.chunk_size > 0);
+        array.capacity = std::bit_ceil(std::max(array.size, std::size_t {1}));
+        if (array.capacity > array.chunk_size)
+        {
+            array.capacity = (array.size + array.chunk_size - 1) /
+                             array.chunk_size * array.chunk_size;
+        }
+        num_blocks += num_uniform_chunks(array);
+    }
 
-    const auto data_size = data.size() * sizeof(T);
-    if (data_size > max_ubo_size)
+    if (num_blocks > static_cast<std::size_t>(max_blocks))
     {
         std::ostringstream oss;
-        oss << "Uniform buffer too big (" << data_size << "B > " << max_ubo_size
-            << "B)";
+        oss << "Scene too big for uniform buffers (" << num_blocks
+            << " blocks of " << max_block_size << "B > " << max_blocks
+            << " blocks)";
         throw std::runtime_error(oss.str());
     }
+}
+
+[[nodiscard]] std::string
+uniform_chunk_name(const char *name, std::size_t chunk, std::size_t num_chunks)
+{
+    if (num_chunks == 1)
+    {
+        return name;
+    }
+    std::ostringstream oss;
+    oss << name << '_' << chunk;
+    return oss.str();
+}
+
+// Declares the uniform blocks of each array, and its accessor which selects
+// the right block for a given index.
+void write_uniform_arrays(std::ostream &os,
+                          const std::vector<Scene_array> &arrays)
+{
+    for (const auto &array : arrays)
+    {
+        const auto num_chunks = num_uniform_chunks(array);
+        for (std::size_t i {0}; i < num_chunks; ++i)
+        {
+            const auto chunk_size = std::min(
+                array.chunk_size, array.capacity - i * array.chunk_size);
+            os << "layout(std140) uniform "
+               << uniform_chunk_name(array.block_name, i, num_chunks) << " { "
+               << array.type_name << ' '
+               << uniform_chunk_name(array.array_name, i, num_chunks) << '['
+               << chunk_size << "]; };\n";
+        }
 
-    glBufferData(GL_UNIFORM_BUFFER,
-                 static_cast<GLsizeiptr>(data_size),
-                 data.data(),
-                 GL_STATIC_DRAW);
+        os << array.type_name << ' ' << array.accessor_name << "(int i)\n{\n";
+        for (std::size_t i {0}; i < num_chunks; ++i)
+        {
+            os << "    ";
+            if (i + 1 < num_chunks)
+            {
+                os << "if (i < " << (i + 1) * array.chunk_size << ") ";
+            }
+            os << "return "
+               << uniform_chunk_name(array.array_name, i, num_chunks) << "[i - "
+               << i * array.chunk_size << "];\n";
+        }
+        os << "}\n";
+    }
+}
 
-    return ubo;
+void bind_uniform_buffers(GLuint program,
+                          const std::vector<Scene_array> &arrays)
+{
+    GLuint binding {1};
+    for (const auto &array : arrays)
+    {
+        const auto num_chunks = num_uniform_chunks(array);
+        for (std::size_t i {0}; i < num_chunks; ++i)
+        {
+            const auto offset = i * array.chunk_size;
+            const auto chunk_size =
+                std::min(array.chunk_size, array.capacity - offset);
+            const auto block_name =
+                uniform_chunk_name(array.block_name, i, num_chunks);
+            const auto block_index =
+                glGetUniformBlockIndex(program, block_name.c_str());
+            glUniformBlockBinding(program, block_index, binding);
+            glBindBufferRange(
+                GL_UNIFORM_BUFFER,
+                binding,
+                array.buffer,
+                static_cast<GLintptr>(offset * array.element_size),
+                static_cast<GLsizeiptr>(chunk_size * array.element_size));
+            ++binding;
+        }
+    }
 }
 
+#endif
+
 [[nodiscard]] constexpr unsigned int align_up(unsigned int value,
                                               unsigned int alignment) noexcept
 {
@@ -859,44 +1514,173 @@ template <typename T>
     return (value + (alignment - 1)) & ~(alignment - 1);
 }
 
+// Keeps the horizontal extent of the saved view, but matches the aspect ratio
+// of the image so that it is not stretched.
+void match_view_aspect_ratio(Scene &scene, int width, int height)
+{
+    scene.view_height = scene.view_width * static_cast<float>(height) /
+                        static_cast<float>(width);
+}
+
 #ifndef __EMSCRIPTEN__
-void save_as_png(const char *file_name, int width, int height, GLuint texture)
+void write_png(const char *file_name,
+               int width,
+               int height,
+               std::span<const std::uint8_t> pixels)
 {
     std::cout << "Saving " << width << " x " << height << " image to \""
               << file_name << "\"\n";
 
     constexpr int channels {4};
-    const auto horizontal_size =
-        static_cast<std::size_t>(width) * static_cast<std::size_t>(channels);
-    const auto vertical_size = static_cast<std::size_t>(height);
+    const auto stride = width * channels;
+
+    // The OpenGL image origin is in the bottom-left corner, so the image is
+    // flipped vertically by encoding the rows from the last one with a
+    // negative stride
+    const auto *const last_row =
+        pixels.data() +
+        static_cast<std::size_t>(height - 1) * static_cast<std::size_t>(stride);
+    const auto write_result = stbi_write_png(
+        file_name, width, height, channels, last_row, -stride);
+    if (write_result == 0)
+    {
+        std::ostringstream message;
+        message << "Failed to write PNG image to \"" << file_name << '\"';
+        throw std::runtime_error(message.str());
+    }
+}
 
-    std::vector<std::uint8_t> pixels(horizontal_size * vertical_size);
+void save_as_png(const char *file_name, int width, int height, GLuint texture)
+{
+    std::vector<std::uint8_t> pixels(static_cast<std::size_t>(width) *
+                                     static_cast<std::size_t>(height) * 4);
 
-    glFinish();
+    // Without a pixel pack buffer, the read back waits for the rendering
     glBindTexture(GL_TEXTURE_2D, texture);
     glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
     glBindTexture(GL_TEXTURE_2D, 0);
 
-    // Flip the image vertically since the OpenGL image origin is in the
-    // bottom-left corner.
-    std::vector<std::uint8_t> tmp_row(horizontal_size);
-    for (std::size_t i {0}; i < vertical_size / 2; ++i)
+    write_png(file_name, width, height, pixels);
+}
+
+// Writes the accumulation image, stored row by row starting from the bottom
+void write_exr(const std::filesystem::path &path,
+               int width,
+               int height,
+               unsigned int samples,
+               std::span<const vec4> accumulation)
+{
+    std::cout << "Saving " << width << " x " << height << " HDR image to \""
+              << path.string() << "\"\n";
+
+    Exr_writer writer(path, width, height, samples);
+    const auto row_size = static_cast<std::size_t>(width);
+    for (std::size_t y {0}; y < static_cast<std::size_t>(height); ++y)
     {
-        auto *const top = &pixels[i * horizontal_size];
-        auto *const bottom = &pixels[(vertical_size - 1 - i) * horizontal_size];
-        std::memcpy(tmp_row.data(), top, horizontal_size);
-        std::memcpy(top, bottom, horizontal_size);
-        std::memcpy(bottom, tmp_row.data(), horizontal_size);
+        writer.write_row(accumulation.subspan(y * row_size, row_size));
     }
+    writer.close();
+}
 
-    const auto write_result = stbi_write_png(
-        file_name, width, height, channels, pixels.data(), width * channels);
-    if (write_result == 0)
+[[nodiscard]] Scene load_render_scene(const Render_options &options)
+{
+    if (options.scene_path.empty())
+    {
+        return create_scene(options.width, options.height);
+    }
+
+    auto scene = load_scene(options.scene_path);
+    if (!scene.has_value())
     {
         std::ostringstream message;
-        message << "Failed to write PNG image to \"" << file_name << '\"';
+        message << "Failed to load scene \"" << options.scene_path.string()
+                << "\": " << scene.error();
         throw std::runtime_error(message.str());
     }
+
+    match_view_aspect_ratio(*scene, options.width, options.height);
+
+    return *std::move(scene);
+}
+
+// Combines the partial renders saved by the workers sharing the directory,
+// each pixel weighted by its number of samples.
+void merge_partial_renders(const std::filesystem::path &directory,
+                           const std::string &output_file_name,
+                           const std::filesystem::path &hdr_output_path)
+{
+    std::vector<std::filesystem::path> paths;
+    for (const auto &entry : std::filesystem::directory_iterator(directory))
+    {
+        const auto file_name = entry.path().filename().string();
+        if (entry.is_regular_file() && file_name.starts_with("worker_") &&
+            entry.path().extension() == ".ckpt")
+        {
+            paths.push_back(entry.path());
+        }
+    }
+    if (paths.empty())
+    {
+        throw std::runtime_error("No partial render to merge in \"" +
+                                 directory.string() + '\"');
+    }
+    std::ranges::sort(paths);
+
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> sample_ranges;
+    std::optional<Checkpoint> merged {};
+    for (const auto &path : paths)
+    {
+        auto partial = read_checkpoint(path);
+        // In 64 bits, since the 32-bit sample indices of the shaders would
+        // wrap around and repeat the first samples
+        const std::uint64_t first {partial.info.first_sample};
+        const auto last = first + partial.info.sample_index;
+        if (last > std::uint64_t {std::numeric_limits<unsigned int>::max()} + 1)
+        {
+            throw std::runtime_error("Partial render \"" + path.string() +
+                                     "\" wraps around the sample indices");
+        }
+        for (const auto &[other_first, other_last] : sample_ranges)
+        {
+            // Overlapping samples are the same samples, and would be counted
+            // twice
+            if (first < other_last && other_first < last)
+            {
+                throw std::runtime_error("Partial render \"" + path.string() +
+                                         "\" repeats samples of another");
+            }
+        }
+        sample_ranges.emplace_back(first, last);
+        std::cout << path.filename().string() << ": samples " << first
+                  << " to " << last << '\n';
+
+        if (merged.has_value())
+        {
+            merge_checkpoint(*merged, partial);
+        }
+        else
+        {
+            merged = std::move(partial);
+        }
+    }
+
+    std::cout << "Merged " << paths.size() << " partial renders, "
+              << merged->info.sample_index << " samples\n";
+    if (!hdr_output_path.empty())
+    {
+        write_exr(hdr_output_path,
+                  merged->info.width,
+                  merged->info.height,
+                  merged->info.sample_index,
+                  merged->accumulation);
+    }
+    auto pixels = tone_map({.width = merged->info.width,
+                            .height = merged->info.height,
+                            .pixels = std::move(merged->accumulation)});
+    write_png(output_file_name.c_str(),
+              merged->info.width,
+              merged->info.height,
+              pixels);
 }
 #endif
 
@@ -911,138 +1695,177 @@ void save_as_png(const char *file_name, int width, int height, GLuint texture)
     return world_center + (u - 0.5f) * world_size;
 }
 
-void create_raster_geometry(const Scene &scene,
-                            float thickness,
-                            Raster_geometry &geometry)
-{
-    geometry.vertices.clear();
-    geometry.indices.clear();
-
-    thickness *= scene.view_height;
-
-    geometry.circle_indices_offset = geometry.indices.size();
-    for (const auto &circle : scene.circles)
-    {
-        const auto half_side = circle.radius + 0.5f * thickness;
-        const auto bottom_left = circle.center + vec2 {-half_side, -half_side};
-        const auto bottom_right = circle.center + vec2 {half_side, -half_side};
-        const auto top_right = circle.center + vec2 {half_side, half_side};
-        const auto top_left = circle.center + vec2 {-half_side, half_side};
-        const auto rel_thickness = thickness / half_side;
-
-        const auto color = scene.materials[circle.material_id].color;
-        const auto first_index =
-            static_cast<std::uint32_t>(geometry.vertices.size());
-        geometry.vertices.push_back(
-            {bottom_left, {-1.0, -1.0f, rel_thickness, 0.0f}, color});
-        geometry.vertices.push_back(
-            {bottom_right, {1.0f, -1.0f, rel_thickness, 0.0f}, color});
-        geometry.vertices.push_back(
-            {top_right, {1.0f, 1.0f, rel_thickness, 0.0f}, color});
-        geometry.vertices.push_back(
-            {top_left, {-1.0f, 1.0f, rel_thickness, 0.0f}, color});
-        geometry.indices.push_back(first_index + 0);
-        geometry.indices.push_back(first_index + 1);
-        geometry.indices.push_back(first_index + 2);
-        geometry.indices.push_back(first_index + 0);
-        geometry.indices.push_back(first_index + 2);
-        geometry.indices.push_back(first_index + 3);
-    }
-    geometry.circle_indices_size =
-        geometry.indices.size() - geometry.circle_indices_offset;
-
-    geometry.line_indices_offset = geometry.indices.size();
-    for (const auto &line : scene.lines)
-    {
-        const auto line_vec = line.b - line.a;
-        const auto line_length = norm(line_vec);
-        const auto line_dir = line_vec * (1.0f / line_length);
-        const auto delta_left =
-            vec2 {-line_dir.y, line_dir.x} * (thickness * 0.5f);
-        const auto delta_up = line_dir * (thickness * 0.5f);
-        const auto start_left = line.a + delta_left - delta_up;
-        const auto start_right = line.a - delta_left - delta_up;
-        const auto end_left = line.b + delta_left + delta_up;
-        const auto end_right = line.b - delta_left + delta_up;
-        const auto aspect_ratio = line_length / thickness;
-
-        const auto color = scene.materials[line.material_id].color;
-        const auto first_index =
-            static_cast<std::uint32_t>(geometry.vertices.size());
-        geometry.vertices.push_back(
-            {start_left, {-0.5f, 0.5f, -aspect_ratio - 0.5f, 0.0f}, color});
-        geometry.vertices.push_back(
-            {start_right, {0.5f, 0.5f, -aspect_ratio - 0.5f, 0.0f}, color});
-        geometry.vertices.push_back(
-            {end_right, {0.5f, -aspect_ratio - 0.5f, 0.5f, 0.0f}, color});
-        geometry.vertices.push_back(
-            {end_left, {-0.5f, -aspect_ratio - 0.5f, 0.5f, 0.0f}, color});
-        geometry.indices.push_back(first_index + 0);
-        geometry.indices.push_back(first_index + 1);
-        geometry.indices.push_back(first_index + 2);
-        geometry.indices.push_back(first_index + 0);
-        geometry.indices.push_back(first_index + 2);
-        geometry.indices.push_back(first_index + 3);
-    }
-    geometry.line_indices_size =
-        geometry.indices.size() - geometry.line_indices_offset;
-
-    geometry.arc_indices_offset = geometry.indices.size();
-    for (const auto &arc : scene.arcs)
-    {
-        const auto half_side = arc.radius + 0.5f * thickness;
-        const auto bottom_y = arc.b - 0.5f * thickness;
-        const auto dir = arc.a;
-        const auto left = vec2 {-dir.y, dir.x};
-        const auto bottom_left = arc.center + dir * bottom_y + left * half_side;
-        const auto bottom_right =
-            arc.center + dir * bottom_y - left * half_side;
-        const auto top_right = arc.center + (dir - left) * half_side;
-        const auto top_left = arc.center + (dir + left) * half_side;
-        const auto rel_thickness = thickness / half_side;
-        const auto cutoff = arc.b / half_side;
-        const auto bottom_coord = bottom_y / half_side;
-
-        const auto color = scene.materials[arc.material_id].color;
-        const auto first_index =
-            static_cast<std::uint32_t>(geometry.vertices.size());
-        geometry.vertices.push_back(
-            {bottom_left, {-1.0, bottom_coord, rel_thickness, cutoff}, color});
-        geometry.vertices.push_back(
-            {bottom_right, {1.0f, bottom_coord, rel_thickness, cutoff}, color});
-        geometry.vertices.push_back(
-            {top_right, {1.0f, 1.0f, rel_thickness, cutoff}, color});
-        geometry.vertices.push_back(
-            {top_left, {-1.0f, 1.0f, rel_thickness, cutoff}, color});
-        geometry.indices.push_back(first_index + 0);
-        geometry.indices.push_back(first_index + 1);
-        geometry.indices.push_back(first_index + 2);
-        geometry.indices.push_back(first_index + 0);
-        geometry.indices.push_back(first_index + 2);
-        geometry.indices.push_back(first_index + 3);
-    }
-    geometry.arc_indices_size =
-        geometry.indices.size() - geometry.arc_indices_offset;
+[[nodiscard]] Circle_instance make_instance(const Scene &scene,
+                                           const Circle &circle)
+{
+    return {circle.center,
+            circle.radius,
+            scene.materials[circle.material_id].color};
 }
 
-void Application::init()
+[[nodiscard]] Line_instance make_instance(const Scene &scene,
+                                         const Line &line)
 {
-    glfwSetErrorCallback(&glfw_error_callback);
+    return {line.a, line.b, scene.materials[line.material_id].color};
+}
 
-    if (!glfwInit())
-    {
-        throw std::runtime_error("Failed to initialize GLFW");
-    }
+[[nodiscard]] Arc_instance make_instance(const Scene &scene, const Arc &arc)
+{
+    return {arc.center,
+            arc.radius,
+            arc.b,
+            arc.a,
+            scene.materials[arc.material_id].color};
+}
+
+template <typename T, typename I>
+void make_instances(const Scene &scene,
+                    const std::vector<T> &primitives,
+                    std::vector<I> &instances)
+{
+    instances.clear();
+    instances.reserve(primitives.size());
+    for (const auto &primitive : primitives)
+    {
+        instances.push_back(make_instance(scene, primitive));
+    }
+}
+
+// There is one instance per primitive, at the same index as in the scene
+void create_raster_geometry(const Scene &scene, Raster_geometry &geometry)
+{
+    make_instances(scene, scene.circles, geometry.circles);
+    make_instances(scene, scene.lines, geometry.lines);
+    make_instances(scene, scene.arcs, geometry.arcs);
+}
+
+// Regenerates the instances of the primitives in the dirty range
+template <typename T, typename I>
+void update_instances(const Scene &scene,
+                      const std::vector<T> &primitives,
+                      const Dirty_range &range,
+                      std::vector<I> &instances)
+{
+    for (auto i = range.begin; i < range.end; ++i)
+    {
+        instances[i] = make_instance(scene, primitives[i]);
+    }
+}
+
+[[nodiscard]] float distance_to_segment(const vec2 &p,
+                                        const vec2 &a,
+                                        const vec2 &b) noexcept
+{
+    const auto ab = b - a;
+    const auto length2 = dot(ab, ab);
+    const auto u =
+        length2 > 0.0f ? std::clamp(dot(p - a, ab) / length2, 0.0f, 1.0f)
+                       : 0.0f;
+    return norm(p - (a + ab * u));
+}
+
+// Returns a reference (see make_primitive_ref) to the primitive closest to the
+// point, if any is within the given distance of it.
+[[nodiscard]] std::optional<std::uint32_t>
+pick_primitive(const Scene &scene, const vec2 &point, float max_distance)
+{
+    std::optional<std::uint32_t> closest {};
+    auto closest_distance = max_distance;
+    const auto consider = [&](float distance, std::uint32_t ref)
+    {
+        if (distance <= closest_distance)
+        {
+            closest_distance = distance;
+            closest = ref;
+        }
+    };
+
+    for (std::size_t i {0}; i < scene.circles.size(); ++i)
+    {
+        const auto &circle = scene.circles[i];
+        consider(
+            std::abs(norm(point - circle.center) - std::abs(circle.radius)),
+            make_primitive_ref(Geometry_type::circle, i));
+    }
+    for (std::size_t i {0}; i < scene.lines.size(); ++i)
+    {
+        const auto &line = scene.lines[i];
+        consider(distance_to_segment(point, line.a, line.b),
+                 make_primitive_ref(Geometry_type::line, i));
+    }
+    for (std::size_t i {0}; i < scene.arcs.size(); ++i)
+    {
+        // Only the part of the circle covered by the arc can be picked
+        const auto &arc = scene.arcs[i];
+        if (dot(arc.a, point - arc.center) >= arc.b)
+        {
+            consider(std::abs(norm(point - arc.center) - std::abs(arc.radius)),
+                     make_primitive_ref(Geometry_type::arc, i));
+        }
+    }
+
+    return closest;
+}
+
+void move_primitive(Scene &scene,
+                    std::uint32_t ref,
+                    const vec2 &offset,
+                    Scene_edits &edits)
+{
+    const auto index = primitive_ref_index(ref);
+    switch (primitive_ref_type(ref))
+    {
+    case Geometry_type::circle:
+        scene.circles[index].center += offset;
+        mark_dirty(edits.circles, index);
+        break;
+    case Geometry_type::line:
+        scene.lines[index].a += offset;
+        scene.lines[index].b += offset;
+        mark_dirty(edits.lines, index);
+        break;
+    case Geometry_type::arc:
+        scene.arcs[index].center += offset;
+        mark_dirty(edits.arcs, index);
+        break;
+    case Geometry_type::none: break;
+    }
+}
+
+// Copies the edited Scene primitives of one type to the compiled scene and to
+// the primitive stream, and marks them in the range of the stream to upload.
+// The range may also contain unchanged primitives, since the stream is not in
+// the same order as the Scene.
+void compile_edits(const Scene &scene,
+                   Geometry_type type,
+                   const Dirty_range &edits,
+                   Compiled_scene &compiled,
+                   Gpu_primitives &gpu_primitives,
+                   Dirty_range &stream_range)
+{
+    for (auto i = edits.begin; i < edits.end; ++i)
+    {
+        const auto slot = update_compiled_primitive(compiled, scene, type, i);
+        mark_dirty(stream_range,
+                   update_gpu_primitive(gpu_primitives, compiled, type, slot));
+    }
+}
+
+void Application::init_context(bool visible)
+{
+    glfwSetErrorCallback(&glfw_error_callback);
+
+    if (!glfwInit())
+    {
+        throw std::runtime_error("Failed to initialize GLFW");
+    }
     glfw_context = decltype(glfw_context)(true);
 
 #ifdef __EMSCRIPTEN__
-    // WebGL 2.0
-    constexpr auto glsl_version = "#version 300 es";
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
     glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
 #else
-    constexpr auto glsl_version = "#version 430 core";
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_API);
@@ -1051,6 +1874,9 @@ void Application::init()
     glfwWindowHint(GLFW_CONTEXT_DEBUG, GLFW_TRUE);
 #endif
     glfwWindowHint(GLFW_SAMPLES, 0);
+    // NOTE: a hidden window is the most portable way to get an OpenGL context
+    // with GLFW; nothing is ever presented to it in headless mode.
+    glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
 
     auto *const window_ptr =
         glfwCreateWindow(1280, 720, "Caustics", nullptr, nullptr);
@@ -1077,7 +1903,7 @@ void Application::init()
                            &window_state.framebuffer_width,
                            &window_state.framebuffer_height);
 
-    glfwSwapInterval(1);
+    glfwSwapInterval(visible ? 1 : 0);
 
     load_gl_functions();
 
@@ -1125,6 +1951,452 @@ void Application::init()
         auto_workload = true;
     }
 #endif
+}
+
+void Application::init_renderer()
+{
+    tile_x = 0;
+    tile_y = 0;
+    tile_width = texture_width;
+    tile_height = texture_height;
+
+    accumulation_texture = create_float_texture(
+        texture_width, texture_height, GL_RGBA32F, GL_RGBA);
+#ifndef NO_COMPUTE_SHADER
+    glBindImageTexture(0,
+                       accumulation_texture.get(),
+                       0,
+                       GL_FALSE,
+                       0,
+                       GL_READ_WRITE,
+                       GL_RGBA32F);
+
+    moment_texture = create_float_texture(
+        texture_width, texture_height, GL_R32F, GL_RED);
+    glBindImageTexture(
+        1, moment_texture.get(), 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
+#endif
+
+    target_texture = create_target_texture(texture_width, texture_height);
+#ifndef NO_COMPUTE_SHADER
+    glBindImageTexture(
+        5, target_texture.get(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+#endif
+
+#ifdef NO_COMPUTE_SHADER
+    empty_vao = create_object(glGenVertexArrays, glDeleteVertexArrays);
+#endif
+
+#ifndef NO_COMPUTE_SHADER
+    post_program = create_post_compute_program(glsl_version_directive);
+
+    reduce_program = create_reduce_program(glsl_version_directive, false);
+    reduce_final_program = create_reduce_program(glsl_version_directive, true);
+    loc_reduce_tile_size =
+        glGetUniformLocation(reduce_program.get(), "tile_size");
+    loc_num_partial_sums =
+        glGetUniformLocation(reduce_final_program.get(), "num_partial_sums");
+
+    // One partial sum per work group of the first reduction pass
+    const auto num_partial_sums =
+        (align_up(static_cast<unsigned int>(texture_width), 16) / 16) *
+        (align_up(static_cast<unsigned int>(texture_height), 16) / 16);
+    partial_sums_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, partial_sums_buffer.get());
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 static_cast<GLsizeiptr>(num_partial_sums * sizeof(float)),
+                 nullptr,
+                 GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    current_error = std::numeric_limits<float>::infinity();
+
+    resolve_program = create_resolve_program(glsl_version_directive);
+    loc_resolve_sample_index =
+        glGetUniformLocation(resolve_program.get(), "sample_index");
+
+    if (light_tracing)
+    {
+        create_light_sums_buffer();
+    }
+
+    if (count_rays)
+    {
+        ray_counts_buffer = create_object(glGenBuffers, glDeleteBuffers);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ray_counts_buffer.get());
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     static_cast<GLsizeiptr>(2 * ray_count_pairs *
+                                             sizeof(GLuint)),
+                     nullptr,
+                     GL_DYNAMIC_READ);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER,
+                          GL_R32UI,
+                          GL_RED_INTEGER,
+                          GL_UNSIGNED_INT,
+                          nullptr);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    work_counter_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, work_counter_buffer.get());
+    glBufferData(
+        GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // The heaviest wavefront kernels read all scene arrays, the queues and
+    // the paths
+    GLint max_blocks {};
+    GLint max_bindings {};
+    glGetIntegerv(GL_MAX_COMPUTE_SHADER_STORAGE_BLOCKS, &max_blocks);
+    glGetIntegerv(GL_MAX_SHADER_STORAGE_BUFFER_BINDINGS, &max_bindings);
+    constexpr GLint wavefront_blocks {wavefront_paths_binding + 1};
+    wavefront_supported = max_blocks >= wavefront_blocks &&
+                          max_bindings >= wavefront_blocks;
+    if (wavefront)
+    {
+        if (!wavefront_supported)
+        {
+            throw std::runtime_error(
+                "Wavefront path tracing needs more storage buffer bindings");
+        }
+        create_wavefront_buffers();
+    }
+#else
+    post_program = create_post_graphics_program(glsl_version_directive);
+
+    glUseProgram(post_program.get());
+    glUniform1i(
+        glGetUniformLocation(post_program.get(), "accumulation_texture"), 0);
+
+    float_fbo = create_framebuffer(accumulation_texture.get());
+#endif
+
+    fbo = create_framebuffer(target_texture.get());
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+#ifndef __EMSCRIPTEN__
+    query_start = create_object(glGenQueries, glDeleteQueries);
+    query_end = create_object(glGenQueries, glDeleteQueries);
+#endif
+
+    materials_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    primitives_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    bvh_nodes_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    grid_cells_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    grid_primitives_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    emitters_buffer = create_object(glGenBuffers, glDeleteBuffers);
+
+    upload_scene();
+
+    samples_per_frame = 1;
+    last_time = glfwGetTime();
+}
+
+// Uploads the current scene into the existing buffers, and switches to a trace
+// program matching its shape, compiling it only if it is not cached yet.
+void Application::upload_scene()
+{
+    compiled_scene = compile_scene(scene);
+
+    Grid grid {};
+    if (primitive_count(compiled_scene) >= grid_min_primitives)
+    {
+        Thread_pool *pool {nullptr};
+#ifndef __EMSCRIPTEN__
+        if (!grid_pool)
+        {
+            grid_pool = std::make_unique<Thread_pool>();
+        }
+        pool = grid_pool.get();
+#endif
+        grid = build_grid(compiled_scene, pool);
+    }
+    if (should_use_grid(compiled_scene, grid))
+    {
+        accelerator = Accelerator::grid;
+        bvh = {};
+    }
+    else
+    {
+        grid = {};
+        bvh = should_use_bvh(compiled_scene) ? build_bvh(compiled_scene)
+                                             : Bvh {};
+        accelerator = bvh.nodes.empty() ? Accelerator::none : Accelerator::bvh;
+    }
+    gpu_primitives = make_gpu_primitives(compiled_scene,
+                                         accelerator == Accelerator::grid
+                                             ? grid.primitives
+                                             : bvh.primitives);
+    const auto grid_cells = pack_uvec4(grid.cell_offsets);
+    const auto grid_primitives =
+        pack_uvec4(stream_indices(gpu_primitives, grid.primitives));
+
+    std::vector<Scene_array> scene_arrays {
+        make_scene_array("Materials",
+                         "materials",
+                         "Material",
+                         "get_material",
+                         compiled_scene.materials,
+                         materials_buffer.get()),
+        make_scene_array("Primitives",
+                         "primitives",
+                         "Primitive",
+                         "get_primitive",
+                         gpu_primitives.stream,
+                         primitives_buffer.get())};
+    if (accelerator == Accelerator::bvh)
+    {
+        scene_arrays.push_back(make_scene_array("Bvh_nodes",
+                                                "bvh_nodes",
+                                                "Bvh_node",
+                                                "get_bvh_node",
+                                                bvh.nodes,
+                                                bvh_nodes_buffer.get()));
+    }
+    else if (accelerator == Accelerator::grid)
+    {
+        scene_arrays.push_back(make_scene_array("Grid_cells",
+                                                "grid_cells",
+                                                "uvec4",
+                                                "get_grid_cells",
+                                                grid_cells,
+                                                grid_cells_buffer.get()));
+        scene_arrays.push_back(
+            make_scene_array("Grid_primitives",
+                             "grid_primitives",
+                             "uvec4",
+                             "get_grid_primitives",
+                             grid_primitives,
+                             grid_primitives_buffer.get()));
+    }
+
+    const auto emitters = build_emitters(compiled_scene);
+    const auto gpu_emitters = make_gpu_emitters(gpu_primitives, emitters);
+    scene_arrays.push_back(make_scene_array("Emitters",
+                                            "emitters",
+                                            "Emitter",
+                                            "get_emitter",
+                                            gpu_emitters,
+                                            emitters_buffer.get()));
+
+#ifndef NO_STORAGE_BUFFER
+    select_trace_program({});
+#else
+    split_uniform_arrays(scene_arrays);
+    std::ostringstream scene_declarations;
+    write_uniform_arrays(scene_declarations, scene_arrays);
+    select_trace_program(scene_declarations.str());
+#endif
+
+    for (const auto &array : scene_arrays)
+    {
+        upload_scene_array(array);
+    }
+
+#ifndef NO_STORAGE_BUFFER
+    bind_storage_buffers(trace_program, scene_arrays);
+#ifndef NO_COMPUTE_SHADER
+    if (wavefront && !light_tracing)
+    {
+        const auto &programs = *wavefront_program;
+        for (const auto program : {programs.generate.get(),
+                                   programs.intersect.get(),
+                                   programs.shade[0].get(),
+                                   programs.shade[1].get(),
+                                   programs.shade[2].get()})
+        {
+            bind_storage_buffers(program, scene_arrays);
+            glUseProgram(program);
+            glUniform1f(glGetUniformLocation(program, "total_power"),
+                        emitters.total_power);
+            set_grid_uniforms(program, grid);
+        }
+    }
+#endif
+#else
+    bind_uniform_buffers(trace_program, scene_arrays);
+
+    glUseProgram(trace_program);
+    glUniform1i(glGetUniformLocation(trace_program, "primitive_count"),
+                static_cast<int>(gpu_primitives.stream.size()));
+    glUniform1i(glGetUniformLocation(trace_program, "emitter_count"),
+                static_cast<int>(emitters.emitters.size()));
+#endif
+
+    glUseProgram(trace_program);
+    glUniform1f(glGetUniformLocation(trace_program, "total_power"),
+                emitters.total_power);
+    set_grid_uniforms(trace_program, grid);
+
+    scene_edits = {};
+    sample_index = 0;
+}
+
+void Application::select_trace_program(const std::string &scene_declarations)
+{
+    auto key = scene_declarations + accelerator_define(accelerator);
+#ifndef NO_COMPUTE_SHADER
+    if (light_tracing)
+    {
+        key += "#define LIGHT_TRACING\n";
+    }
+    else if (persistent_threads)
+    {
+        key += "#define PERSISTENT_THREADS\n";
+    }
+    if (count_rays)
+    {
+        key += "#define COUNT_RAYS\n";
+    }
+#endif
+
+    auto it = trace_programs.find(key);
+    if (it == trace_programs.end())
+    {
+#ifndef NO_COMPUTE_SHADER
+        auto program =
+            create_trace_compute_program(glsl_version_directive,
+                                         accelerator,
+                                         light_tracing,
+                                         !light_tracing && persistent_threads,
+                                         count_rays);
+#else
+        auto program = create_trace_graphics_program(
+            glsl_version_directive, accelerator, scene_declarations);
+#endif
+        it = trace_programs.emplace(std::move(key), std::move(program)).first;
+    }
+    trace_program = it->second.get();
+
+#ifndef NO_COMPUTE_SHADER
+    // Light tracing does not use the wavefront kernels
+    if (wavefront && !light_tracing)
+    {
+        auto wavefront_it = wavefront_programs.find(key);
+        if (wavefront_it == wavefront_programs.end())
+        {
+            wavefront_it =
+                wavefront_programs
+                    .emplace(key,
+                             create_wavefront_programs(glsl_version_directive,
+                                                       accelerator,
+                                                       count_rays))
+                    .first;
+        }
+        wavefront_program = &wavefront_it->second;
+    }
+#endif
+
+    loc_image_size = glGetUniformLocation(trace_program, "image_size");
+    loc_tile_offset = glGetUniformLocation(trace_program, "tile_offset");
+#ifndef NO_COMPUTE_SHADER
+    loc_tile_size = glGetUniformLocation(trace_program, "tile_size");
+#endif
+    loc_sample_index = glGetUniformLocation(trace_program, "sample_index");
+    loc_samples_per_frame =
+        glGetUniformLocation(trace_program, "samples_per_frame");
+    loc_first_sample = glGetUniformLocation(trace_program, "first_sample");
+#ifndef NO_COMPUTE_SHADER
+    loc_error_threshold =
+        glGetUniformLocation(trace_program, "error_threshold");
+#endif
+    loc_view_position = glGetUniformLocation(trace_program, "view_position");
+    loc_view_size = glGetUniformLocation(trace_program, "view_size");
+}
+
+// Uploads only the primitives modified since the last upload, along with the
+// BVH nodes and the overlay instances that depend on them. Moved primitives
+// change the number of references of the grid cells, so a grid is rebuilt
+// along with the whole scene instead.
+void Application::upload_scene_edits()
+{
+    update_instances(
+        scene, scene.circles, scene_edits.circles, raster_geometry.circles);
+    update_instances(
+        scene, scene.lines, scene_edits.lines, raster_geometry.lines);
+    update_instances(scene, scene.arcs, scene_edits.arcs, raster_geometry.arcs);
+    upload_range(GL_ARRAY_BUFFER,
+                 circle_vbo.get(),
+                 raster_geometry.circles,
+                 scene_edits.circles);
+    upload_range(GL_ARRAY_BUFFER,
+                 line_vbo.get(),
+                 raster_geometry.lines,
+                 scene_edits.lines);
+    upload_range(
+        GL_ARRAY_BUFFER, arc_vbo.get(), raster_geometry.arcs, scene_edits.arcs);
+
+    if (accelerator == Accelerator::grid)
+    {
+        upload_scene();
+        return;
+    }
+
+    Dirty_range primitives {};
+    compile_edits(scene,
+                  Geometry_type::circle,
+                  scene_edits.circles,
+                  compiled_scene,
+                  gpu_primitives,
+                  primitives);
+    compile_edits(scene,
+                  Geometry_type::line,
+                  scene_edits.lines,
+                  compiled_scene,
+                  gpu_primitives,
+                  primitives);
+    compile_edits(scene,
+                  Geometry_type::arc,
+                  scene_edits.arcs,
+                  compiled_scene,
+                  gpu_primitives,
+                  primitives);
+    upload_range(scene_buffer_target,
+                 primitives_buffer.get(),
+                 gpu_primitives.stream,
+                 primitives);
+
+    // Only the ancestors of the moved primitives change, upload them as runs
+    // of consecutive nodes
+    Dirty_range nodes {};
+    for (const auto i : refit_bvh(compiled_scene, bvh))
+    {
+        if (i != nodes.end)
+        {
+            upload_range(
+                scene_buffer_target, bvh_nodes_buffer.get(), bvh.nodes, nodes);
+            nodes = {};
+        }
+        mark_dirty(nodes, i);
+    }
+    upload_range(
+        scene_buffer_target, bvh_nodes_buffer.get(), bvh.nodes, nodes);
+
+    scene_edits = {};
+    sample_index = 0;
+}
+
+// Replaces the scene without re-creating any GL object other than a trace
+// program for a scene shape that has not been seen yet.
+void Application::set_scene(Scene new_scene)
+{
+    scene = std::move(new_scene);
+    upload_scene();
+
+    // Headless rendering has no raster geometry
+    if (circle_vao.get() != 0)
+    {
+        create_raster_geometry(scene, raster_geometry);
+        upload_instances(circle_vbo.get(), raster_geometry.circles);
+        upload_instances(line_vbo.get(), raster_geometry.lines);
+        upload_instances(arc_vbo.get(), raster_geometry.arcs);
+    }
+}
+
+void Application::init()
+{
+    init_context(true);
 
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
@@ -1143,7 +2415,7 @@ void Application::init()
     ImGui_ImplGlfw_InstallEmscriptenCallbacks(window.get(), "#canvas");
 #endif
 
-    if (!ImGui_ImplOpenGL3_Init(glsl_version))
+    if (!ImGui_ImplOpenGL3_Init(glsl_version_directive))
     {
         throw std::runtime_error("ImGui: failed to initialize OpenGL backend");
     }
@@ -1151,112 +2423,858 @@ void Application::init()
 
     texture_width = 320;
     texture_height = 240;
+    image_width = texture_width;
+    image_height = texture_height;
     scene = create_scene(texture_width, texture_height);
 
-    accumulation_texture =
-        create_accumulation_texture(texture_width, texture_height);
-#ifndef NO_COMPUTE_SHADER
-    glBindImageTexture(0,
-                       accumulation_texture.get(),
-                       0,
-                       GL_FALSE,
-                       0,
-                       GL_READ_WRITE,
-                       GL_RGBA32F);
+    init_renderer();
+
+    thickness = 0.0075f;
+    create_raster_geometry(scene, raster_geometry);
+
+    // NOTE: the instances do not depend on the view, so zooming does not touch
+    // the instance buffers. Edits only update the instances of the modified
+    // primitives, and changing the number of objects goes through set_scene,
+    // which re-specifies the buffers with upload_instances.
+    std::tie(circle_vao, circle_vbo) = create_instance_buffer<Circle_instance>(
+        {{0, 2, offsetof(Circle_instance, center)},
+         {1, 1, offsetof(Circle_instance, radius)},
+         {2, 3, offsetof(Circle_instance, color)}});
+    std::tie(line_vao, line_vbo) = create_instance_buffer<Line_instance>(
+        {{0, 2, offsetof(Line_instance, a)},
+         {1, 2, offsetof(Line_instance, b)},
+         {2, 3, offsetof(Line_instance, color)}});
+    std::tie(arc_vao, arc_vbo) = create_instance_buffer<Arc_instance>(
+        {{0, 2, offsetof(Arc_instance, center)},
+         {1, 1, offsetof(Arc_instance, radius)},
+         {2, 1, offsetof(Arc_instance, b)},
+         {3, 2, offsetof(Arc_instance, a)},
+         {4, 3, offsetof(Arc_instance, color)}});
+    upload_instances(circle_vbo.get(), raster_geometry.circles);
+    upload_instances(line_vbo.get(), raster_geometry.lines);
+    upload_instances(arc_vbo.get(), raster_geometry.arcs);
+
+    circle_program = create_graphics_program(glsl_version_directive,
+                                             "shaders/circle.vert",
+                                             "shaders/circle.frag");
+    line_program = create_graphics_program(
+        glsl_version_directive, "shaders/line.vert", "shaders/line.frag");
+    arc_program = create_graphics_program(
+        glsl_version_directive, "shaders/arc.vert", "shaders/arc.frag");
+    loc_view_position_draw_circle =
+        glGetUniformLocation(circle_program.get(), "view_position");
+    loc_view_size_draw_circle =
+        glGetUniformLocation(circle_program.get(), "view_size");
+    loc_thickness_draw_circle =
+        glGetUniformLocation(circle_program.get(), "thickness");
+    loc_view_position_draw_line =
+        glGetUniformLocation(line_program.get(), "view_position");
+    loc_view_size_draw_line =
+        glGetUniformLocation(line_program.get(), "view_size");
+    loc_thickness_draw_line =
+        glGetUniformLocation(line_program.get(), "thickness");
+    loc_view_position_draw_arc =
+        glGetUniformLocation(arc_program.get(), "view_position");
+    loc_view_size_draw_arc =
+        glGetUniformLocation(arc_program.get(), "view_size");
+    loc_thickness_draw_arc =
+        glGetUniformLocation(arc_program.get(), "thickness");
+
+    draw_geometry = true;
+}
+
+#ifndef __EMSCRIPTEN__
+void Application::init_headless(const Render_options &options)
+{
+    init_context(false);
+
+    // Only the tile being traced is stored on the GPU
+    image_width = options.width;
+    image_height = options.height;
+    texture_width = options.width;
+    texture_height = options.height;
+    if (options.tile_size > 0)
+    {
+        texture_width = std::min(options.tile_size, options.width);
+        texture_height = std::min(options.tile_size, options.height);
+    }
+    error_threshold = options.error_threshold;
+    target_error = options.target_error;
+    light_tracing = options.light_tracing;
+    wavefront = options.wavefront;
+    count_rays = options.count_rays;
+    persistent_threads = options.persistent_threads;
+    scene = load_render_scene(options);
+
+    init_renderer();
+
+    checkpoint_path = options.checkpoint_path;
+    if (!options.worker_directory.empty())
+    {
+        // Each worker traces the next options.samples samples of the
+        // sequences, and saves them where the merge finds them
+        const auto worker_index = claim_worker(options.worker_directory);
+        // The sample indices of the shaders are 32-bit, so wrapped ranges
+        // would repeat the samples of the first workers
+        const auto end_sample =
+            (static_cast<std::uint64_t>(worker_index) + 1) * options.samples;
+        if (end_sample >
+            std::uint64_t {std::numeric_limits<unsigned int>::max()} + 1)
+        {
+            throw std::runtime_error(
+                "Worker " + std::to_string(worker_index) +
+                " would trace samples past the last sample index, use fewer "
+                "samples per worker");
+        }
+        first_sample =
+            static_cast<unsigned int>(worker_index) * options.samples;
+        checkpoint_path = options.worker_directory;
+        checkpoint_path /= "worker_" + std::to_string(worker_index) + ".ckpt";
+        std::cout << "Worker " << worker_index << ", samples from "
+                  << first_sample << '\n';
+    }
+    checkpoint_info = {.scene_hash = hash_scene(scene),
+                       .width = texture_width,
+                       .height = texture_height,
+                       .sample_index = 0,
+                       .first_sample = first_sample};
+    if (!checkpoint_path.empty())
+    {
+        const auto num_pixels = static_cast<GLsizeiptr>(texture_width) *
+                                static_cast<GLsizeiptr>(texture_height);
+        checkpoint_buffer = create_object(glGenBuffers, glDeleteBuffers);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, checkpoint_buffer.get());
+        glBufferData(
+            GL_PIXEL_PACK_BUFFER,
+            num_pixels * static_cast<GLsizeiptr>(sizeof(vec4) + sizeof(float)),
+            nullptr,
+            GL_STREAM_READ);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        if (options.resume)
+        {
+            resume(read_checkpoint(checkpoint_path));
+        }
+    }
+}
+
+// Continues the render saved in a checkpoint, with the same random numbers as
+// the interrupted render would have used.
+void Application::resume(const Checkpoint &checkpoint)
+{
+    if (checkpoint.info.width != texture_width ||
+        checkpoint.info.height != texture_height)
+    {
+        throw std::runtime_error(
+            "The checkpoint was rendered at another resolution");
+    }
+    if (checkpoint.info.scene_hash != checkpoint_info.scene_hash)
+    {
+        throw std::runtime_error(
+            "The checkpoint was rendered from another scene");
+    }
+
+    glBindTexture(GL_TEXTURE_2D, accumulation_texture.get());
+    glTexSubImage2D(GL_TEXTURE_2D,
+                    0,
+                    0,
+                    0,
+                    texture_width,
+                    texture_height,
+                    GL_RGBA,
+                    GL_FLOAT,
+                    checkpoint.accumulation.data());
+    glBindTexture(GL_TEXTURE_2D, moment_texture.get());
+    glTexSubImage2D(GL_TEXTURE_2D,
+                    0,
+                    0,
+                    0,
+                    texture_width,
+                    texture_height,
+                    GL_RED,
+                    GL_FLOAT,
+                    checkpoint.moments.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    sample_index = checkpoint.info.sample_index;
+    first_sample = checkpoint.info.first_sample;
+    checkpoint_info.first_sample = first_sample;
+    std::cout << "Resuming after " << sample_index << " samples\n";
+}
+
+// Reads the images back into checkpoint_buffer, unless the previous
+// checkpoint is still in flight. The read back completes asynchronously, and
+// update_checkpoint() writes it once done.
+void Application::start_checkpoint()
+{
+    if (checkpoint_fence != nullptr || checkpoint_write.valid())
+    {
+        return;
+    }
+
+    const auto moments_offset = static_cast<std::uintptr_t>(texture_width) *
+                                static_cast<std::uintptr_t>(texture_height) *
+                                sizeof(vec4);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, checkpoint_buffer.get());
+    glBindTexture(GL_TEXTURE_2D, accumulation_texture.get());
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, moment_texture.get());
+    // With a pixel pack buffer bound, the pointer is an offset into it
+    glGetTexImage(GL_TEXTURE_2D,
+                  0,
+                  GL_RED,
+                  GL_FLOAT,
+                  reinterpret_cast<void *>(moments_offset));
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    checkpoint_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    checkpoint_info.sample_index = sample_index;
+}
+
+// Advances the checkpoint in flight: once read back, the buffer is mapped and
+// written to the file by another thread, and unmapped once written. Waits for
+// both steps if requested, which rethrows any error of the write.
+void Application::update_checkpoint(bool wait)
+{
+    if (checkpoint_fence != nullptr)
+    {
+        const auto status = glClientWaitSync(
+            checkpoint_fence,
+            wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+            wait ? std::numeric_limits<GLuint64>::max() : 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+        {
+            return;
+        }
+        glDeleteSync(checkpoint_fence);
+        checkpoint_fence = {};
+
+        const auto num_pixels = static_cast<std::size_t>(texture_width) *
+                                static_cast<std::size_t>(texture_height);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, checkpoint_buffer.get());
+        const auto *const data = static_cast<const std::byte *>(
+            glMapBufferRange(GL_PIXEL_PACK_BUFFER,
+                             0,
+                             static_cast<GLsizeiptr>(
+                                 num_pixels * (sizeof(vec4) + sizeof(float))),
+                             GL_MAP_READ_BIT));
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (data == nullptr)
+        {
+            throw std::runtime_error("Failed to map the checkpoint buffer");
+        }
+
+        const std::span accumulation {
+            reinterpret_cast<const vec4 *>(data), num_pixels};
+        const std::span moments {
+            reinterpret_cast<const float *>(data + num_pixels * sizeof(vec4)),
+            num_pixels};
+        checkpoint_write = std::async(
+            std::launch::async,
+            [path = checkpoint_path,
+             info = checkpoint_info,
+             accumulation,
+             moments] { write_checkpoint(path, info, accumulation, moments); });
+    }
+
+    if (checkpoint_write.valid() &&
+        (wait || checkpoint_write.wait_for(std::chrono::seconds(0)) ==
+                     std::future_status::ready))
+    {
+        checkpoint_write.wait();
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, checkpoint_buffer.get());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        checkpoint_write.get();
+    }
+}
+
+// Reads the post-processed image back into export_buffer, unless the previous
+// export is still in flight. update_export() encodes it once read back.
+void Application::start_export(std::string file_name)
+{
+    if (export_fence != nullptr || export_write.valid())
+    {
+        std::cerr << "Export to \"" << export_file_name
+                  << "\" still in progress\n";
+        return;
+    }
+
+    // Most sessions never export, so the buffer is only created on the first
+    // export. Its storage is reallocated below for the current image size.
+    if (!export_buffer.get())
+    {
+        export_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    }
+    export_file_name = std::move(file_name);
+    export_width = texture_width;
+    export_height = texture_height;
+    const auto size = static_cast<GLsizeiptr>(export_width) *
+                      static_cast<GLsizeiptr>(export_height) * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, export_buffer.get());
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+    glBindTexture(GL_TEXTURE_2D, target_texture.get());
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    export_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Advances the export in flight like update_checkpoint(). Errors are only
+// reported, an interactive session should not end because of a failed export.
+void Application::update_export(bool wait)
+{
+    if (export_fence != nullptr)
+    {
+        const auto status =
+            glClientWaitSync(export_fence,
+                             wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                             wait ? std::numeric_limits<GLuint64>::max() : 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+        {
+            return;
+        }
+        glDeleteSync(export_fence);
+        export_fence = {};
+
+        const auto size = static_cast<std::size_t>(export_width) *
+                          static_cast<std::size_t>(export_height) * 4;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, export_buffer.get());
+        const auto *const data = static_cast<const std::uint8_t *>(
+            glMapBufferRange(GL_PIXEL_PACK_BUFFER,
+                             0,
+                             static_cast<GLsizeiptr>(size),
+                             GL_MAP_READ_BIT));
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (data == nullptr)
+        {
+            std::cerr << "Failed to map the export buffer\n";
+            return;
+        }
+
+        export_write = std::async(
+            std::launch::async,
+            [file_name = export_file_name,
+             width = export_width,
+             height = export_height,
+             pixels = std::span {data, size}]
+            { write_png(file_name.c_str(), width, height, pixels); });
+    }
+
+    if (export_write.valid() &&
+        (wait || export_write.wait_for(std::chrono::seconds(0)) ==
+                     std::future_status::ready))
+    {
+        export_write.wait();
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, export_buffer.get());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        try
+        {
+            export_write.get();
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << '\n';
+        }
+    }
+}
+
+// Uploads the tile from the tiled image, and makes it the target of the next
+// dispatches.
+void Application::load_tile(const Tile &tile, const Tiled_image &image)
+{
+    tile_x = tile.x;
+    tile_y = tile.y;
+    tile_width = tile.width;
+    tile_height = tile.height;
+    sample_index = tile.sample_index;
+    current_error = tile.error;
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, image.tile_size());
+    glBindTexture(GL_TEXTURE_2D, accumulation_texture.get());
+    glTexSubImage2D(GL_TEXTURE_2D,
+                    0,
+                    0,
+                    0,
+                    tile.width,
+                    tile.height,
+                    GL_RGBA,
+                    GL_FLOAT,
+                    image.accumulation(tile).data());
+    glBindTexture(GL_TEXTURE_2D, moment_texture.get());
+    glTexSubImage2D(GL_TEXTURE_2D,
+                    0,
+                    0,
+                    0,
+                    tile.width,
+                    tile.height,
+                    GL_RED,
+                    GL_FLOAT,
+                    image.moments(tile).data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// Reads the traced tile back into the tiled image. The textures are never
+// larger than the tiles, so they are read back whole.
+void Application::store_tile(const Tile &tile, const Tiled_image &image)
+{
+    glPixelStorei(GL_PACK_ROW_LENGTH, image.tile_size());
+    glBindTexture(GL_TEXTURE_2D, accumulation_texture.get());
+    glGetTexImage(
+        GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, image.accumulation(tile).data());
+    glBindTexture(GL_TEXTURE_2D, moment_texture.get());
+    glGetTexImage(
+        GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, image.moments(tile).data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+}
+
+// Copies the post-processed tile into the RGBA8 pixels of the whole image.
+void Application::read_target_tile(const Tile &tile,
+                                   std::vector<std::uint8_t> &pixels)
+{
+    constexpr std::size_t channels {4};
+    std::vector<std::uint8_t> tile_pixels(
+        static_cast<std::size_t>(texture_width) *
+        static_cast<std::size_t>(texture_height) * channels);
+    glBindTexture(GL_TEXTURE_2D, target_texture.get());
+    glGetTexImage(
+        GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, tile_pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (int y {0}; y < tile.height; ++y)
+    {
+        const auto source = static_cast<std::size_t>(y) *
+                            static_cast<std::size_t>(texture_width);
+        const auto destination =
+            static_cast<std::size_t>(tile.y + y) *
+                static_cast<std::size_t>(image_width) +
+            static_cast<std::size_t>(tile.x);
+        std::memcpy(&pixels[destination * channels],
+                    &tile_pixels[source * channels],
+                    static_cast<std::size_t>(tile.width) * channels);
+    }
+}
 #endif
 
-    target_texture = create_target_texture(texture_width, texture_height);
+void Application::trace(unsigned int samples)
+{
+    glUseProgram(trace_program);
+    glUniform1i(loc_sample_index, static_cast<int>(sample_index));
+    glUniform1i(loc_samples_per_frame, static_cast<int>(samples));
+    glUniform1ui(loc_first_sample, first_sample);
 #ifndef NO_COMPUTE_SHADER
-    glBindImageTexture(
-        5, target_texture.get(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    glUniform1f(loc_error_threshold, error_threshold);
 #endif
+    glUniform2f(loc_view_position, scene.view_x, scene.view_y);
+    glUniform2f(loc_view_size, scene.view_width, scene.view_height);
+    glUniform2ui(loc_image_size,
+                 static_cast<unsigned int>(image_width),
+                 static_cast<unsigned int>(image_height));
+    glUniform2ui(loc_tile_offset,
+                 static_cast<unsigned int>(tile_x),
+                 static_cast<unsigned int>(tile_y));
 
 #ifndef NO_COMPUTE_SHADER
-    trace_program = create_trace_compute_program(glsl_version, scene);
+    glUniform2ui(loc_tile_size,
+                 static_cast<unsigned int>(tile_width),
+                 static_cast<unsigned int>(tile_height));
+
+    const unsigned int num_groups_x {
+        align_up(static_cast<unsigned int>(tile_width), 16) / 16,
+    };
+    const unsigned int num_groups_y {
+        align_up(static_cast<unsigned int>(tile_height), 16) / 16,
+    };
+
+    if (count_rays)
+    {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER,
+                         ray_counts_binding,
+                         ray_counts_buffer.get());
+    }
+
+    if (!light_tracing && wavefront)
+    {
+        trace_wavefront(samples);
+    }
+    else if (!light_tracing && persistent_threads)
+    {
+        // Binding 0 is shared with the reduction
+        glBindBufferBase(
+            GL_SHADER_STORAGE_BUFFER, 0, work_counter_buffer.get());
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER,
+                          GL_R32UI,
+                          GL_RED_INTEGER,
+                          GL_UNSIGNED_INT,
+                          nullptr);
+        const auto num_pixels = static_cast<unsigned int>(tile_width) *
+                                static_cast<unsigned int>(tile_height);
+        glDispatchCompute(
+            std::min(persistent_num_groups, align_up(num_pixels, 64) / 64),
+            1,
+            1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    else if (!light_tracing)
+    {
+        glDispatchCompute(num_groups_x, num_groups_y, 1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    else
+    {
+        // Binding 0 is shared with the reduction
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, light_sums_buffer.get());
+        if (sample_index == 0)
+        {
+            glClearBufferData(GL_SHADER_STORAGE_BUFFER,
+                              GL_R32F,
+                              GL_RED,
+                              GL_FLOAT,
+                              nullptr);
+        }
+        glDispatchCompute(num_groups_x, num_groups_y, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        glUseProgram(resolve_program.get());
+        glUniform1i(loc_resolve_sample_index,
+                    static_cast<int>(sample_index + samples));
+        glDispatchCompute(num_groups_x, num_groups_y, 1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+
+    if (count_rays)
+    {
+        read_ray_counts();
+    }
 #else
-    trace_program = create_trace_graphics_program(glsl_version, scene);
-    empty_vao = create_object(glGenVertexArrays, glDeleteVertexArrays);
-    loc_image_size = glGetUniformLocation(trace_program.get(), "image_size");
+    glBindFramebuffer(GL_FRAMEBUFFER, float_fbo.get());
+    glBindVertexArray(empty_vao.get());
+
+    // new_average = alpha * sample_average + (1 - alpha) * old_average
+    const auto alpha = static_cast<float>(samples) /
+                       static_cast<float>(sample_index + samples);
+    glBlendColor(alpha, alpha, alpha, alpha);
+    glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+
+    glViewport(0, 0, texture_width, texture_height);
+
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+#endif
+
+    sample_index += samples;
+    sum_samples += samples;
+}
+
+#ifndef NO_COMPUTE_SHADER
+// Adds the counters of the last dispatch to the totals and clears them. This
+// stalls the pipeline, which is why rays are only counted on request.
+void Application::read_ray_counts()
+{
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    std::vector<GLuint> counts(2 * ray_count_pairs);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ray_counts_buffer.get());
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                       0,
+                       static_cast<GLsizeiptr>(counts.size() * sizeof(GLuint)),
+                       counts.data());
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER,
+                      GL_R32UI,
+                      GL_RED_INTEGER,
+                      GL_UNSIGNED_INT,
+                      nullptr);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    for (std::size_t i {0}; i < ray_count_pairs; ++i)
+    {
+        path_rays += counts[2 * i];
+        shadow_rays += counts[2 * i + 1];
+    }
+}
+
+// Only created once light tracing is enabled, since it is as big as the
+// accumulation texture
+void Application::create_light_sums_buffer()
+{
+    // One RGB triplet of floats per pixel
+    light_sums_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, light_sums_buffer.get());
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 static_cast<GLsizeiptr>(texture_width) * texture_height * 3 *
+                     static_cast<GLsizeiptr>(sizeof(float)),
+                 nullptr,
+                 GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void Application::create_wavefront_buffers()
+{
+    const auto num_paths = static_cast<GLsizeiptr>(texture_width) *
+                           static_cast<GLsizeiptr>(texture_height);
+
+    paths_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, paths_buffer.get());
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 num_paths * wavefront_path_size,
+                 nullptr,
+                 GL_DYNAMIC_COPY);
+
+    // The queue headers are followed by the path indices of every queue
+    queues_buffer = create_object(glGenBuffers, glDeleteBuffers);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, queues_buffer.get());
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 wavefront_num_queues *
+                     (wavefront_queue_size +
+                      num_paths * static_cast<GLsizeiptr>(sizeof(GLuint))),
+                 nullptr,
+                 GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// Traces one sample per pixel at a time, advancing all paths by one bounce
+// per iteration. Only the GPU knows the size of the queues, so every bounce up
+// to the maximum depth is dispatched, which is why dispatch_samples() keeps
+// the samples of a frame low.
+void Application::trace_wavefront(unsigned int samples)
+{
+    const auto &programs = *wavefront_program;
+    const unsigned int num_groups_x {
+        align_up(static_cast<unsigned int>(tile_width), 16) / 16,
+    };
+    const unsigned int num_groups_y {
+        align_up(static_cast<unsigned int>(tile_height), 16) / 16,
+    };
+
+    const auto kernels = trace_uniform_programs(programs);
+    for (std::size_t i {0}; i < kernels.size(); ++i)
+    {
+        const auto &loc = programs.loc_trace_uniforms[i];
+        glUseProgram(kernels[i]);
+        glUniform1i(loc.sample_index, static_cast<int>(sample_index));
+        glUniform1i(loc.samples_per_frame, static_cast<int>(samples));
+        glUniform1ui(loc.first_sample, first_sample);
+        glUniform1f(loc.error_threshold, error_threshold);
+        glUniform2f(loc.view_position, scene.view_x, scene.view_y);
+        glUniform2f(loc.view_size, scene.view_width, scene.view_height);
+        glUniform2ui(loc.image_size,
+                     static_cast<unsigned int>(image_width),
+                     static_cast<unsigned int>(image_height));
+        glUniform2ui(loc.tile_offset,
+                     static_cast<unsigned int>(tile_x),
+                     static_cast<unsigned int>(tile_y));
+        glUniform2ui(loc.tile_size,
+                     static_cast<unsigned int>(tile_width),
+                     static_cast<unsigned int>(tile_height));
+    }
+
+    // Binding 0 is shared with the reduction
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, queues_buffer.get());
+    glBindBufferBase(
+        GL_SHADER_STORAGE_BUFFER, wavefront_paths_binding, paths_buffer.get());
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, queues_buffer.get());
+
+    const auto prepare_queues = [&](GLuint consumed_queues)
+    {
+        glUseProgram(programs.prepare.get());
+        glUniform1ui(programs.loc_consumed_queues, consumed_queues);
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT |
+                        GL_COMMAND_BARRIER_BIT);
+    };
+    const auto dispatch_queue = [](GLuint queue)
+    { glDispatchComputeIndirect(queue * wavefront_queue_size); };
+
+    constexpr GLuint all_queues {(1u << wavefront_num_queues) - 1};
+    constexpr GLuint material_queues {all_queues &
+                                      ~((1u << wavefront_material_queue) - 1)};
+
+    for (unsigned int wave {0}; wave < samples; ++wave)
+    {
+        prepare_queues(all_queues);
+
+        glUseProgram(programs.generate.get());
+        glUniform1i(programs.loc_wave_index, static_cast<int>(wave));
+        glDispatchCompute(num_groups_x, num_groups_y, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        prepare_queues(0);
+
+        for (GLuint depth {0}; depth <= wavefront_max_depth; ++depth)
+        {
+            const auto ray_queue = wavefront_ray_queue + depth % 2;
+
+            glUseProgram(programs.intersect.get());
+            glUniform1ui(programs.loc_intersect_ray_queue, ray_queue);
+            dispatch_queue(ray_queue);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            prepare_queues(1u << ray_queue);
+
+            // The shading kernels only share the atomic counter of the next
+            // ray queue, they need no barrier between them
+            for (std::size_t i {0}; i < programs.shade.size(); ++i)
+            {
+                glUseProgram(programs.shade[i].get());
+                glUniform1ui(programs.loc_shade_ray_queue[i], ray_queue);
+                dispatch_queue(wavefront_material_queue +
+                               static_cast<GLuint>(i));
+            }
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            prepare_queues(material_queues);
+        }
+    }
+
+    glUseProgram(programs.accumulate.get());
+    glDispatchCompute(num_groups_x, num_groups_y, 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
 #endif
 
-    loc_sample_index =
-        glGetUniformLocation(trace_program.get(), "sample_index");
-    loc_samples_per_frame =
-        glGetUniformLocation(trace_program.get(), "samples_per_frame");
-    loc_view_position =
-        glGetUniformLocation(trace_program.get(), "view_position");
-    loc_view_size = glGetUniformLocation(trace_program.get(), "view_size");
+void Application::post_process()
+{
+#ifndef NO_COMPUTE_SHADER
+    const unsigned int num_groups_x {
+        align_up(static_cast<unsigned int>(texture_width), 16) / 16,
+    };
+    const unsigned int num_groups_y {
+        align_up(static_cast<unsigned int>(texture_height), 16) / 16,
+    };
+
+    glUseProgram(post_program.get());
+    glDispatchCompute(num_groups_x, num_groups_y, 1);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+#else
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo.get());
+    glViewport(0, 0, texture_width, texture_height);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, accumulation_texture.get());
+    glUseProgram(post_program.get());
+
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+#endif
+}
 
 #ifndef NO_COMPUTE_SHADER
-    post_program = create_post_compute_program(glsl_version);
-#else
-    post_program = create_post_graphics_program(glsl_version);
+// Returns the mean relative standard error of the luminance of all pixels of
+// the tile, reduced on the GPU so that only a single value is read back.
+float Application::measure_error()
+{
+    const unsigned int num_groups_x {
+        align_up(static_cast<unsigned int>(tile_width), 16) / 16,
+    };
+    const unsigned int num_groups_y {
+        align_up(static_cast<unsigned int>(tile_height), 16) / 16,
+    };
 
-    glUseProgram(post_program.get());
-    glUniform1i(
-        glGetUniformLocation(post_program.get(), "accumulation_texture"), 0);
+    // Binding 0 is not used by the scene buffers
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, partial_sums_buffer.get());
 
-    float_fbo = create_framebuffer(accumulation_texture.get());
-#endif
+    glUseProgram(reduce_program.get());
+    glUniform2ui(loc_reduce_tile_size,
+                 static_cast<unsigned int>(tile_width),
+                 static_cast<unsigned int>(tile_height));
+    glDispatchCompute(num_groups_x, num_groups_y, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
-    fbo = create_framebuffer(target_texture.get());
+    glUseProgram(reduce_final_program.get());
+    glUniform1ui(loc_num_partial_sums, num_groups_x * num_groups_y);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    float sum {};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, partial_sums_buffer.get());
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(sum), &sum);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-#ifndef __EMSCRIPTEN__
-    query_start = create_object(glGenQueries, glDeleteQueries);
-    query_end = create_object(glGenQueries, glDeleteQueries);
+    current_error = sum / static_cast<float>(tile_width * tile_height);
+    return current_error;
+}
 #endif
 
-    materials_ubo = create_uniform_buffer(scene.materials);
-    circles_ubo = create_uniform_buffer(scene.circles);
-    lines_ubo = create_uniform_buffer(scene.lines);
-    arcs_ubo = create_uniform_buffer(scene.arcs);
-
-    const auto bind_ubo = [program = trace_program.get()](
-                              GLuint ubo, const char *name, GLuint binding)
+bool Application::has_converged() const noexcept
+{
+#ifndef NO_COMPUTE_SHADER
+    // Light tracing does not estimate the variance of the pixels
+    if (light_tracing)
     {
-        const auto block_index = glGetUniformBlockIndex(program, name);
-        glUniformBlockBinding(program, block_index, binding);
-        glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo);
-    };
-    bind_ubo(materials_ubo.get(), "Materials", 1);
-    bind_ubo(circles_ubo.get(), "Circles", 2);
-    bind_ubo(lines_ubo.get(), "Lines", 3);
-    bind_ubo(arcs_ubo.get(), "Arcs", 4);
-
-    thickness = 0.0075f;
-    create_raster_geometry(scene, thickness, raster_geometry);
+        return false;
+    }
+#endif
+    return target_error > 0.0f && current_error <= target_error;
+}
 
-    // TODO: we should probably organize the raster geometry better. We need to
-    // clarify the distinction between updating the vertex buffer (when
-    // zooming or moving objects) and re-creating the vertex and index buffers
-    // with a new size (when adding or removing objects).
-    std::tie(vao, vbo, ibo) = create_vertex_index_buffers(raster_geometry);
+// Scales the number of samples of the last dispatch, which can be fewer than
+// samples_per_frame, to the target duration
+// Number of samples of the next dispatch towards max_samples
+unsigned int
+Application::dispatch_samples(unsigned int max_samples) const noexcept
+{
+    auto samples = std::min(samples_per_frame, max_samples - sample_index);
+#ifndef NO_COMPUTE_SHADER
+    if (wavefront && !light_tracing)
+    {
+        // Every sample dispatches all the bounces up to the maximum depth,
+        // whether or not paths are left, so the driver overhead of a dispatch
+        // grows with its samples rather than with its work
+        constexpr unsigned int max_wavefront_samples_per_frame {4};
+        samples = std::min(samples, max_wavefront_samples_per_frame);
+    }
+#endif
+    return samples;
+}
 
-    circle_program = create_graphics_program(
-        glsl_version, "shaders/shader.vert", "shaders/circle.frag");
-    line_program = create_graphics_program(
-        glsl_version, "shaders/shader.vert", "shaders/line.frag");
-    arc_program = create_graphics_program(
-        glsl_version, "shaders/shader.vert", "shaders/arc.frag");
-    loc_view_position_draw_circle =
-        glGetUniformLocation(circle_program.get(), "view_position");
-    loc_view_size_draw_circle =
-        glGetUniformLocation(circle_program.get(), "view_size");
-    loc_view_position_draw_line =
-        glGetUniformLocation(line_program.get(), "view_position");
-    loc_view_size_draw_line =
-        glGetUniformLocation(line_program.get(), "view_size");
-    loc_view_position_draw_arc =
-        glGetUniformLocation(arc_program.get(), "view_position");
-    loc_view_size_draw_arc =
-        glGetUniformLocation(arc_program.get(), "view_size");
+void Application::update_workload(
+    [[maybe_unused]] unsigned int samples,
+    [[maybe_unused]] double target_compute_per_frame)
+{
+#ifndef __EMSCRIPTEN__
+    // NOTE: for some reason, GL_TIMESTAMP or GL_TIME_ELAPSED queries on
+    // Intel with Mesa drivers return non-sense numbers, rendering them
+    // useless. For this reason, we unfortunately cannot rely on GPU timing
+    // at all. We could technically have a workaround for this specific
+    // platform, but that also assumes that GL_RENDERER will always return a
+    // string correctly identifying the driver (what happens on WebGL?).
+    if (auto_workload)
+    {
+        GLuint64 start_time {};
+        GLuint64 end_time {};
+        glGetQueryObjectui64v(query_start.get(), GL_QUERY_RESULT, &start_time);
+        glGetQueryObjectui64v(query_end.get(), GL_QUERY_RESULT, &end_time);
+        const auto elapsed = static_cast<double>(end_time - start_time) / 1e9;
+        // Some drivers return timestamps that do not cover the dispatch, so
+        // the estimate can only double from one dispatch to the next, and
+        // never exceeds max_samples_per_frame
+        constexpr double max_samples_per_frame {256.0};
+        const auto samples_per_frame_f =
+            static_cast<double>(samples) * target_compute_per_frame / elapsed;
+        samples_per_frame = static_cast<unsigned int>(
+            std::clamp(std::min(samples_per_frame_f,
+                                2.0 * static_cast<double>(samples)),
+                       1.0,
+                       max_samples_per_frame));
+    }
+#endif
+}
 
-    samples_per_frame = 1;
-    last_time = glfwGetTime();
-    draw_geometry = true;
+void Application::print_statistics()
+{
+    ++num_frames;
+    const double current_time {glfwGetTime()};
+    if (const auto elapsed = current_time - last_time; elapsed >= 1.0)
+    {
+        std::cout << static_cast<double>(num_frames) / elapsed << " fps, "
+                  << samples_per_frame << " samples/frame, " << sum_samples
+                  << " samples/s, " << sample_index << " samples\n";
+        num_frames = 0;
+        last_time = current_time;
+        sum_samples = 0;
+    }
 }
 
 void Application::main_loop_update()
@@ -1289,6 +3307,43 @@ void Application::main_loop_update()
 
     if (!ImGui::GetIO().WantCaptureMouse)
     {
+        if (glfwGetMouseButton(window.get(), GLFW_MOUSE_BUTTON_RIGHT) ==
+            GLFW_PRESS)
+        {
+            if (!editing)
+            {
+                editing = true;
+                picked_primitive =
+                    pick_primitive(scene,
+                                   {mouse_world_x, mouse_world_y},
+                                   thickness * scene.view_height);
+                edit_source_mouse_x = mouse_world_x;
+                edit_source_mouse_y = mouse_world_y;
+            }
+            else if (picked_primitive.has_value() &&
+                     (mouse_world_x != edit_source_mouse_x ||
+                      mouse_world_y != edit_source_mouse_y))
+            {
+                move_primitive(scene,
+                               *picked_primitive,
+                               {mouse_world_x - edit_source_mouse_x,
+                                mouse_world_y - edit_source_mouse_y},
+                               scene_edits);
+                upload_scene_edits();
+                edit_source_mouse_x = mouse_world_x;
+                edit_source_mouse_y = mouse_world_y;
+            }
+        }
+        else if (editing)
+        {
+            editing = false;
+            // Refitting degrades the BVH, rebuild it once the edit is done
+            if (picked_primitive.has_value() && !bvh.nodes.empty())
+            {
+                upload_scene();
+            }
+        }
+
         if (glfwGetMouseButton(window.get(), GLFW_MOUSE_BUTTON_LEFT) ==
             GLFW_PRESS)
         {
@@ -1330,12 +3385,6 @@ void Application::main_loop_update()
             scene.view_width *= zoom;
             scene.view_height *= zoom;
             sample_index = 0;
-
-            // NOTE: we update the geometry when scrolling because the
-            // thickness is constant in view space and therefore changes in
-            // world space
-            create_raster_geometry(scene, thickness, raster_geometry);
-            update_vertex_buffer(vao.get(), vbo.get(), raster_geometry);
         }
     }
 
@@ -1352,10 +3401,7 @@ void Application::main_loop_update()
             p_pressed = true;
 // FIXME
 #ifndef __EMSCRIPTEN__
-            save_as_png("image.png",
-                        texture_width,
-                        texture_height,
-                        target_texture.get());
+            start_export("image.png");
 #endif
         }
         else if (p_state == GLFW_RELEASE)
@@ -1384,11 +3430,16 @@ void Application::main_loop_update()
         {
             l_pressed = true;
             std::cout << "Loading scene from \"scene.json\"\n";
-            if (const auto new_scene = load_scene("scene.json");
+            if (auto new_scene = load_scene("scene.json");
                 new_scene.has_value())
             {
-                std::cerr << "Scene loading successful but not yet supported "
-                             "as it requires recreating some resources\n";
+                const auto start_time = std::chrono::steady_clock::now();
+                match_view_aspect_ratio(
+                    *new_scene, texture_width, texture_height);
+                set_scene(*std::move(new_scene));
+                const std::chrono::duration<double, std::milli> elapsed {
+                    std::chrono::steady_clock::now() - start_time};
+                std::cout << "Scene loaded in " << elapsed.count() << " ms\n";
             }
             else
             {
@@ -1411,8 +3462,55 @@ void Application::main_loop_update()
                     static_cast<double>(1000.0f / ImGui::GetIO().Framerate),
                     static_cast<double>(ImGui::GetIO().Framerate));
         ImGui::Text("%u samples", sample_index);
+#ifndef NO_COMPUTE_SHADER
+        if (std::isfinite(current_error))
+        {
+            ImGui::Text("Error: %.4f", static_cast<double>(current_error));
+        }
+#endif
 
         ImGui::Checkbox("Draw geometry", &draw_geometry);
+#ifndef NO_COMPUTE_SHADER
+        if (ImGui::Checkbox("Light tracing", &light_tracing))
+        {
+            if (light_tracing && !light_sums_buffer.get())
+            {
+                create_light_sums_buffer();
+            }
+            upload_scene();
+        }
+        if (wavefront_supported && ImGui::Checkbox("Wavefront", &wavefront))
+        {
+            if (wavefront && !paths_buffer.get())
+            {
+                create_wavefront_buffers();
+            }
+            upload_scene();
+        }
+        if (ImGui::Checkbox("Persistent threads", &persistent_threads))
+        {
+            upload_scene();
+        }
+        ImGui::SliderFloat("Error threshold",
+                           &error_threshold,
+                           0.0f,
+                           0.1f,
+                           "%.4f",
+                           ImGuiSliderFlags_Logarithmic);
+        ImGui::SliderFloat("Target error",
+                           &target_error,
+                           0.0f,
+                           0.1f,
+                           "%.4f",
+                           ImGuiSliderFlags_Logarithmic);
+#endif
+#ifndef __EMSCRIPTEN__
+        ImGui::SliderFloat("Auto-save interval (s)",
+                           &auto_save_interval,
+                           0.0f,
+                           600.0f,
+                           "%.0f");
+#endif
     }
     ImGui::End();
 
@@ -1428,62 +3526,44 @@ void Application::main_loop_update()
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
 
-    if (sample_index < max_samples)
-    {
-        const auto samples_this_frame =
-            std::min(samples_per_frame, max_samples - sample_index);
-        glUseProgram(trace_program.get());
-        glUniform1i(loc_sample_index, static_cast<int>(sample_index));
-        glUniform1i(loc_samples_per_frame,
-                    static_cast<int>(samples_this_frame));
-        glUniform2f(loc_view_position, scene.view_x, scene.view_y);
-        glUniform2f(loc_view_size, scene.view_width, scene.view_height);
-
 #ifndef NO_COMPUTE_SHADER
-        unsigned int num_groups_x {
-            align_up(static_cast<unsigned int>(texture_width), 16) / 16,
-        };
-        unsigned int num_groups_y {
-            align_up(static_cast<unsigned int>(texture_height), 16) / 16,
-        };
-
-        glDispatchCompute(num_groups_x, num_groups_y, 1);
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-
-        glUseProgram(post_program.get());
-        glDispatchCompute(num_groups_x, num_groups_y, 1);
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-#else
-        glBindFramebuffer(GL_FRAMEBUFFER, float_fbo.get());
-        glUniform2ui(loc_image_size,
-                     static_cast<unsigned int>(texture_width),
-                     static_cast<unsigned int>(texture_height));
-        glBindVertexArray(empty_vao.get());
-
-        // new_average = alpha * sample_average + (1 - alpha) * old_average
-        const auto alpha =
-            static_cast<float>(samples_this_frame) /
-            static_cast<float>(sample_index + samples_this_frame);
-        glBlendColor(alpha, alpha, alpha, alpha);
-        glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
-
-        glViewport(0, 0, texture_width, texture_height);
-
-        glDrawArrays(GL_TRIANGLES, 0, 3);
-
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (sample_index == 0)
+    {
+        current_error = std::numeric_limits<float>::infinity();
+    }
+#endif
 
-        glBindFramebuffer(GL_FRAMEBUFFER, fbo.get());
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, accumulation_texture.get());
-        glUseProgram(post_program.get());
+    const auto rendering = sample_index < max_samples && !has_converged();
+    const auto samples = dispatch_samples(max_samples);
+    if (rendering)
+    {
+        trace(samples);
+        post_process();
 
-        glDrawArrays(GL_TRIANGLES, 0, 3);
+#ifndef NO_COMPUTE_SHADER
+        // Reading back the error stalls the pipeline, so only do it from time
+        // to time
+        constexpr double error_interval {0.5};
+        if (const auto current_time = glfwGetTime();
+            !light_tracing && current_time - last_error_time >= error_interval)
+        {
+            static_cast<void>(measure_error());
+            last_error_time = current_time;
+        }
 #endif
+    }
 
-        sample_index += samples_this_frame;
-        sum_samples += samples_this_frame;
+#ifndef __EMSCRIPTEN__
+    update_export(false);
+    if (const auto current_time = glfwGetTime();
+        auto_save_interval > 0.0f &&
+        current_time - last_auto_save_time >=
+            static_cast<double>(auto_save_interval))
+    {
+        start_export("autosave.png");
+        last_auto_save_time = current_time;
     }
+#endif
 
     glViewport(viewport.x, viewport.y, viewport.width, viewport.height);
 
@@ -1503,40 +3583,42 @@ void Application::main_loop_update()
 
     if (draw_geometry)
     {
-        glBindVertexArray(vao.get());
-
+        // Every instance is a quad drawn as a strip of 4 vertices
         glUseProgram(circle_program.get());
         glUniform2f(loc_view_position_draw_circle, scene.view_x, scene.view_y);
         glUniform2f(
             loc_view_size_draw_circle, scene.view_width, scene.view_height);
-        glDrawElements(
-            GL_TRIANGLES,
-            static_cast<GLsizei>(raster_geometry.circle_indices_size),
-            GL_UNSIGNED_INT,
-            reinterpret_cast<void *>(raster_geometry.circle_indices_offset *
-                                     sizeof(std::uint32_t)));
+        glUniform1f(loc_thickness_draw_circle, thickness);
+        glBindVertexArray(circle_vao.get());
+        glDrawArraysInstanced(
+            GL_TRIANGLE_STRIP,
+            0,
+            4,
+            static_cast<GLsizei>(raster_geometry.circles.size()));
 
         glUseProgram(line_program.get());
         glUniform2f(loc_view_position_draw_line, scene.view_x, scene.view_y);
         glUniform2f(
             loc_view_size_draw_line, scene.view_width, scene.view_height);
-        glDrawElements(
-            GL_TRIANGLES,
-            static_cast<GLsizei>(raster_geometry.line_indices_size),
-            GL_UNSIGNED_INT,
-            reinterpret_cast<void *>(raster_geometry.line_indices_offset *
-                                     sizeof(std::uint32_t)));
+        glUniform1f(loc_thickness_draw_line, thickness);
+        glBindVertexArray(line_vao.get());
+        glDrawArraysInstanced(
+            GL_TRIANGLE_STRIP,
+            0,
+            4,
+            static_cast<GLsizei>(raster_geometry.lines.size()));
 
         glUseProgram(arc_program.get());
         glUniform2f(loc_view_position_draw_arc, scene.view_x, scene.view_y);
         glUniform2f(
             loc_view_size_draw_arc, scene.view_width, scene.view_height);
-        glDrawElements(
-            GL_TRIANGLES,
-            static_cast<GLsizei>(raster_geometry.arc_indices_size),
-            GL_UNSIGNED_INT,
-            reinterpret_cast<void *>(raster_geometry.arc_indices_offset *
-                                     sizeof(std::uint32_t)));
+        glUniform1f(loc_thickness_draw_arc, thickness);
+        glBindVertexArray(arc_vao.get());
+        glDrawArraysInstanced(
+            GL_TRIANGLE_STRIP,
+            0,
+            4,
+            static_cast<GLsizei>(raster_geometry.arcs.size()));
     }
 
 #ifndef __EMSCRIPTEN__
@@ -1550,40 +3632,12 @@ void Application::main_loop_update()
 
     glfwSwapBuffers(window.get());
 
-    ++num_frames;
-    const double current_time {glfwGetTime()};
-    if (const auto elapsed = current_time - last_time; elapsed >= 1.0)
-    {
-        std::cout << static_cast<double>(num_frames) / elapsed << " fps, "
-                  << samples_per_frame << " samples/frame, " << sum_samples
-                  << " samples/s, " << sample_index << " samples\n";
-        num_frames = 0;
-        last_time = current_time;
-        sum_samples = 0;
-    }
+    print_statistics();
 
-#ifndef __EMSCRIPTEN__
-    // NOTE: for some reason, GL_TIMESTAMP or GL_TIME_ELAPSED queries on
-    // Intel with Mesa drivers return non-sense numbers, rendering them
-    // useless. For this reason, we unfortunately cannot rely on GPU timing
-    // at all. We could technically have a workaround for this specific
-    // platform, but that also assumes that GL_RENDERER will always return a
-    // string correctly identifying the driver (what happens on WebGL?).
-    if (auto_workload && sample_index < max_samples)
+    if (rendering)
     {
-        GLuint64 start_time {};
-        GLuint64 end_time {};
-        glGetQueryObjectui64v(query_start.get(), GL_QUERY_RESULT, &start_time);
-        glGetQueryObjectui64v(query_end.get(), GL_QUERY_RESULT, &end_time);
-        const auto elapsed = static_cast<double>(end_time - start_time) / 1e9;
-        constexpr double target_compute_per_frame {0.014};
-        const auto samples_per_frame_f =
-            static_cast<double>(samples_per_frame) * target_compute_per_frame /
-            elapsed;
-        samples_per_frame =
-            static_cast<unsigned int>(std::max(samples_per_frame_f, 1.0));
+        update_workload(samples, 0.014);
     }
-#endif
 }
 
 } // namespace
@@ -1619,5 +3673,324 @@ void run()
         app.main_loop_update();
     }
 
+    // The export buffer must be unmapped before the context is destroyed
+    app.update_export(true);
+
 #endif
 }
+
+#ifndef __EMSCRIPTEN__
+
+Render_statistics run_headless(const Render_options &options)
+{
+    const auto output_file_name = options.output_path.string();
+
+    if (!options.merge_directory.empty())
+    {
+        merge_partial_renders(options.merge_directory,
+                              output_file_name,
+                              options.hdr_output_path);
+        return {};
+    }
+
+    Render_statistics statistics {};
+    const auto seconds_since = [](std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                             start)
+            .count();
+    };
+
+    if (options.cpu)
+    {
+        const auto scene = load_render_scene(options);
+        const auto compiled = compile_scene(scene);
+        const auto bvh =
+            should_use_bvh(compiled) ? build_bvh(compiled) : Bvh {};
+        const auto emitters = build_emitters(compiled);
+        Thread_pool pool(options.threads);
+        std::cout << "Rendering on " << pool.size() << " CPU threads\n";
+
+        auto accumulation =
+            create_accumulation_buffer(options.width, options.height);
+        unsigned int sample_index {0};
+        const auto start_time = std::chrono::steady_clock::now();
+        auto last_time = start_time;
+        while (sample_index < options.samples)
+        {
+            // Small passes only so that progress can be reported regularly
+            constexpr unsigned int samples_per_pass {4};
+            const auto samples =
+                std::min(samples_per_pass, options.samples - sample_index);
+            const auto rays = cpu_trace(pool,
+                                        scene,
+                                        compiled,
+                                        bvh,
+                                        emitters,
+                                        sample_index,
+                                        samples,
+                                        accumulation);
+            statistics.path_rays += rays.path_rays;
+            statistics.shadow_rays += rays.shadow_rays;
+            sample_index += samples;
+
+            const auto current_time = std::chrono::steady_clock::now();
+            if (current_time - last_time >= std::chrono::seconds(1))
+            {
+                std::cout << sample_index << " samples\n";
+                last_time = current_time;
+            }
+        }
+        statistics.trace_seconds = seconds_since(start_time);
+        statistics.samples = sample_index;
+
+        auto pixels = tone_map(accumulation);
+        write_png(output_file_name.c_str(),
+                  options.width,
+                  options.height,
+                  pixels);
+
+        if (!options.hdr_output_path.empty())
+        {
+            // The CPU tracer averages the weights of the samples instead of
+            // counting them, and always traces all samples of all pixels
+            for (auto &pixel : accumulation.pixels)
+            {
+                pixel.w = static_cast<float>(sample_index);
+            }
+            write_exr(options.hdr_output_path,
+                      options.width,
+                      options.height,
+                      sample_index,
+                      accumulation.pixels);
+        }
+        return statistics;
+    }
+
+    Application app {};
+    app.init_headless(options);
+
+    const std::chrono::duration<float> checkpoint_interval {
+        options.checkpoint_interval};
+    auto last_checkpoint_time = std::chrono::steady_clock::now();
+
+    // Traces the tile in the accumulation textures up to the given number of
+    // samples, or until its error reaches the target error. Returns whether
+    // the target error was reached.
+    const auto trace_tile = [&](unsigned int max_samples)
+    {
+        while (app.sample_index < max_samples)
+        {
+            if (app.auto_workload)
+            {
+                glQueryCounter(app.query_start.get(), GL_TIMESTAMP);
+            }
+
+            auto samples = app.dispatch_samples(max_samples);
+            if (app.error_threshold > 0.0f)
+            {
+                // Pixels can only stop sampling between dispatches
+                constexpr unsigned int max_adaptive_samples_per_frame {32};
+                samples = std::min(samples, max_adaptive_samples_per_frame);
+            }
+            app.trace(samples);
+
+            if (app.auto_workload)
+            {
+                glQueryCounter(app.query_end.get(), GL_TIMESTAMP);
+            }
+
+            // Without V-Sync or UI to wait for, each dispatch can be much
+            // bigger than in interactive mode, but should stay well below the
+            // driver watchdog timeout.
+            app.update_workload(samples, 0.1);
+            app.print_statistics();
+
+            if (!app.checkpoint_path.empty())
+            {
+                app.update_checkpoint(false);
+                const auto current_time = std::chrono::steady_clock::now();
+                if (current_time - last_checkpoint_time >= checkpoint_interval)
+                {
+                    app.start_checkpoint();
+                    last_checkpoint_time = current_time;
+                }
+            }
+
+            if (app.target_error > 0.0f &&
+                app.measure_error() <= app.target_error)
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    if (app.texture_width == options.width &&
+        app.texture_height == options.height)
+    {
+        const auto start_time = std::chrono::steady_clock::now();
+        statistics.reached_target_error = trace_tile(options.samples);
+        glFinish();
+        statistics.trace_seconds = seconds_since(start_time);
+        statistics.samples = app.sample_index;
+        statistics.path_rays = app.path_rays;
+        statistics.shadow_rays = app.shadow_rays;
+        if (statistics.reached_target_error)
+        {
+            std::cout << "Reached an error of " << app.current_error
+                      << " after " << app.sample_index << " samples\n";
+        }
+
+        // The final checkpoint lets a later render resume with more samples
+        if (!app.checkpoint_path.empty())
+        {
+            app.update_checkpoint(true);
+            app.start_checkpoint();
+            app.update_checkpoint(true);
+        }
+
+        app.post_process();
+        save_as_png(output_file_name.c_str(),
+                    app.texture_width,
+                    app.texture_height,
+                    app.target_texture.get());
+
+        if (!options.hdr_output_path.empty())
+        {
+            std::vector<vec4> accumulation(
+                static_cast<std::size_t>(app.texture_width) *
+                static_cast<std::size_t>(app.texture_height));
+            glBindTexture(GL_TEXTURE_2D, app.accumulation_texture.get());
+            glGetTexImage(
+                GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, accumulation.data());
+            glBindTexture(GL_TEXTURE_2D, 0);
+            write_exr(options.hdr_output_path,
+                      app.texture_width,
+                      app.texture_height,
+                      app.sample_index,
+                      accumulation);
+        }
+        return statistics;
+    }
+
+    // The GPU traces one tile at a time, the whole image only lives in the
+    // tiled image. Each visit of a tile at least doubles its number of
+    // samples, so that the transfers stay negligible while the noisiest tiles
+    // are always refined first.
+    const Tiled_image image(options.width,
+                            options.height,
+                            options.tile_size,
+                            options.out_of_core_path);
+    auto tiles = create_tiles(options.width, options.height, options.tile_size);
+    std::cout << "Rendering " << tiles.size() << " tiles\n";
+    const auto start_time = std::chrono::steady_clock::now();
+
+    while (const auto tile_index =
+               next_tile(tiles, options.samples, app.target_error))
+    {
+        auto &tile = tiles[*tile_index];
+        app.load_tile(tile, image);
+
+        // The tile traced next is most likely the noisiest of the others,
+        // which can be paged in while the GPU is busy
+        if (const auto prefetched_index = next_tile(
+                tiles, options.samples, app.target_error, tile_index))
+        {
+            image.prefetch(tiles[*prefetched_index]);
+        }
+
+        constexpr unsigned int min_samples_per_visit {16};
+        const auto samples_per_visit =
+            std::max(tile.sample_index, min_samples_per_visit);
+        trace_tile(std::min(options.samples,
+                            tile.sample_index + samples_per_visit));
+
+        tile.sample_index = app.sample_index;
+        tile.error = app.measure_error();
+        app.store_tile(tile, image);
+        image.evict(tile);
+
+        const auto error = mean_error(tiles);
+        if (app.target_error > 0.0f && error <= app.target_error)
+        {
+            std::cout << "Reached an error of " << error << '\n';
+            statistics.reached_target_error = true;
+            break;
+        }
+    }
+    statistics.trace_seconds = seconds_since(start_time);
+    statistics.samples =
+        std::ranges::max(tiles, {}, &Tile::sample_index).sample_index;
+    statistics.path_rays = app.path_rays;
+    statistics.shadow_rays = app.shadow_rays;
+
+    // post.glsl tone maps the tiles one at a time, only the final 8-bit image
+    // is stored whole
+    std::vector<std::uint8_t> pixels(static_cast<std::size_t>(options.width) *
+                                     static_cast<std::size_t>(options.height) *
+                                     4);
+    for (std::size_t i {0}; i < tiles.size(); ++i)
+    {
+        if (i + 1 < tiles.size())
+        {
+            image.prefetch(tiles[i + 1]);
+        }
+        app.load_tile(tiles[i], image);
+        app.post_process();
+        app.read_target_tile(tiles[i], pixels);
+        image.evict(tiles[i]);
+    }
+
+    write_png(
+        output_file_name.c_str(), options.width, options.height, pixels);
+
+    if (!options.hdr_output_path.empty())
+    {
+        // Rows of the image are gathered from one row of tiles at a time, so
+        // that only those tiles need to be in memory
+        std::cout << "Saving " << options.width << " x " << options.height
+                  << " HDR image to \"" << options.hdr_output_path.string()
+                  << "\"\n";
+        const auto max_tile = std::ranges::max_element(
+            tiles, {}, [](const Tile &tile) { return tile.sample_index; });
+        Exr_writer writer(options.hdr_output_path,
+                          options.width,
+                          options.height,
+                          max_tile->sample_index);
+        std::vector<vec4> row(static_cast<std::size_t>(options.width));
+        const auto tile_size = static_cast<std::size_t>(options.tile_size);
+        for (auto first = tiles.begin(); first != tiles.end();)
+        {
+            const auto last = std::ranges::find_if(
+                first,
+                tiles.end(),
+                [&](const Tile &tile) { return tile.y != first->y; });
+            for (std::size_t y {0};
+                 y < static_cast<std::size_t>(first->height);
+                 ++y)
+            {
+                for (auto tile = first; tile != last; ++tile)
+                {
+                    const auto tile_row =
+                        image.accumulation(*tile).subspan(
+                            y * tile_size,
+                            static_cast<std::size_t>(tile->width));
+                    std::ranges::copy(tile_row,
+                                      row.begin() + tile->x);
+                }
+                writer.write_row(row);
+            }
+            for (auto tile = first; tile != last; ++tile)
+            {
+                image.evict(*tile);
+            }
+            first = last;
+        }
+        writer.close();
+    }
+
+    return statistics;
+}
+
+#endif
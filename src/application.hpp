@@ -1,6 +1,85 @@
 #ifndef APPLICATION_HPP
 #define APPLICATION_HPP
 
+#include <cstdint>
+#include <filesystem>
+
+struct Render_options
+{
+    // An empty path selects the built-in scene from create_scene()
+    std::filesystem::path scene_path;
+    std::filesystem::path output_path;
+    // OpenEXR image of the accumulated radiance and sample counts written
+    // along with the PNG image, empty to disable
+    std::filesystem::path hdr_output_path;
+    int width;
+    int height;
+    // Maximum number of samples per pixel
+    unsigned int samples;
+    // Relative error under which pixels stop sampling, 0 to disable adaptive
+    // sampling. GPU only.
+    float error_threshold;
+    // Mean relative error of all pixels at which rendering stops before
+    // reaching the maximum number of samples, 0 to disable. GPU only.
+    float target_error;
+    // Trace paths from the emitters instead of from the pixels. GPU only.
+    bool light_tracing;
+    // Trace camera paths one bounce at a time with the wavefront kernels.
+    // GPU only.
+    bool wavefront;
+    // Trace pixels pulled from a shared counter by a fixed number of threads.
+    // GPU only.
+    bool persistent_threads;
+    // Size of the square tiles traced one at a time, so that only one tile
+    // of the image is stored on the GPU, 0 to trace the whole image at once.
+    // GPU only.
+    int tile_size;
+    // File storing the image while it is traced in tiles, so that only the
+    // tiles in use are in memory. Empty to keep the whole image in memory.
+    std::filesystem::path out_of_core_path;
+    // File to which the render state is saved periodically, empty to disable
+    // checkpoints. GPU only, without tiles.
+    std::filesystem::path checkpoint_path;
+    // Seconds between checkpoints
+    float checkpoint_interval;
+    // Continue the render saved in checkpoint_path instead of starting over
+    bool resume;
+    // Directory shared by the workers of a distributed render, empty to render
+    // alone. Each worker claims an index, traces its own range of samples and
+    // saves them as a checkpoint in the directory.
+    std::filesystem::path worker_directory;
+    // Directory of a distributed render whose partial renders are merged into
+    // the output image instead of rendering, empty to render
+    std::filesystem::path merge_directory;
+    bool cpu;
+    // Number of CPU threads, 0 for all available cores
+    unsigned int threads;
+    // Count the rays traced by the GPU, which reads back the counts after
+    // every dispatch. The CPU tracer always counts them.
+    bool count_rays;
+};
+
+// Outcome of a headless render
+struct Render_statistics
+{
+    // Time spent tracing, without the setup and the output of the image
+    double trace_seconds;
+    // Samples per pixel traced, at most Render_options::samples. With adaptive
+    // sampling, the pixels that stopped early have fewer.
+    unsigned int samples;
+    // Whether the render stopped because the mean relative error of its pixels
+    // reached Render_options::target_error
+    bool reached_target_error;
+    // Rays traced along the paths and towards the emitters, 0 on the GPU
+    // unless Render_options::count_rays is set
+    std::uint64_t path_rays;
+    std::uint64_t shadow_rays;
+};
+
 void run();
 
+// Renders the scene to the requested sample count without any window or UI,
+// writes the resulting image and returns.
+Render_statistics run_headless(const Render_options &options);
+
 #endif
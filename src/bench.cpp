@@ -0,0 +1,635 @@
+#include "application.hpp"
+#include "bvh.hpp"
+#include "compiled_scene.hpp"
+#include "cpu_tracer.hpp"
+#include "emitters.hpp"
+#include "scene.hpp"
+#include "thread_pool.hpp"
+#include "vec.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numbers>
+#include <optional>
+#include <random>
+#include <ranges>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+
+constexpr auto usage =
+    "Usage: caustics_bench [options]\n"
+    "\n"
+    "Renders a fixed set of generated scenes and writes their throughput as\n"
+    "JSON. Each scene is rendered until the mean relative error of its pixels\n"
+    "reaches --threshold, or until --samples samples per pixel.\n"
+    "\n"
+    "Options:\n"
+    "  --out <file>       JSON report (default: bench.json)\n"
+    "  --scenes <names>   Comma-separated scenes to render (default: all)\n"
+    "  --width <n>        Image width in pixels (default: 640)\n"
+    "  --height <n>       Image height in pixels (default: 360)\n"
+    "  --samples <n>      Maximum samples per pixel (default: 256)\n"
+    "  --threshold <x>    Mean relative error of the pixels at which the time\n"
+    "                     to threshold is taken, 0 to always render --samples\n"
+    "                     samples (default: 0.05)\n"
+    "  --cpu              Render on the CPU instead of the GPU\n"
+    "  --threads <n>      Number of CPU threads (default: all cores)\n"
+    "  --help             Show this message\n"
+    "\n"
+    "Scenes: default, circles_1k, circles_10k, circles_100k, lenses,\n"
+    "corridors\n";
+
+struct Bench_options
+{
+    std::filesystem::path output_path;
+    std::vector<std::string> scenes;
+    int width;
+    int height;
+    unsigned int samples;
+    float threshold;
+    bool cpu;
+    unsigned int threads;
+};
+
+struct Bench_result
+{
+    std::size_t primitives;
+    double seconds;
+    unsigned int samples;
+    Trace_statistics rays;
+    std::optional<double> time_to_threshold;
+};
+
+template <typename T>
+[[nodiscard]] T parse_number(std::string_view option, std::string_view value)
+{
+    T result {};
+    const auto [ptr, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), result);
+    if (ec != std::errc {} || ptr != value.data() + value.size())
+    {
+        std::ostringstream message;
+        message << "Invalid value \"" << value << "\" for " << option;
+        throw std::runtime_error(message.str());
+    }
+    return result;
+}
+
+// Generated scenes share their view and materials
+enum Bench_material : std::uint32_t
+{
+    light,
+    diffuse,
+    mirror,
+    glass,
+    tinted_glass
+};
+
+[[nodiscard]] Scene make_empty_scene(int width, int height)
+{
+    const auto aspect_ratio =
+        static_cast<float>(height) / static_cast<float>(width);
+    return {.view_x = 0.5f,
+            .view_y = 0.5f * aspect_ratio,
+            .view_width = 1.0f,
+            .view_height = aspect_ratio,
+            .materials = {Material {{0.75f, 0.75f, 0.75f},
+                                    {6.0f, 6.0f, 6.0f},
+                                    Material_type::diffuse},
+                          Material {{0.75f, 0.75f, 0.75f},
+                                    {},
+                                    Material_type::diffuse},
+                          Material {{0.9f, 0.9f, 0.9f},
+                                    {},
+                                    Material_type::specular},
+                          Material {{1.0f, 1.0f, 1.0f},
+                                    {},
+                                    Material_type::dielectric},
+                          Material {{0.25f, 0.75f, 0.75f},
+                                    {},
+                                    Material_type::dielectric}},
+            .circles = {},
+            .lines = {},
+            .arcs = {}};
+}
+
+// Reproducible on every platform, unlike the standard distributions
+[[nodiscard]] float uniform(std::mt19937 &rng, float min, float max)
+{
+    constexpr auto scale = 1.0f / static_cast<float>(1u << 24);
+    return min + (max - min) * static_cast<float>(rng() >> 8) * scale;
+}
+
+// Circles of random sizes and materials covering about a fifth of the view,
+// lit by a few lights spread over it
+[[nodiscard]] Scene make_random_circles(int width, int height, int count)
+{
+    auto scene = make_empty_scene(width, height);
+    std::mt19937 rng {1};
+
+    const auto area = scene.view_width * scene.view_height;
+    const auto mean_radius = std::sqrt(
+        0.2f * area / (std::numbers::pi_v<float> * static_cast<float>(count)));
+    scene.circles.reserve(static_cast<std::size_t>(count));
+    for (int i {0}; i < count; ++i)
+    {
+        const auto material = diffuse + static_cast<std::uint32_t>(
+                                            rng() % (tinted_glass - light));
+        scene.circles.push_back(
+            {.center = {uniform(rng, 0.0f, scene.view_width),
+                        uniform(rng, 0.0f, scene.view_height)},
+             .radius = mean_radius * uniform(rng, 0.5f, 1.5f),
+             .material_id = material});
+    }
+    for (int i {0}; i < 4; ++i)
+    {
+        scene.circles.push_back(
+            {.center = {uniform(rng, 0.0f, scene.view_width),
+                        uniform(rng, 0.0f, scene.view_height)},
+             .radius = 0.02f,
+             .material_id = light});
+    }
+    return scene;
+}
+
+[[nodiscard]] Scene make_circles_1k(int width, int height)
+{
+    return make_random_circles(width, height, 1'000);
+}
+
+[[nodiscard]] Scene make_circles_10k(int width, int height)
+{
+    return make_random_circles(width, height, 10'000);
+}
+
+[[nodiscard]] Scene make_circles_100k(int width, int height)
+{
+    return make_random_circles(width, height, 100'000);
+}
+
+// Rows of biconvex glass lenses in random orientations, lit from the left, so
+// that most paths go through many refractions
+[[nodiscard]] Scene make_lenses(int width, int height)
+{
+    auto scene = make_empty_scene(width, height);
+    std::mt19937 rng {2};
+
+    constexpr int columns {32};
+    const auto rows = std::max(
+        1, static_cast<int>(static_cast<float>(columns) * scene.view_height));
+    const auto spacing = scene.view_width / static_cast<float>(columns);
+    // Each lens is the intersection of two disks, bounded by an arc of each
+    const auto radius = 0.6f * spacing;
+    const auto offset = 0.45f * spacing;
+    for (int row {0}; row < rows; ++row)
+    {
+        for (int column {1}; column < columns; ++column)
+        {
+            const vec2 center {(static_cast<float>(column) + 0.5f) * spacing,
+                               (static_cast<float>(row) + 0.5f) * spacing};
+            const auto angle =
+                uniform(rng, 0.0f, 2.0f * std::numbers::pi_v<float>);
+            const vec2 axis {std::cos(angle), std::sin(angle)};
+            scene.arcs.push_back({.center = center - axis * offset,
+                                  .radius = radius,
+                                  .a = axis,
+                                  .b = offset,
+                                  .material_id = glass});
+            scene.arcs.push_back({.center = center + axis * offset,
+                                  .radius = radius,
+                                  .a = -axis,
+                                  .b = offset,
+                                  .material_id = glass});
+        }
+    }
+    scene.circles.push_back(
+        {.center = {0.5f * spacing, 0.5f * scene.view_height},
+         .radius = 0.25f * spacing,
+         .material_id = light});
+    return scene;
+}
+
+// Narrow corridors between parallel mirrors across the view, lit at one end
+// and closed by a diffuse wall at the other, so that most paths bounce until
+// the maximum depth
+[[nodiscard]] Scene make_corridors(int width, int height)
+{
+    auto scene = make_empty_scene(width, height);
+
+    constexpr int count {8};
+    const auto pitch = scene.view_height / static_cast<float>(count);
+    const auto corridor_height = 0.25f * pitch;
+    const auto x_min = 0.02f * scene.view_width;
+    const auto x_max = 0.98f * scene.view_width;
+    for (int i {0}; i < count; ++i)
+    {
+        const auto y_min = (static_cast<float>(i) + 0.5f) * pitch -
+                           0.5f * corridor_height;
+        const auto y_max = y_min + corridor_height;
+        scene.lines.push_back(
+            {.a = {x_min, y_min}, .b = {x_max, y_min}, .material_id = mirror});
+        scene.lines.push_back(
+            {.a = {x_min, y_max}, .b = {x_max, y_max}, .material_id = mirror});
+        scene.lines.push_back(
+            {.a = {x_max, y_min}, .b = {x_max, y_max}, .material_id = diffuse});
+        scene.circles.push_back({.center = {x_min + corridor_height,
+                                            0.5f * (y_min + y_max)},
+                                 .radius = 0.25f * corridor_height,
+                                 .material_id = light});
+    }
+    return scene;
+}
+
+struct Bench_scene
+{
+    const char *name;
+    Scene (*create)(int width, int height);
+};
+
+constexpr Bench_scene bench_scenes[] {{"default", create_scene},
+                                      {"circles_1k", make_circles_1k},
+                                      {"circles_10k", make_circles_10k},
+                                      {"circles_100k", make_circles_100k},
+                                      {"lenses", make_lenses},
+                                      {"corridors", make_corridors}};
+
+// Returns no options if --help was given
+[[nodiscard]] std::optional<Bench_options> parse_options(int argc, char *argv[])
+{
+    Bench_options options {.output_path = "bench.json",
+                           .scenes = {},
+                           .width = 640,
+                           .height = 360,
+                           .samples = 256,
+                           .threshold = 0.05f,
+                           .cpu = false,
+                           .threads = 0};
+
+    for (int i {1}; i < argc; ++i)
+    {
+        const std::string_view option {argv[i]};
+
+        if (option == "--help")
+        {
+            return std::nullopt;
+        }
+        if (option == "--cpu")
+        {
+            options.cpu = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::ostringstream message;
+            message << "Unknown option or missing value: " << option << "\n\n"
+                    << usage;
+            throw std::runtime_error(message.str());
+        }
+        const std::string_view value {argv[++i]};
+
+        if (option == "--out")
+        {
+            options.output_path = value;
+        }
+        else if (option == "--scenes")
+        {
+            for (const auto name : std::views::split(value, ','))
+            {
+                options.scenes.emplace_back(name.begin(), name.end());
+            }
+        }
+        else if (option == "--width")
+        {
+            options.width = parse_number<int>(option, value);
+        }
+        else if (option == "--height")
+        {
+            options.height = parse_number<int>(option, value);
+        }
+        else if (option == "--samples")
+        {
+            options.samples = parse_number<unsigned int>(option, value);
+        }
+        else if (option == "--threshold")
+        {
+            options.threshold = parse_number<float>(option, value);
+        }
+        else if (option == "--threads")
+        {
+            options.threads = parse_number<unsigned int>(option, value);
+        }
+        else
+        {
+            std::ostringstream message;
+            message << "Unknown option: " << option << "\n\n" << usage;
+            throw std::runtime_error(message.str());
+        }
+    }
+
+    if (options.width <= 0 || options.height <= 0 || options.samples == 0)
+    {
+        throw std::runtime_error(
+            "The image size and the number of samples must be positive");
+    }
+    for (const auto &name : options.scenes)
+    {
+        if (std::ranges::none_of(bench_scenes,
+                                 [&](const Bench_scene &scene)
+                                 { return scene.name == name; }))
+        {
+            throw std::runtime_error("Unknown scene: " + name);
+        }
+    }
+
+    return options;
+}
+
+[[nodiscard]] double luminance(const vec4 &color) noexcept
+{
+    return 0.2126 * static_cast<double>(color.x) +
+           0.7152 * static_cast<double>(color.y) +
+           0.0722 * static_cast<double>(color.z);
+}
+
+// The CPU tracer keeps no second moments, so the error of each pixel is
+// estimated from the spread of the means of its successive batches of samples
+class Batch_error
+{
+public:
+    explicit Batch_error(std::size_t num_pixels)
+        : m_previous(num_pixels), m_sums(num_pixels), m_squared_sums(num_pixels)
+    {
+    }
+
+    // Adds the batch of samples traced since the last call, and returns the
+    // mean relative standard error of the pixels, clamped as in reduce.glsl
+    [[nodiscard]] double add_batch(const Accumulation_buffer &accumulation,
+                                   unsigned int old_samples,
+                                   unsigned int new_samples)
+    {
+        ++m_num_batches;
+        const auto k = static_cast<double>(m_num_batches);
+        const auto old_weight = static_cast<double>(old_samples);
+        const auto new_weight = static_cast<double>(new_samples);
+
+        double error_sum {0.0};
+        for (std::size_t i {0}; i < m_previous.size(); ++i)
+        {
+            const auto mean = luminance(accumulation.pixels[i]);
+            const auto batch_mean =
+                (mean * new_weight - m_previous[i] * old_weight) /
+                (new_weight - old_weight);
+            m_previous[i] = mean;
+            m_sums[i] += batch_mean;
+            m_squared_sums[i] += batch_mean * batch_mean;
+
+            if (m_num_batches < min_batches)
+            {
+                error_sum += 1.0;
+                continue;
+            }
+            const auto variance = std::max(
+                (m_squared_sums[i] - m_sums[i] * m_sums[i] / k) / (k - 1.0),
+                0.0);
+            const auto relative_error =
+                std::sqrt(variance / k) / std::max(mean, 1e-3);
+            error_sum += std::min(relative_error, 1.0);
+        }
+        return error_sum / static_cast<double>(m_previous.size());
+    }
+
+private:
+    // The spread of fewer batches is too unreliable an estimate of the error
+    static constexpr unsigned int min_batches {4};
+
+    std::vector<double> m_previous;
+    std::vector<double> m_sums;
+    std::vector<double> m_squared_sums;
+    unsigned int m_num_batches {0};
+};
+
+[[nodiscard]] Bench_result
+bench_cpu(const Scene &scene, const Bench_options &options, Thread_pool &pool)
+{
+    const auto compiled = compile_scene(scene);
+    const auto bvh = should_use_bvh(compiled) ? build_bvh(compiled) : Bvh {};
+    const auto emitters = build_emitters(compiled);
+
+    Bench_result result {.primitives = primitive_count(compiled),
+                         .seconds = 0.0,
+                         .samples = 0,
+                         .rays = {},
+                         .time_to_threshold = {}};
+    auto accumulation =
+        create_accumulation_buffer(options.width, options.height);
+    Batch_error error(accumulation.pixels.size());
+
+    const auto start_time = std::chrono::steady_clock::now();
+    while (result.samples < options.samples)
+    {
+        constexpr unsigned int samples_per_batch {4};
+        const auto samples =
+            std::min(samples_per_batch, options.samples - result.samples);
+        const auto statistics = cpu_trace(pool,
+                                          scene,
+                                          compiled,
+                                          bvh,
+                                          emitters,
+                                          result.samples,
+                                          samples,
+                                          accumulation);
+        result.rays.path_rays += statistics.path_rays;
+        result.rays.shadow_rays += statistics.shadow_rays;
+        const auto mean_error = error.add_batch(
+            accumulation, result.samples, result.samples + samples);
+        result.samples += samples;
+        result.seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start_time)
+                             .count();
+
+        if (mean_error <= static_cast<double>(options.threshold))
+        {
+            result.time_to_threshold = result.seconds;
+            break;
+        }
+    }
+
+    return result;
+}
+
+// The GPU renders go through run_headless like those of caustics, with the
+// scene and the image in temporary files. Counting the rays reads them back
+// after every dispatch, which is included in the time.
+[[nodiscard]] Bench_result bench_gpu(const Scene &scene,
+                                     const Bench_options &options)
+{
+    const auto directory = std::filesystem::temp_directory_path();
+    const auto scene_path = directory / "caustics_bench_scene.json";
+    const auto image_path = directory / "caustics_bench_image.png";
+    if (const auto saved = save_scene(scene, scene_path); !saved)
+    {
+        throw std::runtime_error("Failed to save the scene to \"" +
+                                 scene_path.string() +
+                                 "\": " + saved.error());
+    }
+
+    const auto statistics =
+        run_headless({.scene_path = scene_path,
+                      .output_path = image_path,
+                      .hdr_output_path = {},
+                      .width = options.width,
+                      .height = options.height,
+                      .samples = options.samples,
+                      .error_threshold = 0.0f,
+                      .target_error = options.threshold,
+                      .light_tracing = false,
+                      .wavefront = false,
+                      .persistent_threads = false,
+                      .tile_size = 0,
+                      .out_of_core_path = {},
+                      .checkpoint_path = {},
+                      .checkpoint_interval = 0.0f,
+                      .resume = false,
+                      .worker_directory = {},
+                      .merge_directory = {},
+                      .cpu = false,
+                      .threads = 0,
+                      .count_rays = true});
+    std::filesystem::remove(scene_path);
+    std::filesystem::remove(image_path);
+
+    const auto compiled = compile_scene(scene);
+    Bench_result result {.primitives = primitive_count(compiled),
+                         .seconds = statistics.trace_seconds,
+                         .samples = statistics.samples,
+                         .rays = {.path_rays = statistics.path_rays,
+                                  .shadow_rays = statistics.shadow_rays},
+                         .time_to_threshold = {}};
+    if (statistics.reached_target_error)
+    {
+        result.time_to_threshold = statistics.trace_seconds;
+    }
+    return result;
+}
+
+template <typename T>
+[[nodiscard]] nlohmann::json to_json(const std::optional<T> &value)
+{
+    return value ? nlohmann::json(*value) : nlohmann::json(nullptr);
+}
+
+[[nodiscard]] nlohmann::json to_json(const char *name,
+                                     const Bench_result &result,
+                                     const Bench_options &options)
+{
+    const auto pixels = static_cast<double>(options.width) *
+                        static_cast<double>(options.height);
+    const auto samples = pixels * static_cast<double>(result.samples);
+
+    const auto rays = static_cast<double>(result.rays.path_rays +
+                                          result.rays.shadow_rays);
+
+    return {{"name", name},
+            {"primitives", result.primitives},
+            {"seconds", result.seconds},
+            {"samples_per_pixel", result.samples},
+            {"samples_per_second", samples / result.seconds},
+            {"rays_per_second", rays / result.seconds},
+            {"average_path_length",
+             static_cast<double>(result.rays.path_rays) / samples},
+            {"time_to_threshold", to_json(result.time_to_threshold)}};
+}
+
+void run_bench(const Bench_options &options)
+{
+    std::optional<Thread_pool> pool;
+    if (options.cpu)
+    {
+        pool.emplace(options.threads);
+        std::cout << "Rendering on " << pool->size() << " CPU threads\n";
+    }
+
+    nlohmann::json report {{"device", options.cpu ? "cpu" : "gpu"},
+                           {"threads", pool ? pool->size() : 0u},
+                           {"width", options.width},
+                           {"height", options.height},
+                           {"max_samples", options.samples},
+                           {"threshold", options.threshold},
+                           {"scenes", nlohmann::json::array()}};
+
+    for (const auto &bench_scene : bench_scenes)
+    {
+        if (!options.scenes.empty() &&
+            std::ranges::find(options.scenes, bench_scene.name) ==
+                options.scenes.end())
+        {
+            continue;
+        }
+
+        std::cout << "Rendering " << bench_scene.name << '\n';
+        const auto scene = bench_scene.create(options.width, options.height);
+        const auto result = options.cpu ? bench_cpu(scene, options, *pool)
+                                        : bench_gpu(scene, options);
+        auto scene_report = to_json(bench_scene.name, result, options);
+        std::cout << scene_report.dump(4) << '\n';
+        report["scenes"].push_back(std::move(scene_report));
+    }
+
+    std::ofstream file(options.output_path);
+    file << report.dump(4) << '\n';
+    if (!file)
+    {
+        throw std::runtime_error("Failed to write \"" +
+                                 options.output_path.string() + '"');
+    }
+    std::cout << "Saved report to \"" << options.output_path.string()
+              << "\"\n";
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        const auto options = parse_options(argc, argv);
+        if (!options.has_value())
+        {
+            std::cout << usage;
+            return EXIT_SUCCESS;
+        }
+
+        run_bench(*options);
+
+        return EXIT_SUCCESS;
+    }
+    catch (const std::exception &e)
+    {
+        std::cout.flush();
+        std::cerr << "Exception thrown: " << e.what() << '\n';
+        return EXIT_FAILURE;
+    }
+    catch (...)
+    {
+        std::cout.flush();
+        std::cerr << "Unknown exception thrown\n";
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,352 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <utility>
+
+namespace
+{
+
+struct Build_primitive
+{
+    Aabb bounds;
+    vec2 centroid;
+    std::uint32_t ref;
+};
+
+struct Bin
+{
+    Aabb bounds;
+    std::size_t count;
+};
+
+constexpr std::size_t num_bins {16};
+constexpr std::size_t min_leaf_size {2};
+constexpr std::size_t max_leaf_size {8};
+constexpr float traversal_cost {1.0f};
+constexpr float intersection_cost {1.0f};
+
+// The 2D equivalent of the surface area used by the SAH
+[[nodiscard]] constexpr float half_perimeter(const Aabb &a) noexcept
+{
+    if (a.min.x > a.max.x)
+    {
+        return 0.0f;
+    }
+    return (a.max.x - a.min.x) + (a.max.y - a.min.y);
+}
+
+[[nodiscard]] constexpr float component(const vec2 &v, int axis) noexcept
+{
+    return axis == 0 ? v.x : v.y;
+}
+
+struct Builder
+{
+    std::vector<Build_primitive> primitives;
+    std::vector<Bvh_node> nodes;
+
+    void build(std::size_t begin, std::size_t end, std::uint32_t depth);
+    void make_leaf(std::size_t node_index, std::size_t begin, std::size_t end);
+};
+
+void Builder::make_leaf(std::size_t node_index,
+                        std::size_t begin,
+                        std::size_t end)
+{
+    nodes[node_index].offset = static_cast<std::uint32_t>(begin);
+    nodes[node_index].count = static_cast<std::uint32_t>(end - begin);
+}
+
+void Builder::build(std::size_t begin, std::size_t end, std::uint32_t depth)
+{
+    const auto node_index = nodes.size();
+    nodes.push_back({});
+
+    auto bounds = empty_aabb();
+    auto centroid_bounds = empty_aabb();
+    for (auto i = begin; i < end; ++i)
+    {
+        bounds = merge(bounds, primitives[i].bounds);
+        centroid_bounds = merge(centroid_bounds, primitives[i].centroid);
+    }
+    nodes[node_index].aabb_min = bounds.min;
+    nodes[node_index].aabb_max = bounds.max;
+
+    const auto count = end - begin;
+    if (count <= min_leaf_size || depth + 1 >= bvh_max_depth)
+    {
+        make_leaf(node_index, begin, end);
+        return;
+    }
+
+    // Binned SAH: evaluate the cost of splitting between each pair of
+    // consecutive bins along both axes.
+    auto best_cost = std::numeric_limits<float>::infinity();
+    int best_axis {-1};
+    std::size_t best_split {0};
+    for (int axis {0}; axis < 2; ++axis)
+    {
+        const auto axis_min = component(centroid_bounds.min, axis);
+        const auto axis_extent =
+            component(centroid_bounds.max, axis) - axis_min;
+        if (axis_extent <= 0.0f)
+        {
+            continue;
+        }
+
+        std::array<Bin, num_bins> bins {};
+        bins.fill({empty_aabb(), 0});
+        const auto scale = static_cast<float>(num_bins) / axis_extent;
+        for (auto i = begin; i < end; ++i)
+        {
+            const auto bin_index = std::min(
+                static_cast<std::size_t>(
+                    (component(primitives[i].centroid, axis) - axis_min) *
+                    scale),
+                num_bins - 1);
+            bins[bin_index].bounds =
+                merge(bins[bin_index].bounds, primitives[i].bounds);
+            ++bins[bin_index].count;
+        }
+
+        // Sweep from the right to get the cost of every right partition
+        std::array<float, num_bins> right_costs {};
+        auto right_bounds = empty_aabb();
+        std::size_t right_count {0};
+        for (auto i = num_bins - 1; i > 0; --i)
+        {
+            right_bounds = merge(right_bounds, bins[i].bounds);
+            right_count += bins[i].count;
+            right_costs[i] =
+                half_perimeter(right_bounds) * static_cast<float>(right_count);
+        }
+
+        auto left_bounds = empty_aabb();
+        std::size_t left_count {0};
+        for (std::size_t i {0}; i < num_bins - 1; ++i)
+        {
+            left_bounds = merge(left_bounds, bins[i].bounds);
+            left_count += bins[i].count;
+            if (left_count == 0 || left_count == count)
+            {
+                continue;
+            }
+            const auto cost =
+                half_perimeter(left_bounds) * static_cast<float>(left_count) +
+                right_costs[i + 1];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i + 1;
+            }
+        }
+    }
+
+    const auto leaf_cost = intersection_cost * static_cast<float>(count);
+    const auto parent_area = half_perimeter(bounds);
+    if (best_axis >= 0 && parent_area > 0.0f)
+    {
+        best_cost =
+            traversal_cost + intersection_cost * best_cost / parent_area;
+    }
+
+    std::size_t middle {};
+    if (best_axis >= 0 && (best_cost < leaf_cost || count > max_leaf_size))
+    {
+        const auto axis_min = component(centroid_bounds.min, best_axis);
+        const auto scale =
+            static_cast<float>(num_bins) /
+            (component(centroid_bounds.max, best_axis) - axis_min);
+        const auto first = primitives.begin();
+        const auto split = std::partition(
+            first + static_cast<std::ptrdiff_t>(begin),
+            first + static_cast<std::ptrdiff_t>(end),
+            [&](const Build_primitive &primitive)
+            {
+                const auto bin_index = std::min(
+                    static_cast<std::size_t>(
+                        (component(primitive.centroid, best_axis) - axis_min) *
+                        scale),
+                    num_bins - 1);
+                return bin_index < best_split;
+            });
+        middle = static_cast<std::size_t>(split - first);
+    }
+    else if (count > max_leaf_size)
+    {
+        // All centroids coincide, there is no better split than an arbitrary
+        // one, but we still want to bound the leaf size.
+        middle = begin + count / 2;
+    }
+    else
+    {
+        make_leaf(node_index, begin, end);
+        return;
+    }
+
+    build(begin, middle, depth + 1);
+    nodes[node_index].offset = static_cast<std::uint32_t>(nodes.size());
+    nodes[node_index].count = 0;
+    build(middle, end, depth + 1);
+}
+
+[[nodiscard]] Build_primitive make_build_primitive(const Aabb &bounds,
+                                                   std::uint32_t ref) noexcept
+{
+    return {bounds, (bounds.min + bounds.max) * 0.5f, ref};
+}
+
+} // namespace
+
+Aabb circle_bounds(const Circle &circle) noexcept
+{
+    const auto radius = std::abs(circle.radius);
+    return {circle.center - radius, circle.center + radius};
+}
+
+Aabb line_bounds(const Line &line) noexcept
+{
+    return merge(Aabb {line.a, line.a}, line.b);
+}
+
+Aabb arc_bounds(const Arc &arc) noexcept
+{
+    // The arc is the part of the circle where dot(a, p - center) >= b
+    const auto radius = std::abs(arc.radius);
+    if (arc.b <= -radius)
+    {
+        return {arc.center - radius, arc.center + radius};
+    }
+    if (arc.b >= radius)
+    {
+        const auto p = arc.center + arc.a * radius;
+        return {p, p};
+    }
+
+    // End points of the arc
+    const auto half_chord = std::sqrt(radius * radius - arc.b * arc.b);
+    const vec2 tangent {-arc.a.y, arc.a.x};
+    const auto mid = arc.center + arc.a * arc.b;
+    const auto end_1 = mid + tangent * half_chord;
+    const auto end_2 = mid - tangent * half_chord;
+    auto bounds = merge(Aabb {end_1, end_1}, end_2);
+
+    // Axis-aligned extremities of the circle that lie on the arc
+    constexpr vec2 axes[] {
+        {1.0f, 0.0f}, {-1.0f, 0.0f}, {0.0f, 1.0f}, {0.0f, -1.0f}};
+    for (const auto &axis : axes)
+    {
+        if (dot(arc.a, axis) * radius >= arc.b)
+        {
+            bounds = merge(bounds, arc.center + axis * radius);
+        }
+    }
+
+    return bounds;
+}
+
+Aabb primitive_bounds(const Compiled_scene &scene, std::uint32_t ref) noexcept
+{
+    const auto index = primitive_ref_index(ref);
+    switch (primitive_ref_type(ref))
+    {
+    case Geometry_type::circle:
+        return circle_bounds(get_circle(scene, index));
+    case Geometry_type::line: return line_bounds(get_line(scene, index));
+    case Geometry_type::arc: return arc_bounds(get_arc(scene, index));
+    case Geometry_type::none: break;
+    }
+    return empty_aabb();
+}
+
+bool should_use_bvh(const Compiled_scene &scene) noexcept
+{
+    constexpr std::size_t min_primitives {16};
+    return primitive_count(scene) >= min_primitives;
+}
+
+Bvh build_bvh(const Compiled_scene &scene)
+{
+    Builder builder {};
+    builder.primitives.reserve(primitive_count(scene));
+
+    for (std::size_t i {0}; i < scene.circle_radius.size(); ++i)
+    {
+        builder.primitives.push_back(
+            make_build_primitive(circle_bounds(get_circle(scene, i)),
+                                 make_primitive_ref(Geometry_type::circle, i)));
+    }
+    for (std::size_t i {0}; i < scene.line_a_x.size(); ++i)
+    {
+        builder.primitives.push_back(
+            make_build_primitive(line_bounds(get_line(scene, i)),
+                                 make_primitive_ref(Geometry_type::line, i)));
+    }
+    for (std::size_t i {0}; i < scene.arc_radius.size(); ++i)
+    {
+        builder.primitives.push_back(
+            make_build_primitive(arc_bounds(get_arc(scene, i)),
+                                 make_primitive_ref(Geometry_type::arc, i)));
+    }
+
+    Bvh bvh {};
+    if (builder.primitives.empty())
+    {
+        return bvh;
+    }
+
+    builder.nodes.reserve(2 * builder.primitives.size());
+    builder.build(0, builder.primitives.size(), 0);
+
+    bvh.nodes = std::move(builder.nodes);
+    bvh.primitives.reserve(builder.primitives.size());
+    for (const auto &primitive : builder.primitives)
+    {
+        bvh.primitives.push_back(primitive.ref);
+    }
+
+    return bvh;
+}
+
+std::vector<std::size_t> refit_bvh(const Compiled_scene &scene, Bvh &bvh)
+{
+    std::vector<std::size_t> changed_nodes;
+
+    // Children are always stored after their parent
+    for (auto i = bvh.nodes.size(); i-- > 0;)
+    {
+        auto &node = bvh.nodes[i];
+        auto bounds = empty_aabb();
+        if (node.count > 0)
+        {
+            for (std::uint32_t j {0}; j < node.count; ++j)
+            {
+                bounds = merge(
+                    bounds,
+                    primitive_bounds(scene, bvh.primitives[node.offset + j]));
+            }
+        }
+        else
+        {
+            const auto &left = bvh.nodes[i + 1];
+            const auto &right = bvh.nodes[node.offset];
+            bounds = merge(Aabb {left.aabb_min, left.aabb_max},
+                           Aabb {right.aabb_min, right.aabb_max});
+        }
+
+        if (bounds.min != node.aabb_min || bounds.max != node.aabb_max)
+        {
+            node.aabb_min = bounds.min;
+            node.aabb_max = bounds.max;
+            changed_nodes.push_back(i);
+        }
+    }
+
+    std::reverse(changed_nodes.begin(), changed_nodes.end());
+    return changed_nodes;
+}
@@ -0,0 +1,110 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include "compiled_scene.hpp"
+#include "scene.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+struct Aabb
+{
+    vec2 min;
+    vec2 max;
+};
+
+// Layout compatible with the std140 Bvh_node struct of trace.glsl. Nodes are
+// stored in depth-first order, so the first child of an interior node always
+// immediately follows it.
+struct alignas(16) Bvh_node
+{
+    alignas(8) vec2 aabb_min;
+    alignas(8) vec2 aabb_max;
+    // Interior node: index of the second child.
+    // Leaf: index of the first primitive reference.
+    std::uint32_t offset;
+    // Number of primitive references of a leaf, 0 for an interior node.
+    std::uint32_t count;
+};
+
+// Primitive references pack the Geometry_type in the two most significant bits
+// and the index into the corresponding Compiled_scene arrays in the remaining
+// bits.
+constexpr std::uint32_t primitive_index_bits {30};
+constexpr std::uint32_t primitive_index_mask {(1u << primitive_index_bits) -
+                                              1};
+
+// Maximum depth of the tree, which bounds the traversal stack size
+constexpr std::uint32_t bvh_max_depth {32};
+
+struct Bvh
+{
+    std::vector<Bvh_node> nodes;
+    std::vector<std::uint32_t> primitives;
+};
+
+[[nodiscard]] constexpr std::uint32_t
+make_primitive_ref(Geometry_type type, std::size_t index) noexcept
+{
+    return (static_cast<std::uint32_t>(type) << primitive_index_bits) |
+           static_cast<std::uint32_t>(index);
+}
+
+[[nodiscard]] constexpr Geometry_type
+primitive_ref_type(std::uint32_t ref) noexcept
+{
+    return static_cast<Geometry_type>(ref >> primitive_index_bits);
+}
+
+[[nodiscard]] constexpr std::size_t
+primitive_ref_index(std::uint32_t ref) noexcept
+{
+    return ref & primitive_index_mask;
+}
+
+[[nodiscard]] constexpr Aabb empty_aabb() noexcept
+{
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+    return {{inf, inf}, {-inf, -inf}};
+}
+
+[[nodiscard]] constexpr Aabb merge(const Aabb &a, const Aabb &b) noexcept
+{
+    return {{std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y)},
+            {std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y)}};
+}
+
+[[nodiscard]] constexpr Aabb merge(const Aabb &a, const vec2 &p) noexcept
+{
+    return {{std::min(a.min.x, p.x), std::min(a.min.y, p.y)},
+            {std::max(a.max.x, p.x), std::max(a.max.y, p.y)}};
+}
+
+[[nodiscard]] Aabb circle_bounds(const Circle &circle) noexcept;
+[[nodiscard]] Aabb line_bounds(const Line &line) noexcept;
+// Tight bounds of the part of the circle actually covered by the arc
+[[nodiscard]] Aabb arc_bounds(const Arc &arc) noexcept;
+// Bounds of the primitive of the compiled scene a reference points to, empty
+// for a reference to no primitive
+[[nodiscard]] Aabb primitive_bounds(const Compiled_scene &scene,
+                                    std::uint32_t ref) noexcept;
+
+// Below this number of primitives, a linear loop over all primitives is
+// cheaper than traversing the hierarchy.
+[[nodiscard]] bool should_use_bvh(const Compiled_scene &scene) noexcept;
+
+// Builds a binned SAH hierarchy over all circles, lines and arcs of the scene.
+[[nodiscard]] Bvh build_bvh(const Compiled_scene &scene);
+
+// Recomputes the bounds of all nodes after primitives have moved, keeping the
+// topology of the tree. Returns the indices of the nodes whose bounds changed,
+// in increasing order. The tree gets less efficient as primitives move away
+// from their original position, so it should eventually be rebuilt.
+[[nodiscard]] std::vector<std::size_t> refit_bvh(const Compiled_scene &scene,
+                                                 Bvh &bvh);
+
+#endif
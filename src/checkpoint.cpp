@@ -0,0 +1,294 @@
+#include "checkpoint.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace
+{
+
+constexpr std::array<char, 8> magic {'C', 'A', 'U', 'S', 'T', 'I', 'C', 'S'};
+constexpr std::uint32_t version {2};
+
+// Identifies how the trace kernels seed the random numbers of a pixel from its
+// index and the sample index. Bump it whenever that changes, since resuming
+// with other sequences would reuse samples already accumulated.
+constexpr std::uint32_t rng_scheme {1};
+
+// 64-bit FNV-1a, fed with the values of the fields rather than the bytes of
+// the structures so that padding is ignored
+class Hasher
+{
+public:
+    void add(std::uint32_t value) noexcept
+    {
+        for (int i {0}; i < 4; ++i)
+        {
+            m_hash ^= (value >> (8 * i)) & 0xFF;
+            m_hash *= 0x100000001B3;
+        }
+    }
+
+    void add(float value) noexcept
+    {
+        add(std::bit_cast<std::uint32_t>(value));
+    }
+
+    void add(const vec2 &value) noexcept
+    {
+        add(value.x);
+        add(value.y);
+    }
+
+    void add(const vec3 &value) noexcept
+    {
+        add(value.x);
+        add(value.y);
+        add(value.z);
+    }
+
+    [[nodiscard]] std::uint64_t get() const noexcept
+    {
+        return m_hash;
+    }
+
+private:
+    std::uint64_t m_hash {0xCBF29CE484222325};
+};
+
+template <typename T>
+void write_value(std::ofstream &file, const T &value)
+{
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+void read_value(std::ifstream &file, T &value)
+{
+    file.read(reinterpret_cast<char *>(&value), sizeof(value));
+}
+
+[[noreturn]] void throw_checkpoint_error(const std::filesystem::path &path,
+                                         const char *error)
+{
+    std::ostringstream message;
+    message << "Checkpoint \"" << path.string() << "\": " << error;
+    throw std::runtime_error(message.str());
+}
+
+} // namespace
+
+std::uint64_t hash_scene(const Scene &scene) noexcept
+{
+    Hasher hasher;
+    hasher.add(scene.view_x);
+    hasher.add(scene.view_y);
+    hasher.add(scene.view_width);
+    hasher.add(scene.view_height);
+
+    hasher.add(static_cast<std::uint32_t>(scene.materials.size()));
+    for (const auto &material : scene.materials)
+    {
+        hasher.add(material.color);
+        hasher.add(material.emissivity);
+        hasher.add(static_cast<std::uint32_t>(material.type));
+    }
+    hasher.add(static_cast<std::uint32_t>(scene.circles.size()));
+    for (const auto &circle : scene.circles)
+    {
+        hasher.add(circle.center);
+        hasher.add(circle.radius);
+        hasher.add(circle.material_id);
+    }
+    hasher.add(static_cast<std::uint32_t>(scene.lines.size()));
+    for (const auto &line : scene.lines)
+    {
+        hasher.add(line.a);
+        hasher.add(line.b);
+        hasher.add(line.material_id);
+    }
+    hasher.add(static_cast<std::uint32_t>(scene.arcs.size()));
+    for (const auto &arc : scene.arcs)
+    {
+        hasher.add(arc.center);
+        hasher.add(arc.radius);
+        hasher.add(arc.a);
+        hasher.add(arc.b);
+        hasher.add(arc.material_id);
+    }
+
+    return hasher.get();
+}
+
+void write_checkpoint(const std::filesystem::path &path,
+                      const Checkpoint_info &info,
+                      std::span<const vec4> accumulation,
+                      std::span<const float> moments)
+{
+    auto temporary_path = path;
+    temporary_path += ".tmp";
+
+    {
+        std::ofstream file(temporary_path, std::ios::binary);
+        if (!file)
+        {
+            throw_checkpoint_error(temporary_path,
+                                   "failed to open for writing");
+        }
+
+        // Values are stored in the native byte order
+        file.write(magic.data(), magic.size());
+        write_value(file, version);
+        write_value(file, rng_scheme);
+        write_value(file, info.scene_hash);
+        write_value(file, static_cast<std::int32_t>(info.width));
+        write_value(file, static_cast<std::int32_t>(info.height));
+        write_value(file, static_cast<std::uint32_t>(info.sample_index));
+        write_value(file, static_cast<std::uint32_t>(info.first_sample));
+        file.write(reinterpret_cast<const char *>(accumulation.data()),
+                   static_cast<std::streamsize>(accumulation.size_bytes()));
+        file.write(reinterpret_cast<const char *>(moments.data()),
+                   static_cast<std::streamsize>(moments.size_bytes()));
+
+        file.close();
+        if (!file)
+        {
+            throw_checkpoint_error(temporary_path, "failed to write");
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary_path, path, error);
+    if (error)
+    {
+        throw_checkpoint_error(path, error.message().c_str());
+    }
+}
+
+Checkpoint read_checkpoint(const std::filesystem::path &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw_checkpoint_error(path, "failed to open for reading");
+    }
+
+    std::array<char, 8> file_magic {};
+    std::uint32_t file_version {};
+    std::uint32_t file_rng_scheme {};
+    file.read(file_magic.data(), file_magic.size());
+    read_value(file, file_version);
+    read_value(file, file_rng_scheme);
+    if (!file || file_magic != magic)
+    {
+        throw_checkpoint_error(path, "not a checkpoint");
+    }
+    if (file_version != version)
+    {
+        throw_checkpoint_error(path, "unsupported version");
+    }
+    if (file_rng_scheme != rng_scheme)
+    {
+        throw_checkpoint_error(path,
+                               "written with other random number sequences");
+    }
+
+    Checkpoint checkpoint {};
+    std::int32_t width {};
+    std::int32_t height {};
+    std::uint32_t sample_index {};
+    std::uint32_t first_sample {};
+    read_value(file, checkpoint.info.scene_hash);
+    read_value(file, width);
+    read_value(file, height);
+    read_value(file, sample_index);
+    read_value(file, first_sample);
+    if (!file || width <= 0 || height <= 0)
+    {
+        throw_checkpoint_error(path, "invalid header");
+    }
+    checkpoint.info.width = width;
+    checkpoint.info.height = height;
+    checkpoint.info.sample_index = sample_index;
+    checkpoint.info.first_sample = first_sample;
+
+    const auto num_pixels =
+        static_cast<std::size_t>(width) * static_cast<std::size_t>(height);
+    checkpoint.accumulation.resize(num_pixels);
+    checkpoint.moments.resize(num_pixels);
+    file.read(reinterpret_cast<char *>(checkpoint.accumulation.data()),
+              static_cast<std::streamsize>(num_pixels * sizeof(vec4)));
+    file.read(reinterpret_cast<char *>(checkpoint.moments.data()),
+              static_cast<std::streamsize>(num_pixels * sizeof(float)));
+    if (!file)
+    {
+        throw_checkpoint_error(path, "truncated");
+    }
+
+    return checkpoint;
+}
+
+void merge_checkpoint(Checkpoint &merged, const Checkpoint &partial)
+{
+    if (partial.info.width != merged.info.width ||
+        partial.info.height != merged.info.height)
+    {
+        throw std::runtime_error("Partial renders have different resolutions");
+    }
+    if (partial.info.scene_hash != merged.info.scene_hash)
+    {
+        throw std::runtime_error("Partial renders are of different scenes");
+    }
+
+    for (std::size_t i {0}; i < merged.accumulation.size(); ++i)
+    {
+        auto &accumulation = merged.accumulation[i];
+        const auto &partial_accumulation = partial.accumulation[i];
+        // The alpha channel holds the number of samples of the pixel
+        const auto num_samples = accumulation.w + partial_accumulation.w;
+        if (num_samples <= 0.0f)
+        {
+            continue;
+        }
+        const auto weight = accumulation.w / num_samples;
+        const auto partial_weight = partial_accumulation.w / num_samples;
+        accumulation = {accumulation.x * weight +
+                            partial_accumulation.x * partial_weight,
+                        accumulation.y * weight +
+                            partial_accumulation.y * partial_weight,
+                        accumulation.z * weight +
+                            partial_accumulation.z * partial_weight,
+                        num_samples};
+        merged.moments[i] =
+            merged.moments[i] * weight + partial.moments[i] * partial_weight;
+    }
+
+    merged.info.sample_index += partial.info.sample_index;
+    merged.info.first_sample =
+        std::min(merged.info.first_sample, partial.info.first_sample);
+}
+
+int claim_worker(const std::filesystem::path &directory)
+{
+    std::filesystem::create_directories(directory);
+    for (int index {0};; ++index)
+    {
+        auto path = directory;
+        path /= "worker_" + std::to_string(index) + ".claim";
+        // Fails if another worker created the file first
+        std::ofstream file(path, std::ios::out | std::ios::noreplace);
+        if (file)
+        {
+            return index;
+        }
+        if (!std::filesystem::exists(path))
+        {
+            throw_checkpoint_error(path, "failed to create");
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include "scene.hpp"
+#include "vec.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+// Render state that must match for a render to resume from a checkpoint
+struct Checkpoint_info
+{
+    std::uint64_t scene_hash;
+    int width;
+    int height;
+    // Number of samples of the pixels that did not stop sampling early
+    unsigned int sample_index;
+    // Position in the sample sequences of the first sample of the render
+    unsigned int first_sample;
+};
+
+struct Checkpoint
+{
+    Checkpoint_info info;
+    std::vector<vec4> accumulation;
+    std::vector<float> moments;
+};
+
+// Hashes everything in the scene that affects the rendered image.
+[[nodiscard]] std::uint64_t hash_scene(const Scene &scene) noexcept;
+
+// Writes the accumulation and moment images, stored row by row starting from
+// the bottom of the view. The file is replaced only once completely written,
+// so that an interrupted write keeps the previous checkpoint.
+void write_checkpoint(const std::filesystem::path &path,
+                      const Checkpoint_info &info,
+                      std::span<const vec4> accumulation,
+                      std::span<const float> moments);
+
+// Throws if the file is not a checkpoint written with the same random number
+// sequences as the current trace kernels.
+[[nodiscard]] Checkpoint read_checkpoint(const std::filesystem::path &path);
+
+// Adds the samples of a partial render of the same scene to a merged render,
+// weighting the mean and second moment of every pixel by its number of
+// samples. The sample ranges must not overlap, which is not checked.
+void merge_checkpoint(Checkpoint &merged, const Checkpoint &partial);
+
+// Claims the lowest worker index not yet claimed in the directory, by
+// creating a file for it that is never overwritten. Workers sharing the
+// directory, possibly on other machines, get distinct indices.
+[[nodiscard]] int claim_worker(const std::filesystem::path &directory);
+
+#endif
@@ -0,0 +1,190 @@
+#include "compiled_scene.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace
+{
+
+// Indices of the primitives sorted by material, in their original order
+// within each material
+template <typename T>
+[[nodiscard]] std::vector<std::uint32_t>
+sort_by_material(const std::vector<T> &primitives)
+{
+    std::vector<std::uint32_t> order(primitives.size());
+    std::iota(order.begin(), order.end(), std::uint32_t {0});
+    std::stable_sort(order.begin(),
+                     order.end(),
+                     [&](std::uint32_t i, std::uint32_t j)
+                     {
+                         return primitives[i].material_id <
+                                primitives[j].material_id;
+                     });
+    return order;
+}
+
+[[nodiscard]] std::vector<std::uint32_t>
+inverse_permutation(const std::vector<std::uint32_t> &order)
+{
+    std::vector<std::uint32_t> slots(order.size());
+    for (std::size_t i {0}; i < order.size(); ++i)
+    {
+        slots[order[i]] = static_cast<std::uint32_t>(i);
+    }
+    return slots;
+}
+
+void resize_circles(Compiled_scene &scene, std::size_t count)
+{
+    scene.circle_center_x.resize(count);
+    scene.circle_center_y.resize(count);
+    scene.circle_radius.resize(count);
+    scene.circle_material_id.resize(count);
+}
+
+void resize_lines(Compiled_scene &scene, std::size_t count)
+{
+    scene.line_a_x.resize(count);
+    scene.line_a_y.resize(count);
+    scene.line_b_x.resize(count);
+    scene.line_b_y.resize(count);
+    scene.line_material_id.resize(count);
+}
+
+void resize_arcs(Compiled_scene &scene, std::size_t count)
+{
+    scene.arc_center_x.resize(count);
+    scene.arc_center_y.resize(count);
+    scene.arc_radius.resize(count);
+    scene.arc_a_x.resize(count);
+    scene.arc_a_y.resize(count);
+    scene.arc_b.resize(count);
+    scene.arc_material_id.resize(count);
+}
+
+void set_circle(Compiled_scene &scene,
+                std::size_t index,
+                const Circle &circle) noexcept
+{
+    scene.circle_center_x[index] = circle.center.x;
+    scene.circle_center_y[index] = circle.center.y;
+    scene.circle_radius[index] = circle.radius;
+    scene.circle_material_id[index] = circle.material_id;
+}
+
+void set_line(Compiled_scene &scene,
+              std::size_t index,
+              const Line &line) noexcept
+{
+    scene.line_a_x[index] = line.a.x;
+    scene.line_a_y[index] = line.a.y;
+    scene.line_b_x[index] = line.b.x;
+    scene.line_b_y[index] = line.b.y;
+    scene.line_material_id[index] = line.material_id;
+}
+
+void set_arc(Compiled_scene &scene, std::size_t index, const Arc &arc) noexcept
+{
+    scene.arc_center_x[index] = arc.center.x;
+    scene.arc_center_y[index] = arc.center.y;
+    scene.arc_radius[index] = arc.radius;
+    scene.arc_a_x[index] = arc.a.x;
+    scene.arc_a_y[index] = arc.a.y;
+    scene.arc_b[index] = arc.b;
+    scene.arc_material_id[index] = arc.material_id;
+}
+
+} // namespace
+
+Compiled_scene compile_scene(const Scene &scene)
+{
+    Compiled_scene compiled {};
+    compiled.materials = scene.materials;
+
+    const auto circle_order = sort_by_material(scene.circles);
+    resize_circles(compiled, circle_order.size());
+    for (std::size_t i {0}; i < circle_order.size(); ++i)
+    {
+        set_circle(compiled, i, scene.circles[circle_order[i]]);
+    }
+    compiled.circle_slots = inverse_permutation(circle_order);
+
+    const auto line_order = sort_by_material(scene.lines);
+    resize_lines(compiled, line_order.size());
+    for (std::size_t i {0}; i < line_order.size(); ++i)
+    {
+        set_line(compiled, i, scene.lines[line_order[i]]);
+    }
+    compiled.line_slots = inverse_permutation(line_order);
+
+    const auto arc_order = sort_by_material(scene.arcs);
+    resize_arcs(compiled, arc_order.size());
+    for (std::size_t i {0}; i < arc_order.size(); ++i)
+    {
+        set_arc(compiled, i, scene.arcs[arc_order[i]]);
+    }
+    compiled.arc_slots = inverse_permutation(arc_order);
+
+    return compiled;
+}
+
+std::size_t update_compiled_primitive(Compiled_scene &compiled,
+                                      const Scene &scene,
+                                      Geometry_type type,
+                                      std::size_t index) noexcept
+{
+    switch (type)
+    {
+    case Geometry_type::circle:
+    {
+        const auto slot = compiled.circle_slots[index];
+        set_circle(compiled, slot, scene.circles[index]);
+        return slot;
+    }
+    case Geometry_type::line:
+    {
+        const auto slot = compiled.line_slots[index];
+        set_line(compiled, slot, scene.lines[index]);
+        return slot;
+    }
+    case Geometry_type::arc:
+    {
+        const auto slot = compiled.arc_slots[index];
+        set_arc(compiled, slot, scene.arcs[index]);
+        return slot;
+    }
+    case Geometry_type::none: break;
+    }
+    return index;
+}
+
+std::size_t primitive_count(const Compiled_scene &scene) noexcept
+{
+    return scene.circle_radius.size() + scene.line_a_x.size() +
+           scene.arc_radius.size();
+}
+
+Circle get_circle(const Compiled_scene &scene, std::size_t index) noexcept
+{
+    return {.center = {scene.circle_center_x[index],
+                       scene.circle_center_y[index]},
+            .radius = scene.circle_radius[index],
+            .material_id = scene.circle_material_id[index]};
+}
+
+Line get_line(const Compiled_scene &scene, std::size_t index) noexcept
+{
+    return {.a = {scene.line_a_x[index], scene.line_a_y[index]},
+            .b = {scene.line_b_x[index], scene.line_b_y[index]},
+            .material_id = scene.line_material_id[index]};
+}
+
+Arc get_arc(const Compiled_scene &scene, std::size_t index) noexcept
+{
+    return {.center = {scene.arc_center_x[index], scene.arc_center_y[index]},
+            .radius = scene.arc_radius[index],
+            .a = {scene.arc_a_x[index], scene.arc_a_y[index]},
+            .b = scene.arc_b[index],
+            .material_id = scene.arc_material_id[index]};
+}
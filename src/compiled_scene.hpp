@@ -0,0 +1,69 @@
+#ifndef COMPILED_SCENE_HPP
+#define COMPILED_SCENE_HPP
+
+#include "packet.hpp"
+#include "scene.hpp"
+#include "vec.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Primitives of a Scene as they are traced, with each field of the circles,
+// lines and arcs in its own array aligned for packet loads. The primitives of
+// each type are sorted by material, so that paths hitting the same material
+// read neighbouring data. Primitive references (see make_primitive_ref), and
+// therefore the BVH and the emitters, index these arrays rather than the Scene
+// ones.
+struct Compiled_scene
+{
+    std::vector<Material> materials;
+
+    Packet_vector<float> circle_center_x;
+    Packet_vector<float> circle_center_y;
+    Packet_vector<float> circle_radius;
+    std::vector<std::uint32_t> circle_material_id;
+
+    Packet_vector<float> line_a_x;
+    Packet_vector<float> line_a_y;
+    Packet_vector<float> line_b_x;
+    Packet_vector<float> line_b_y;
+    std::vector<std::uint32_t> line_material_id;
+
+    Packet_vector<float> arc_center_x;
+    Packet_vector<float> arc_center_y;
+    Packet_vector<float> arc_radius;
+    Packet_vector<float> arc_a_x;
+    Packet_vector<float> arc_a_y;
+    Packet_vector<float> arc_b;
+    std::vector<std::uint32_t> arc_material_id;
+
+    // Index in the arrays above of each primitive of the Scene
+    std::vector<std::uint32_t> circle_slots;
+    std::vector<std::uint32_t> line_slots;
+    std::vector<std::uint32_t> arc_slots;
+};
+
+[[nodiscard]] Compiled_scene compile_scene(const Scene &scene);
+
+// Copies the geometry of a primitive of the Scene into the compiled scene,
+// after it moved. Returns the index of the primitive in the compiled arrays.
+// The material of the primitive must not have changed, since it determines
+// that index.
+std::size_t update_compiled_primitive(Compiled_scene &compiled,
+                                      const Scene &scene,
+                                      Geometry_type type,
+                                      std::size_t index) noexcept;
+
+[[nodiscard]] std::size_t
+primitive_count(const Compiled_scene &scene) noexcept;
+
+// Gathers a primitive from the compiled arrays
+[[nodiscard]] Circle get_circle(const Compiled_scene &scene,
+                                std::size_t index) noexcept;
+[[nodiscard]] Line get_line(const Compiled_scene &scene,
+                            std::size_t index) noexcept;
+[[nodiscard]] Arc get_arc(const Compiled_scene &scene,
+                          std::size_t index) noexcept;
+
+#endif
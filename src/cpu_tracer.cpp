@@ -0,0 +1,771 @@
+#include "cpu_tracer.hpp"
+#include "emitters.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <numbers>
+#include <span>
+
+namespace
+{
+
+// NOTE: everything in this namespace mirrors the function of the same name in
+// shaders/trace.glsl. Any change to one must be reflected in the other.
+
+struct Hit
+{
+    vec2 position;
+    vec2 normal;
+    std::uint32_t material_id;
+};
+
+constexpr int tile_size {32};
+
+[[nodiscard]] constexpr std::uint32_t hash(std::uint32_t x) noexcept
+{
+    x += x << 10;
+    x ^= x >> 6;
+    x += x << 3;
+    x ^= x >> 11;
+    x += x << 15;
+    return x;
+}
+
+[[nodiscard]] constexpr float random(std::uint32_t &rng_state) noexcept
+{
+    // Returns a value uniformly sampled from [0.0, 1.0]
+    // NOTE: can return 1.0 because of floating-point rounding !
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return static_cast<float>(rng_state) / 4294967296.0f;
+}
+
+[[nodiscard]] constexpr float sign(float x) noexcept
+{
+    return x > 0.0f ? 1.0f : (x < 0.0f ? -1.0f : 0.0f);
+}
+
+[[nodiscard]] constexpr float luminance(const vec3 &color) noexcept
+{
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+[[nodiscard]] constexpr vec2 reflect(const vec2 &direction,
+                                     const vec2 &normal) noexcept
+{
+    return direction - 2.0f * dot(normal, direction) * normal;
+}
+
+// This uses the technique by Carsten Wächter and
+// Nikolaus Binder from "A Fast and Robust Method for Avoiding
+// Self-Intersection" from Ray Tracing Gems (version 1.7, 2020).
+[[nodiscard]] vec2 offset_position_along_normal(const vec2 &position,
+                                                const vec2 &normal) noexcept
+{
+    // Convert the normal to an integer offset.
+    const auto of_i_x = static_cast<std::int32_t>(256.0f * normal.x);
+    const auto of_i_y = static_cast<std::int32_t>(256.0f * normal.y);
+
+    // Offset each component of position using its binary representation.
+    // Handle the sign bits correctly.
+    const auto p_i_x = std::bit_cast<float>(
+        std::bit_cast<std::int32_t>(position.x) +
+        ((position.x < 0.0f) ? -of_i_x : of_i_x));
+    const auto p_i_y = std::bit_cast<float>(
+        std::bit_cast<std::int32_t>(position.y) +
+        ((position.y < 0.0f) ? -of_i_y : of_i_y));
+    // Use a floating-point offset instead for points near (0,0), the origin.
+    constexpr float origin {1.0f / 32.0f};
+    constexpr float float_scale {1.0f / 65536.0f};
+    return {std::abs(position.x) < origin
+                ? position.x + float_scale * normal.x
+                : p_i_x,
+            std::abs(position.y) < origin
+                ? position.y + float_scale * normal.y
+                : p_i_y};
+}
+
+[[nodiscard]] Hit get_hit(const Compiled_scene &scene,
+                          const vec2 &origin,
+                          const vec2 &direction,
+                          float t,
+                          float u,
+                          Geometry_type geometry_type,
+                          std::size_t geometry_index) noexcept
+{
+    Hit hit {};
+
+    switch (geometry_type)
+    {
+    case Geometry_type::circle:
+    {
+        const auto circle = get_circle(scene, geometry_index);
+        hit.position = origin + t * direction;
+        // A negative radius means the object normal (defining the
+        // "outside" of solid objects) points towards the center
+        hit.normal =
+            sign(circle.radius) * normalize(hit.position - circle.center);
+        // Re-project the hit position onto the circle
+        hit.position = circle.center + hit.normal * circle.radius;
+        hit.material_id = circle.material_id;
+        break;
+    }
+    case Geometry_type::line:
+    {
+        const auto line = get_line(scene, geometry_index);
+        hit.position = line.a + u * (line.b - line.a);
+        const auto line_dir = normalize(line.b - line.a);
+        hit.normal = {line_dir.y, -line_dir.x};
+        hit.material_id = line.material_id;
+        break;
+    }
+    case Geometry_type::arc:
+    {
+        const auto arc = get_arc(scene, geometry_index);
+        hit.position = origin + t * direction;
+        // A negative radius means the object normal (defining the
+        // "outside" of solid objects) points towards the center
+        hit.normal = sign(arc.radius) * normalize(hit.position - arc.center);
+        // Re-project the hit position onto the arc
+        hit.position = arc.center + hit.normal * arc.radius;
+        hit.material_id = arc.material_id;
+        break;
+    }
+    case Geometry_type::none: break;
+    }
+
+    return hit;
+}
+
+[[nodiscard]] vec2 reflect_diffuse(const vec2 &normal,
+                                   std::uint32_t &rng_state) noexcept
+{
+    // Cosine weighted
+    const vec2 tangent {-normal.y, normal.x};
+    const auto u = random(rng_state);
+    const auto sin_theta = 2.0f * u - 1.0f;
+    const auto cos_theta = std::sqrt(1.0f - sin_theta * sin_theta);
+    return cos_theta * normal + sin_theta * tangent;
+}
+
+[[nodiscard]] bool scatter(const Hit &hit,
+                           const Material &material,
+                           bool can_continue,
+                           vec2 &origin,
+                           vec2 &direction,
+                           vec3 &throughput,
+                           std::uint32_t &rng_state) noexcept
+{
+    auto color = material.color;
+    const auto max_color = std::max({color.x, color.y, color.z});
+    // Russian Roulette ray termination
+    if (random(rng_state) < max_color && can_continue)
+    {
+        color /= max_color;
+    }
+    else
+    {
+        return false;
+    }
+
+    throughput *= color;
+
+    // hit.normal: object normal, defining "inside" and "outside" for relevant
+    //             primitives (circles and dielectric primitives)
+    // normal:     front-facing normal as seen by the incoming ray
+    const auto into = dot(direction, hit.normal) < 0.0f;
+    const auto normal = into ? hit.normal : -hit.normal;
+
+    switch (material.type)
+    {
+    case Material_type::diffuse:
+    {
+        origin = offset_position_along_normal(hit.position, normal);
+        direction = reflect_diffuse(normal, rng_state);
+        break;
+    }
+    case Material_type::specular:
+    {
+        origin = offset_position_along_normal(hit.position, normal);
+        direction = reflect(direction, normal);
+        break;
+    }
+    case Material_type::dielectric:
+    {
+        const auto reflected_dir = reflect(direction, hit.normal);
+
+        constexpr float n_air {1.0f};
+        constexpr float n_glass {1.5f};
+        const auto n_ratio = into ? n_air / n_glass : n_glass / n_air;
+        const auto dir_dot_normal = dot(direction, normal);
+        const auto cos2t =
+            1.0f - n_ratio * n_ratio * (1.0f - dir_dot_normal * dir_dot_normal);
+        // Total internal reflection
+        if (cos2t < 0.0f)
+        {
+            origin = offset_position_along_normal(hit.position, normal);
+            direction = reflected_dir;
+            return true;
+        }
+
+        const auto transmitted_dir = normalize(
+            direction * n_ratio -
+            hit.normal * ((into ? 1.0f : -1.0f) *
+                          (dir_dot_normal * n_ratio + std::sqrt(cos2t))));
+
+        constexpr float a {n_glass - n_air};
+        constexpr float b {n_glass + n_air};
+        constexpr float R0 {a * a / (b * b)};
+        const auto c =
+            1.0f - (into ? -dir_dot_normal : dot(transmitted_dir, hit.normal));
+        const auto Re = R0 + (1.0f - R0) * c * c * c * c * c;
+        const auto Tr = 1.0f - Re;
+        const auto P = 0.25f + 0.5f * Re;
+        const auto RP = Re / P;
+        const auto TP = Tr / (1.0f - P);
+        if (random(rng_state) < P)
+        {
+            throughput *= RP;
+            origin = offset_position_along_normal(hit.position, normal);
+            direction = reflected_dir;
+        }
+        else
+        {
+            throughput *= TP;
+            origin = offset_position_along_normal(hit.position, -normal);
+            direction = transmitted_dir;
+        }
+        break;
+    }
+    }
+
+    return true;
+}
+
+void sample_emitter(const Compiled_scene &scene,
+                    const Emitters &emitters,
+                    std::uint32_t &rng_state,
+                    vec2 &position,
+                    vec2 &normal,
+                    std::uint32_t &material_id,
+                    Geometry_type &geometry_type,
+                    std::size_t &geometry_index) noexcept
+{
+    const auto emitter_count = static_cast<int>(emitters.emitters.size());
+    const auto x = random(rng_state) * static_cast<float>(emitter_count);
+    const auto i = std::min(static_cast<int>(x), emitter_count - 1);
+    const auto &emitter = emitters.emitters[static_cast<std::size_t>(i)];
+    const auto ref = x - static_cast<float>(i) < emitter.threshold
+                         ? emitter.primitive
+                         : emitter.alias;
+    geometry_type = primitive_ref_type(ref);
+    geometry_index = primitive_ref_index(ref);
+
+    const auto v = random(rng_state);
+    switch (geometry_type)
+    {
+    case Geometry_type::circle:
+    {
+        const auto circle = get_circle(scene, geometry_index);
+        const auto angle = 2.0f * std::numbers::pi_v<float> * v;
+        normal = {std::cos(angle), std::sin(angle)};
+        position = circle.center + normal * std::abs(circle.radius);
+        material_id = circle.material_id;
+        break;
+    }
+    case Geometry_type::line:
+    {
+        const auto line = get_line(scene, geometry_index);
+        position = line.a + v * (line.b - line.a);
+        const auto line_dir = normalize(line.b - line.a);
+        normal = {line_dir.y, -line_dir.x};
+        material_id = line.material_id;
+        break;
+    }
+    case Geometry_type::arc:
+    {
+        const auto arc = get_arc(scene, geometry_index);
+        const auto radius = std::abs(arc.radius);
+        const auto half_angle =
+            std::acos(std::clamp(arc.b / radius, -1.0f, 1.0f));
+        const auto angle =
+            std::atan2(arc.a.y, arc.a.x) + (2.0f * v - 1.0f) * half_angle;
+        normal = {std::cos(angle), std::sin(angle)};
+        position = arc.center + normal * radius;
+        material_id = arc.material_id;
+        break;
+    }
+    case Geometry_type::none: break;
+    }
+}
+
+[[nodiscard]] constexpr float emitter_density(const Emitters &emitters,
+                                              const vec3 &emissivity) noexcept
+{
+    return emitters.total_power > 0.0f
+               ? 4.0f * luminance(emissivity) / emitters.total_power
+               : 0.0f;
+}
+
+[[nodiscard]] constexpr float mis_weight(float pdf, float other_pdf) noexcept
+{
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// Shadow ray towards a point sampled on an emitter
+struct Light_sample
+{
+    vec2 direction;
+    float distance;
+    std::uint32_t primitive;
+    // Contribution if the point is visible, including the path throughput
+    vec3 radiance;
+};
+
+// First half of sample_direct_light in trace.glsl, up to the shadow ray.
+// Returns false if the sample cannot contribute, in which case no shadow ray
+// is needed.
+[[nodiscard]] bool sample_direct_light(const Compiled_scene &scene,
+                                       const Emitters &emitters,
+                                       const vec2 &position,
+                                       const vec2 &normal,
+                                       bool on_surface,
+                                       const vec3 &throughput,
+                                       std::uint32_t &rng_state,
+                                       Light_sample &sample) noexcept
+{
+    if (emitters.emitters.empty())
+    {
+        return false;
+    }
+
+    vec2 light_position {};
+    vec2 light_normal {};
+    std::uint32_t material_id {};
+    Geometry_type light_type {};
+    std::size_t light_index {};
+    sample_emitter(scene,
+                   emitters,
+                   rng_state,
+                   light_position,
+                   light_normal,
+                   material_id,
+                   light_type,
+                   light_index);
+
+    const auto to_light = light_position - position;
+    const auto light_distance = norm(to_light);
+    const auto direction = to_light / light_distance;
+    const auto cos_light = std::abs(dot(direction, light_normal));
+    const auto bsdf_pdf = on_surface ? 0.5f * dot(direction, normal)
+                                     : 0.5f / std::numbers::pi_v<float>;
+    if (bsdf_pdf <= 0.0f || cos_light <= 0.0f)
+    {
+        return false;
+    }
+
+    const auto &emissivity = scene.materials[material_id].emissivity;
+    const auto light_pdf =
+        emitter_density(emitters, emissivity) * light_distance / cos_light;
+    sample = {.direction = direction,
+              .distance = light_distance,
+              .primitive = make_primitive_ref(light_type, light_index),
+              .radiance =
+                  throughput *
+                  (emissivity *
+                   (mis_weight(light_pdf, bsdf_pdf) * bsdf_pdf / light_pdf))};
+    return true;
+}
+
+[[nodiscard]] vec3 hit_emission(const Emitters &emitters,
+                                const Material &material,
+                                const Hit &hit,
+                                const vec2 &direction,
+                                float t,
+                                float direction_pdf) noexcept
+{
+    auto emissivity = material.emissivity;
+    if (direction_pdf > 0.0f && luminance(emissivity) > 0.0f)
+    {
+        const auto light_pdf = emitter_density(emitters, emissivity) * t /
+                               std::abs(dot(direction, hit.normal));
+        emissivity *= mis_weight(direction_pdf, light_pdf);
+    }
+    return emissivity;
+}
+
+// State of the path of one lane of a packet
+struct Path
+{
+    std::uint32_t rng_state;
+    vec2 origin;
+    vec2 direction;
+    vec3 color;
+    vec3 throughput;
+    float direction_pdf;
+    bool active;
+    bool has_light_sample;
+    Light_sample light_sample;
+};
+
+constexpr float max_distance {1e6f};
+
+// Traces the pending shadow rays of the paths, and adds the contribution of
+// the visible ones
+void trace_shadow_rays(const Compiled_scene &scene,
+                       const Bvh &bvh,
+                       std::span<Path> paths,
+                       Ray_packet &rays,
+                       Trace_statistics &statistics) noexcept
+{
+    bool any_ray {false};
+    for (std::size_t i {0}; i < packet_size; ++i)
+    {
+        const auto has_ray = i < paths.size() && paths[i].has_light_sample;
+        if (has_ray)
+        {
+            const auto &path = paths[i];
+            rays.origin_x[i] = path.origin.x;
+            rays.origin_y[i] = path.origin.y;
+            rays.direction_x[i] = path.light_sample.direction.x;
+            rays.direction_y[i] = path.light_sample.direction.y;
+        }
+        rays.t[i] = has_ray ? max_distance : 0.0f;
+        rays.u[i] = 0.0f;
+        rays.primitive[i] = 0;
+        any_ray = any_ray || has_ray;
+        statistics.shadow_rays += has_ray ? 1 : 0;
+    }
+    if (!any_ray)
+    {
+        return;
+    }
+
+    intersect(scene, bvh, rays);
+
+    for (std::size_t i {0}; i < paths.size(); ++i)
+    {
+        auto &path = paths[i];
+        if (path.has_light_sample &&
+            rays.primitive[i] == path.light_sample.primitive &&
+            rays.t[i] >= 0.999f * path.light_sample.distance)
+        {
+            path.color += path.light_sample.radiance;
+        }
+        path.has_light_sample = false;
+    }
+}
+
+// Same as radiance() in trace.glsl, for the paths of all lanes of a packet at
+// once. The paths advance one bounce at a time, so that the rays of all lanes
+// are intersected together. Each path consumes its random numbers in the same
+// order as on its own.
+void radiance(const Compiled_scene &scene,
+              const Bvh &bvh,
+              const Emitters &emitters,
+              std::span<Path> paths,
+              Trace_statistics &statistics) noexcept
+{
+    Ray_packet rays {};
+
+    for (auto &path : paths)
+    {
+        path.color = {0.0f, 0.0f, 0.0f};
+        path.throughput = {1.0f, 1.0f, 1.0f};
+        path.direction_pdf = 0.5f / std::numbers::pi_v<float>;
+        path.active = true;
+        path.has_light_sample = sample_direct_light(scene,
+                                                    emitters,
+                                                    path.origin,
+                                                    {0.0f, 0.0f},
+                                                    false,
+                                                    path.throughput,
+                                                    path.rng_state,
+                                                    path.light_sample);
+    }
+    trace_shadow_rays(scene, bvh, paths, rays, statistics);
+
+    constexpr int max_depth {32};
+    for (int depth {0}; depth <= max_depth; ++depth)
+    {
+        bool any_active {false};
+        for (std::size_t i {0}; i < packet_size; ++i)
+        {
+            const auto active = i < paths.size() && paths[i].active;
+            if (active)
+            {
+                const auto &path = paths[i];
+                rays.origin_x[i] = path.origin.x;
+                rays.origin_y[i] = path.origin.y;
+                rays.direction_x[i] = path.direction.x;
+                rays.direction_y[i] = path.direction.y;
+            }
+            rays.t[i] = active ? max_distance : 0.0f;
+            rays.u[i] = 0.0f;
+            rays.primitive[i] = 0;
+            any_active = any_active || active;
+            statistics.path_rays += active ? 1 : 0;
+        }
+        if (!any_active)
+        {
+            return;
+        }
+
+        intersect(scene, bvh, rays);
+
+        for (std::size_t i {0}; i < paths.size(); ++i)
+        {
+            auto &path = paths[i];
+            if (!path.active)
+            {
+                continue;
+            }
+            if (rays.primitive[i] == 0)
+            {
+                path.active = false;
+                continue;
+            }
+
+            const auto t = rays.t[i];
+            const auto hit = get_hit(scene,
+                                     path.origin,
+                                     path.direction,
+                                     t,
+                                     rays.u[i],
+                                     primitive_ref_type(rays.primitive[i]),
+                                     primitive_ref_index(rays.primitive[i]));
+            const auto &material = scene.materials[hit.material_id];
+
+            path.color += path.throughput * hit_emission(emitters,
+                                                         material,
+                                                         hit,
+                                                         path.direction,
+                                                         t,
+                                                         path.direction_pdf);
+
+            const auto normal = dot(path.direction, hit.normal) < 0.0f
+                                    ? hit.normal
+                                    : -hit.normal;
+            if (!scatter(hit,
+                         material,
+                         depth < max_depth,
+                         path.origin,
+                         path.direction,
+                         path.throughput,
+                         path.rng_state))
+            {
+                path.active = false;
+                continue;
+            }
+
+            if (material.type == Material_type::diffuse)
+            {
+                path.has_light_sample = sample_direct_light(scene,
+                                                            emitters,
+                                                            path.origin,
+                                                            normal,
+                                                            true,
+                                                            path.throughput,
+                                                            path.rng_state,
+                                                            path.light_sample);
+                path.direction_pdf = 0.5f * dot(path.direction, normal);
+            }
+            else
+            {
+                path.direction_pdf = 0.0f;
+            }
+        }
+
+        trace_shadow_rays(scene, bvh, paths, rays, statistics);
+    }
+}
+
+// Pixels are traced in packets of consecutive pixels of a row, one per lane
+Trace_statistics trace_tile(const Scene &scene,
+                            const Compiled_scene &compiled,
+                            const Bvh &bvh,
+                            const Emitters &emitters,
+                            unsigned int sample_index,
+                            unsigned int samples_per_frame,
+                            int tile_x,
+                            int tile_y,
+                            Accumulation_buffer &accumulation) noexcept
+{
+    const auto image_width = static_cast<float>(accumulation.width);
+    const auto image_height = static_cast<float>(accumulation.height);
+    const auto x_end = std::min(tile_x + tile_size, accumulation.width);
+    const auto y_end = std::min(tile_y + tile_size, accumulation.height);
+
+    std::array<Path, packet_size> paths {};
+    std::array<vec3, packet_size> accumulated_colors {};
+    Trace_statistics statistics {};
+
+    for (auto y = tile_y; y < y_end; ++y)
+    {
+        for (auto packet_x = tile_x; packet_x < x_end;
+             packet_x += static_cast<int>(packet_size))
+        {
+            const auto num_lanes = static_cast<std::size_t>(
+                std::min(static_cast<int>(packet_size), x_end - packet_x));
+            const std::span packet_paths {paths.data(), num_lanes};
+
+            const auto first_pixel_index =
+                static_cast<std::uint32_t>(y) *
+                    static_cast<std::uint32_t>(accumulation.width) +
+                static_cast<std::uint32_t>(packet_x);
+            for (std::size_t i {0}; i < num_lanes; ++i)
+            {
+                const auto pixel_index =
+                    first_pixel_index + static_cast<std::uint32_t>(i);
+                paths[i].rng_state = hash(pixel_index) + hash(sample_index);
+                accumulated_colors[i] = {0.0f, 0.0f, 0.0f};
+            }
+
+            for (unsigned int sample {0}; sample < samples_per_frame; ++sample)
+            {
+                for (std::size_t i {0}; i < num_lanes; ++i)
+                {
+                    auto &path = paths[i];
+                    const auto x = packet_x + static_cast<int>(i);
+                    const auto u =
+                        (static_cast<float>(x) + random(path.rng_state)) /
+                        image_width;
+                    const auto v =
+                        (static_cast<float>(y) + random(path.rng_state)) /
+                        image_height;
+                    path.origin = {
+                        scene.view_x + (u - 0.5f) * scene.view_width,
+                        scene.view_y + (v - 0.5f) * scene.view_height};
+                    const auto angle = 2.0f * std::numbers::pi_v<float> *
+                                       random(path.rng_state);
+                    path.direction = {std::cos(angle), std::sin(angle)};
+                }
+
+                radiance(compiled, bvh, emitters, packet_paths, statistics);
+
+                for (std::size_t i {0}; i < num_lanes; ++i)
+                {
+                    accumulated_colors[i] += paths[i].color;
+                }
+            }
+
+            for (std::size_t i {0}; i < num_lanes; ++i)
+            {
+                const auto &accumulated_color = accumulated_colors[i];
+                auto &average_color =
+                    accumulation.pixels[first_pixel_index + i];
+                const auto old_weight = static_cast<float>(sample_index);
+                const auto total_weight =
+                    static_cast<float>(sample_index + samples_per_frame);
+                average_color = {
+                    (average_color.x * old_weight + accumulated_color.x) /
+                        total_weight,
+                    (average_color.y * old_weight + accumulated_color.y) /
+                        total_weight,
+                    (average_color.z * old_weight + accumulated_color.z) /
+                        total_weight,
+                    (average_color.w * old_weight +
+                     static_cast<float>(samples_per_frame)) /
+                        total_weight};
+            }
+        }
+    }
+
+    return statistics;
+}
+
+// ACES tone mapping curve from Krzysztof Narkowicz, as in post.glsl
+[[nodiscard]] constexpr float ACES_tone_map(float x) noexcept
+{
+    constexpr float a {2.51f};
+    constexpr float b {0.03f};
+    constexpr float c {2.43f};
+    constexpr float d {0.59f};
+    constexpr float e {0.14f};
+    return std::clamp((x * (a * x + b)) / (x * (c * x + d) + e), 0.0f, 1.0f);
+}
+
+[[nodiscard]] constexpr std::uint8_t to_unorm8(float x) noexcept
+{
+    return static_cast<std::uint8_t>(x * 255.0f + 0.5f);
+}
+
+} // namespace
+
+Accumulation_buffer create_accumulation_buffer(int width, int height)
+{
+    return {.width = width,
+            .height = height,
+            .pixels = std::vector<vec4>(static_cast<std::size_t>(width) *
+                                        static_cast<std::size_t>(height))};
+}
+
+Trace_statistics cpu_trace(Thread_pool &pool,
+                           const Scene &scene,
+                           const Compiled_scene &compiled,
+                           const Bvh &bvh,
+                           const Emitters &emitters,
+                           unsigned int sample_index,
+                           unsigned int samples_per_frame,
+                           Accumulation_buffer &accumulation)
+{
+    const auto num_tiles_x = (accumulation.width + tile_size - 1) / tile_size;
+    const auto num_tiles_y = (accumulation.height + tile_size - 1) / tile_size;
+    const auto num_tiles = static_cast<std::size_t>(num_tiles_x) *
+                           static_cast<std::size_t>(num_tiles_y);
+
+    // Counted per tile rather than in shared counters
+    std::vector<Trace_statistics> tile_statistics(num_tiles);
+
+    pool.parallel_for(
+        num_tiles,
+        [&](std::size_t tile_index)
+        {
+            const auto tile_x =
+                static_cast<int>(tile_index %
+                                 static_cast<std::size_t>(num_tiles_x)) *
+                tile_size;
+            const auto tile_y =
+                static_cast<int>(tile_index /
+                                 static_cast<std::size_t>(num_tiles_x)) *
+                tile_size;
+            tile_statistics[tile_index] = trace_tile(scene,
+                                                     compiled,
+                                                     bvh,
+                                                     emitters,
+                                                     sample_index,
+                                                     samples_per_frame,
+                                                     tile_x,
+                                                     tile_y,
+                                                     accumulation);
+        });
+
+    Trace_statistics statistics {};
+    for (const auto &tile : tile_statistics)
+    {
+        statistics.path_rays += tile.path_rays;
+        statistics.shadow_rays += tile.shadow_rays;
+    }
+    return statistics;
+}
+
+std::vector<std::uint8_t> tone_map(const Accumulation_buffer &accumulation)
+{
+    std::vector<std::uint8_t> pixels;
+    pixels.reserve(accumulation.pixels.size() * 4);
+
+    for (const auto &color : accumulation.pixels)
+    {
+        pixels.push_back(to_unorm8(ACES_tone_map(color.x)));
+        pixels.push_back(to_unorm8(ACES_tone_map(color.y)));
+        pixels.push_back(to_unorm8(ACES_tone_map(color.z)));
+        pixels.push_back(255);
+    }
+
+    return pixels;
+}
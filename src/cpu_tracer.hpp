@@ -0,0 +1,57 @@
+#ifndef CPU_TRACER_HPP
+#define CPU_TRACER_HPP
+
+#include "bvh.hpp"
+#include "emitters.hpp"
+#include "packet_intersect.hpp"
+#include "scene.hpp"
+#include "vec.hpp"
+
+#include <cstdint>
+#include <vector>
+
+class Thread_pool;
+
+// CPU equivalent of accumulation_texture: the running average of all samples
+// traced so far, stored row by row starting from the bottom of the view.
+struct Accumulation_buffer
+{
+    int width;
+    int height;
+    std::vector<vec4> pixels;
+};
+
+[[nodiscard]] Accumulation_buffer create_accumulation_buffer(int width,
+                                                             int height);
+
+// Rays intersected with the scene by cpu_trace
+struct Trace_statistics
+{
+    // One per bounce of the camera paths, including the last one that leaves
+    // the scene
+    std::uint64_t path_rays;
+    // Visibility tests of the light samples
+    std::uint64_t shadow_rays;
+};
+
+// Adds samples_per_frame samples to every pixel of the accumulation buffer,
+// which must already contain the average of sample_index samples. This
+// reproduces one dispatch of trace.glsl, including its random number
+// sequences, so the CPU and GPU paths converge to the same image. The
+// primitives are traced from the compiled scene, only the view is read from
+// the scene. If the BVH is empty, all primitives are tested for every ray.
+Trace_statistics cpu_trace(Thread_pool &pool,
+                           const Scene &scene,
+                           const Compiled_scene &compiled,
+                           const Bvh &bvh,
+                           const Emitters &emitters,
+                           unsigned int sample_index,
+                           unsigned int samples_per_frame,
+                           Accumulation_buffer &accumulation);
+
+// Tone maps the accumulation buffer to RGBA8 pixels, as post.glsl does for
+// target_texture.
+[[nodiscard]] std::vector<std::uint8_t>
+tone_map(const Accumulation_buffer &accumulation);
+
+#endif
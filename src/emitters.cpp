@@ -0,0 +1,127 @@
+#include "emitters.hpp"
+#include "bvh.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <numbers>
+
+namespace
+{
+
+[[nodiscard]] constexpr float luminance(const vec3 &color) noexcept
+{
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+[[nodiscard]] float circle_length(const Circle &circle) noexcept
+{
+    return 2.0f * std::numbers::pi_v<float> * std::abs(circle.radius);
+}
+
+[[nodiscard]] float line_length(const Line &line) noexcept
+{
+    return norm(line.b - line.a);
+}
+
+[[nodiscard]] float arc_length(const Arc &arc) noexcept
+{
+    // The arc spans the angles within acos(b / radius) of its direction a
+    const auto radius = std::abs(arc.radius);
+    const auto half_angle = std::acos(std::clamp(arc.b / radius, -1.0f, 1.0f));
+    return 2.0f * half_angle * radius;
+}
+
+struct Builder
+{
+    const Compiled_scene &scene;
+    std::vector<std::uint32_t> primitives;
+    std::vector<float> powers;
+
+    // The radiance L of each side of a primitive of length A integrates to a
+    // power of 2 * L * A over the half plane, so 4 * L * A for both sides.
+    void add(std::uint32_t material_id,
+             float length,
+             Geometry_type type,
+             std::size_t index)
+    {
+        const auto power =
+            4.0f * luminance(scene.materials[material_id].emissivity) * length;
+        if (power > 0.0f)
+        {
+            primitives.push_back(make_primitive_ref(type, index));
+            powers.push_back(power);
+        }
+    }
+};
+
+} // namespace
+
+Emitters build_emitters(const Compiled_scene &scene)
+{
+    Builder builder {scene, {}, {}};
+    for (std::size_t i {0}; i < scene.circle_radius.size(); ++i)
+    {
+        const auto circle = get_circle(scene, i);
+        builder.add(circle.material_id,
+                    circle_length(circle),
+                    Geometry_type::circle,
+                    i);
+    }
+    for (std::size_t i {0}; i < scene.line_a_x.size(); ++i)
+    {
+        const auto line = get_line(scene, i);
+        builder.add(
+            line.material_id, line_length(line), Geometry_type::line, i);
+    }
+    for (std::size_t i {0}; i < scene.arc_radius.size(); ++i)
+    {
+        const auto arc = get_arc(scene, i);
+        builder.add(arc.material_id, arc_length(arc), Geometry_type::arc, i);
+    }
+
+    Emitters result {};
+    const auto count = builder.primitives.size();
+    for (const auto power : builder.powers)
+    {
+        result.total_power += power;
+    }
+
+    // Vose's alias method: entries with less than the average power are
+    // completed by an entry with more than the average power
+    std::vector<float> scaled_powers(count);
+    std::vector<std::size_t> small;
+    std::vector<std::size_t> large;
+    for (std::size_t i {0}; i < count; ++i)
+    {
+        scaled_powers[i] = builder.powers[i] * static_cast<float>(count) /
+                           result.total_power;
+        (scaled_powers[i] < 1.0f ? small : large).push_back(i);
+    }
+
+    result.emitters.resize(count);
+    while (!small.empty() && !large.empty())
+    {
+        const auto s = small.back();
+        small.pop_back();
+        const auto l = large.back();
+        result.emitters[s] = {
+            builder.primitives[s], scaled_powers[s], builder.primitives[l]};
+        scaled_powers[l] -= 1.0f - scaled_powers[s];
+        if (scaled_powers[l] < 1.0f)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Only rounding errors can leave entries in one of the lists
+    small.insert(small.end(), large.begin(), large.end());
+    for (const auto i : small)
+    {
+        const auto primitive = builder.primitives[i];
+        result.emitters[i] = {primitive, 1.0f, primitive};
+    }
+
+    return result;
+}
@@ -0,0 +1,33 @@
+#ifndef EMITTERS_HPP
+#define EMITTERS_HPP
+
+#include "compiled_scene.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Layout compatible with the std140 Emitter struct of scene.glsl. Each entry
+// of the alias table is picked uniformly, then keeps its primitive with
+// probability threshold or switches to the alias primitive.
+struct alignas(16) Emitter
+{
+    // Primitive reference, packed as in Bvh::primitives. The shaders use the
+    // index in the primitive stream instead, see make_gpu_emitters.
+    std::uint32_t primitive;
+    float threshold;
+    std::uint32_t alias;
+};
+
+struct Emitters
+{
+    std::vector<Emitter> emitters;
+    // Luminance of the total power emitted by the scene
+    float total_power;
+};
+
+// Builds an alias table over every primitive with an emissive material, to
+// sample them in proportion to the power they emit in constant time.
+// Primitives emit the same radiance in all directions on both of their sides.
+[[nodiscard]] Emitters build_emitters(const Compiled_scene &scene);
+
+#endif
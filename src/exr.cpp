@@ -0,0 +1,179 @@
+#include "exr.hpp"
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+
+namespace
+{
+
+// OpenEXR files are little-endian, values are written in the native byte order
+static_assert(std::endian::native == std::endian::little);
+
+constexpr std::int32_t magic {20000630};
+// Single-part scanline file
+constexpr std::int32_t version {2};
+
+constexpr std::int32_t pixel_type_float {2};
+constexpr std::uint8_t no_compression {0};
+constexpr std::uint8_t decreasing_y {1};
+
+// Channels must be sorted by name
+constexpr std::array<std::string_view, 4> channel_names {
+    "B", "G", "R", "samples"};
+
+template <typename T>
+void write_value(std::ofstream &file, const T &value)
+{
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void write_string(std::ofstream &file, std::string_view string)
+{
+    file.write(string.data(), static_cast<std::streamsize>(string.size()));
+    file.put('\0');
+}
+
+void write_attribute_header(std::ofstream &file,
+                            std::string_view name,
+                            std::string_view type,
+                            std::size_t size)
+{
+    write_string(file, name);
+    write_string(file, type);
+    write_value(file, static_cast<std::int32_t>(size));
+}
+
+template <typename T>
+void write_attribute(std::ofstream &file,
+                     std::string_view name,
+                     std::string_view type,
+                     const T &value)
+{
+    write_attribute_header(file, name, type, sizeof(value));
+    write_value(file, value);
+}
+
+void write_box_attribute(std::ofstream &file,
+                         std::string_view name,
+                         int width,
+                         int height)
+{
+    const std::array<std::int32_t, 4> box {0, 0, width - 1, height - 1};
+    write_attribute(file, name, "box2i", box);
+}
+
+[[noreturn]] void throw_exr_error(const std::filesystem::path &path,
+                                  const char *error)
+{
+    std::ostringstream message;
+    message << "EXR image \"" << path.string() << "\": " << error;
+    throw std::runtime_error(message.str());
+}
+
+} // namespace
+
+Exr_writer::Exr_writer(const std::filesystem::path &path,
+                       int width,
+                       int height,
+                       unsigned int samples)
+    : m_path {path},
+      m_file(path, std::ios::binary),
+      m_width {width},
+      m_height {height},
+      m_channels(channel_names.size() * static_cast<std::size_t>(width))
+{
+    if (!m_file)
+    {
+        throw_exr_error(m_path, "failed to open for writing");
+    }
+
+    write_value(m_file, magic);
+    write_value(m_file, version);
+
+    // Each channel is a name followed by its type, linearity, 3 reserved
+    // bytes and sampling rates
+    constexpr std::size_t channel_description_size {16};
+    std::size_t channels_size {1};
+    for (const auto name : channel_names)
+    {
+        channels_size += name.size() + 1 + channel_description_size;
+    }
+    write_attribute_header(m_file, "channels", "chlist", channels_size);
+    for (const auto name : channel_names)
+    {
+        write_string(m_file, name);
+        write_value(m_file, pixel_type_float);
+        write_value(m_file, std::array<std::uint8_t, 4> {});
+        write_value(m_file, std::array<std::int32_t, 2> {1, 1});
+    }
+    m_file.put('\0');
+
+    write_attribute(m_file, "compression", "compression", no_compression);
+    write_box_attribute(m_file, "dataWindow", width, height);
+    write_box_attribute(m_file, "displayWindow", width, height);
+    // Rows come from the bottom of the image
+    write_attribute(m_file, "lineOrder", "lineOrder", decreasing_y);
+    write_attribute(m_file, "pixelAspectRatio", "float", 1.0f);
+    write_attribute(
+        m_file, "screenWindowCenter", "v2f", std::array {0.0f, 0.0f});
+    write_attribute(m_file, "screenWindowWidth", "float", 1.0f);
+    write_attribute(
+        m_file, "samples", "int", static_cast<std::int32_t>(samples));
+    m_file.put('\0');
+
+    // Uncompressed rows all have the same size, so the table of their
+    // offsets, indexed from the top row, is known before any row is written
+    const auto row_size = static_cast<std::uint64_t>(
+        2 * sizeof(std::int32_t) + m_channels.size() * sizeof(float));
+    const auto first_row_offset =
+        static_cast<std::uint64_t>(m_file.tellp()) +
+        static_cast<std::uint64_t>(height) * sizeof(std::uint64_t);
+    for (int y {0}; y < height; ++y)
+    {
+        const auto rows_before = static_cast<std::uint64_t>(height - 1 - y);
+        write_value(m_file, first_row_offset + rows_before * row_size);
+    }
+}
+
+void Exr_writer::write_row(std::span<const vec4> row)
+{
+    if (m_rows_written >= m_height)
+    {
+        throw_exr_error(m_path, "too many rows");
+    }
+
+    const auto width = static_cast<std::size_t>(m_width);
+    for (std::size_t x {0}; x < width; ++x)
+    {
+        m_channels[x] = row[x].z;
+        m_channels[width + x] = row[x].y;
+        m_channels[2 * width + x] = row[x].x;
+        m_channels[3 * width + x] = row[x].w;
+    }
+
+    const auto y = m_height - 1 - m_rows_written;
+    write_value(m_file, static_cast<std::int32_t>(y));
+    write_value(m_file,
+                static_cast<std::int32_t>(m_channels.size() * sizeof(float)));
+    m_file.write(reinterpret_cast<const char *>(m_channels.data()),
+                 static_cast<std::streamsize>(m_channels.size() *
+                                              sizeof(float)));
+    ++m_rows_written;
+}
+
+void Exr_writer::close()
+{
+    if (m_rows_written != m_height)
+    {
+        throw_exr_error(m_path, "incomplete image");
+    }
+    m_file.close();
+    if (!m_file)
+    {
+        throw_exr_error(m_path, "failed to write");
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef EXR_HPP
+#define EXR_HPP
+
+#include "vec.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <vector>
+
+// Writes the accumulated radiance as an uncompressed OpenEXR image, one row at
+// a time so that images larger than memory can be streamed from their tiles.
+// The R, G and B channels hold the average radiance of each pixel, and the
+// "samples" channel its number of samples, so that images can be tone mapped
+// again or merged later without loss. The maximum number of samples per pixel
+// is stored in the "samples" attribute of the header.
+class Exr_writer
+{
+public:
+    // An existing file is overwritten.
+    Exr_writer(const std::filesystem::path &path,
+               int width,
+               int height,
+               unsigned int samples);
+
+    // Rows are written starting from the bottom of the image, with the number
+    // of samples of each pixel in the alpha channel, as in accumulation_image.
+    void write_row(std::span<const vec4> row);
+
+    // Throws if the image is incomplete or could not be written.
+    void close();
+
+private:
+    std::filesystem::path m_path;
+    std::ofstream m_file;
+    int m_width;
+    int m_height;
+    int m_rows_written {0};
+    std::vector<float> m_channels;
+};
+
+#endif
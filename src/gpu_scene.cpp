@@ -0,0 +1,154 @@
+#include "gpu_scene.hpp"
+
+#include <limits>
+
+namespace
+{
+
+[[nodiscard]] Gpu_primitive make_gpu_primitive(const Compiled_scene &scene,
+                                               Geometry_type type,
+                                               std::size_t index) noexcept
+{
+    switch (type)
+    {
+    case Geometry_type::circle:
+    {
+        const auto circle = get_circle(scene, index);
+        return {
+            .shape = {circle.center.x, circle.center.y, circle.radius, 0.0f},
+            .axis = {0.0f, 0.0f},
+            .type = type,
+            .material_id = circle.material_id};
+    }
+    case Geometry_type::line:
+    {
+        const auto line = get_line(scene, index);
+        return {.shape = {line.a.x, line.a.y, line.b.x, line.b.y},
+                .axis = {0.0f, 0.0f},
+                .type = type,
+                .material_id = line.material_id};
+    }
+    case Geometry_type::arc:
+    {
+        const auto arc = get_arc(scene, index);
+        return {.shape = {arc.center.x, arc.center.y, arc.radius, arc.b},
+                .axis = arc.a,
+                .type = type,
+                .material_id = arc.material_id};
+    }
+    case Geometry_type::none: break;
+    }
+    return {};
+}
+
+[[nodiscard]] std::uint32_t stream_index(const Gpu_primitives &primitives,
+                                         std::uint32_t ref) noexcept
+{
+    const auto index = primitive_ref_index(ref);
+    switch (primitive_ref_type(ref))
+    {
+    case Geometry_type::circle: return primitives.circle_indices[index];
+    case Geometry_type::line: return primitives.line_indices[index];
+    case Geometry_type::arc: return primitives.arc_indices[index];
+    case Geometry_type::none: break;
+    }
+    return 0;
+}
+
+} // namespace
+
+Gpu_primitives make_gpu_primitives(const Compiled_scene &scene,
+                                   const std::vector<std::uint32_t> &order)
+{
+    constexpr auto unassigned = std::numeric_limits<std::uint32_t>::max();
+    Gpu_primitives primitives {
+        .stream = {},
+        .circle_indices = std::vector<std::uint32_t>(
+            scene.circle_radius.size(), unassigned),
+        .line_indices =
+            std::vector<std::uint32_t>(scene.line_a_x.size(), unassigned),
+        .arc_indices =
+            std::vector<std::uint32_t>(scene.arc_radius.size(), unassigned)};
+    primitives.stream.reserve(primitive_count(scene));
+
+    const auto add = [&](std::uint32_t ref)
+    {
+        const auto type = primitive_ref_type(ref);
+        const auto index = primitive_ref_index(ref);
+        std::uint32_t *position {nullptr};
+        switch (type)
+        {
+        case Geometry_type::circle:
+            position = &primitives.circle_indices[index];
+            break;
+        case Geometry_type::line:
+            position = &primitives.line_indices[index];
+            break;
+        case Geometry_type::arc:
+            position = &primitives.arc_indices[index];
+            break;
+        case Geometry_type::none: return;
+        }
+        if (*position == unassigned)
+        {
+            *position = static_cast<std::uint32_t>(primitives.stream.size());
+            primitives.stream.push_back(make_gpu_primitive(scene, type, index));
+        }
+    };
+
+    for (const auto ref : order)
+    {
+        add(ref);
+    }
+    // In the same order as the loops of the CPU tracer, so that both resolve
+    // equal distances to the same primitive
+    for (std::size_t i {0}; i < scene.circle_radius.size(); ++i)
+    {
+        add(make_primitive_ref(Geometry_type::circle, i));
+    }
+    for (std::size_t i {0}; i < scene.line_a_x.size(); ++i)
+    {
+        add(make_primitive_ref(Geometry_type::line, i));
+    }
+    for (std::size_t i {0}; i < scene.arc_radius.size(); ++i)
+    {
+        add(make_primitive_ref(Geometry_type::arc, i));
+    }
+
+    return primitives;
+}
+
+std::size_t update_gpu_primitive(Gpu_primitives &primitives,
+                                 const Compiled_scene &scene,
+                                 Geometry_type type,
+                                 std::size_t index) noexcept
+{
+    const auto position =
+        stream_index(primitives, make_primitive_ref(type, index));
+    primitives.stream[position] = make_gpu_primitive(scene, type, index);
+    return position;
+}
+
+std::vector<Emitter> make_gpu_emitters(const Gpu_primitives &primitives,
+                                       const Emitters &emitters)
+{
+    auto result = emitters.emitters;
+    for (auto &emitter : result)
+    {
+        emitter.primitive = stream_index(primitives, emitter.primitive);
+        emitter.alias = stream_index(primitives, emitter.alias);
+    }
+    return result;
+}
+
+std::vector<std::uint32_t>
+stream_indices(const Gpu_primitives &primitives,
+               const std::vector<std::uint32_t> &refs)
+{
+    std::vector<std::uint32_t> indices(refs.size());
+    for (std::size_t i {0}; i < refs.size(); ++i)
+    {
+        indices[i] = stream_index(primitives, refs[i]);
+    }
+    return indices;
+}
@@ -0,0 +1,66 @@
+#ifndef GPU_SCENE_HPP
+#define GPU_SCENE_HPP
+
+#include "bvh.hpp"
+#include "compiled_scene.hpp"
+#include "emitters.hpp"
+#include "scene.hpp"
+#include "vec.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Layout compatible with the std140 Primitive struct of scene.glsl, which holds
+// a circle, a line or an arc depending on its type:
+// - circle: center in shape.xy, radius in shape.z
+// - line: a in shape.xy, b in shape.zw
+// - arc: center in shape.xy, radius in shape.z, b in shape.w, a in axis
+struct alignas(16) Gpu_primitive
+{
+    vec4 shape;
+    alignas(8) vec2 axis;
+    Geometry_type type;
+    std::uint32_t material_id;
+};
+
+// Upload format of the compiled scene. All primitives are in a single stream,
+// so that the shaders test them in one loop and fetch each of them once. With
+// a BVH, the stream is in the order of Bvh::primitives: the primitives of a
+// leaf are next to each other, and leaves index the stream directly. With a
+// grid, the stream follows the cells, so that neighbouring cells mostly read
+// neighbouring primitives.
+struct Gpu_primitives
+{
+    std::vector<Gpu_primitive> stream;
+    // Index in the stream of each compiled circle, line and arc
+    std::vector<std::uint32_t> circle_indices;
+    std::vector<std::uint32_t> line_indices;
+    std::vector<std::uint32_t> arc_indices;
+};
+
+// The stream follows the first occurrence of each primitive in order (e.g.
+// Bvh::primitives or Grid::primitives), followed by the primitives missing
+// from it in the order of the compiled arrays.
+[[nodiscard]] Gpu_primitives
+make_gpu_primitives(const Compiled_scene &scene,
+                    const std::vector<std::uint32_t> &order);
+
+// Converts a compiled primitive again, after update_compiled_primitive.
+// Returns its index in the stream.
+std::size_t update_gpu_primitive(Gpu_primitives &primitives,
+                                 const Compiled_scene &scene,
+                                 Geometry_type type,
+                                 std::size_t index) noexcept;
+
+// Copy of the emitters with their primitives given by index in the stream
+// rather than by reference
+[[nodiscard]] std::vector<Emitter>
+make_gpu_emitters(const Gpu_primitives &primitives, const Emitters &emitters);
+
+// Indices in the stream of the given primitive references
+[[nodiscard]] std::vector<std::uint32_t>
+stream_indices(const Gpu_primitives &primitives,
+               const std::vector<std::uint32_t> &refs);
+
+#endif
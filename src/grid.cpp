@@ -0,0 +1,283 @@
+#include "grid.hpp"
+
+#ifndef __EMSCRIPTEN__
+#include "thread_pool.hpp"
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+
+namespace
+{
+
+// More cells hold fewer primitives each, but a ray steps through more of them
+// and each primitive overlaps more of them
+constexpr float cells_per_primitive {1.0f};
+constexpr std::uint32_t max_grid_size {4096};
+// Primitives much bigger than the cells are referenced by many of them, which
+// makes the grid big and its cells expensive to traverse
+constexpr std::size_t max_references_per_primitive {8};
+// Below this number of primitives per chunk, counting them is not worth a
+// separate array of counts
+constexpr std::size_t min_chunk_size {4096};
+// Each chunk counts its references in an array of all cells, so the number of
+// chunks is limited to keep the counts of all chunks within this many per
+// primitive
+constexpr std::size_t max_chunk_counts_per_primitive {4};
+
+struct Cell_range
+{
+    std::uint32_t x_min;
+    std::uint32_t y_min;
+    std::uint32_t x_max;
+    std::uint32_t y_max;
+};
+
+[[nodiscard]] std::size_t max_parallelism([[maybe_unused]] Thread_pool *pool)
+{
+#ifndef __EMSCRIPTEN__
+    if (pool != nullptr)
+    {
+        return pool->size();
+    }
+#endif
+    return 1;
+}
+
+void parallel_for([[maybe_unused]] Thread_pool *pool,
+                  std::size_t count,
+                  const std::function<void(std::size_t)> &task)
+{
+#ifndef __EMSCRIPTEN__
+    if (pool != nullptr)
+    {
+        pool->parallel_for(count, task);
+        return;
+    }
+#endif
+    for (std::size_t i {0}; i < count; ++i)
+    {
+        task(i);
+    }
+}
+
+// References of all primitives in the order of the compiled arrays
+[[nodiscard]] std::uint32_t primitive_ref(const Compiled_scene &scene,
+                                          std::size_t index) noexcept
+{
+    const auto circle_count = scene.circle_radius.size();
+    const auto line_count = scene.line_a_x.size();
+    if (index < circle_count)
+    {
+        return make_primitive_ref(Geometry_type::circle, index);
+    }
+    index -= circle_count;
+    if (index < line_count)
+    {
+        return make_primitive_ref(Geometry_type::line, index);
+    }
+    return make_primitive_ref(Geometry_type::arc, index - line_count);
+}
+
+[[nodiscard]] std::uint32_t cell_coordinate(float position,
+                                            float origin,
+                                            float cell_size,
+                                            std::uint32_t size) noexcept
+{
+    const auto cell = std::floor((position - origin) / cell_size);
+    return static_cast<std::uint32_t>(
+        std::clamp(cell, 0.0f, static_cast<float>(size - 1)));
+}
+
+[[nodiscard]] Cell_range cell_range(const Grid &grid,
+                                    const Aabb &bounds) noexcept
+{
+    return {
+        cell_coordinate(
+            bounds.min.x, grid.origin.x, grid.cell_size.x, grid.width),
+        cell_coordinate(
+            bounds.min.y, grid.origin.y, grid.cell_size.y, grid.height),
+        cell_coordinate(
+            bounds.max.x, grid.origin.x, grid.cell_size.x, grid.width),
+        cell_coordinate(
+            bounds.max.y, grid.origin.y, grid.cell_size.y, grid.height)};
+}
+
+// Chooses the resolution so that the grid has about cells_per_primitive cells
+// per primitive, with cells as square as possible
+void set_resolution(Grid &grid, const Aabb &bounds, std::size_t count)
+{
+    auto extent = bounds.max - bounds.min;
+    // Primitives all on a horizontal or vertical line still get a grid of
+    // finite cells
+    const auto min_extent = std::max(std::max(extent.x, extent.y) * 1e-3f,
+                                     std::numeric_limits<float>::min());
+    extent.x = std::max(extent.x, min_extent);
+    extent.y = std::max(extent.y, min_extent);
+
+    const auto cell_side = std::sqrt(extent.x * extent.y /
+                                     (cells_per_primitive *
+                                      static_cast<float>(count)));
+    const auto cells_along = [&](float length)
+    {
+        return static_cast<std::uint32_t>(std::clamp(
+            std::ceil(length / cell_side),
+            1.0f,
+            static_cast<float>(max_grid_size)));
+    };
+    grid.width = cells_along(extent.x);
+    grid.height = cells_along(extent.y);
+    grid.origin = bounds.min;
+    grid.cell_size = {extent.x / static_cast<float>(grid.width),
+                      extent.y / static_cast<float>(grid.height)};
+}
+
+} // namespace
+
+Grid build_grid(const Compiled_scene &scene, Thread_pool *pool)
+{
+    const auto count = primitive_count(scene);
+    if (count == 0)
+    {
+        return {};
+    }
+
+    // First primitive of a chunk, with the primitives split into chunks of
+    // equal size
+    const auto chunk_begin = [&](std::size_t chunk, std::size_t chunks)
+    {
+        return chunk * count / chunks;
+    };
+
+    const auto num_bounds_chunks = std::clamp(count / min_chunk_size,
+                                              std::size_t {1},
+                                              max_parallelism(pool));
+    std::vector<Aabb> bounds(count);
+    std::vector<Aabb> chunk_bounds(num_bounds_chunks);
+    parallel_for(pool,
+                 num_bounds_chunks,
+                 [&](std::size_t chunk)
+                 {
+                     auto &merged = chunk_bounds[chunk];
+                     merged = empty_aabb();
+                     for (auto i = chunk_begin(chunk, num_bounds_chunks);
+                          i < chunk_begin(chunk + 1, num_bounds_chunks);
+                          ++i)
+                     {
+                         bounds[i] =
+                             primitive_bounds(scene, primitive_ref(scene, i));
+                         merged = merge(merged, bounds[i]);
+                     }
+                 });
+
+    Grid grid {};
+    auto scene_bounds = chunk_bounds.front();
+    for (const auto &chunk : chunk_bounds)
+    {
+        scene_bounds = merge(scene_bounds, chunk);
+    }
+    set_resolution(grid, scene_bounds, count);
+    const std::size_t cell_count {std::size_t {grid.width} * grid.height};
+
+    std::size_t reference_count {0};
+    for (const auto &primitive : bounds)
+    {
+        const auto range = cell_range(grid, primitive);
+        reference_count += std::size_t {range.x_max - range.x_min + 1} *
+                           (range.y_max - range.y_min + 1);
+    }
+    if (reference_count > max_references_per_primitive * count)
+    {
+        return {};
+    }
+
+    const auto num_chunks =
+        std::clamp(max_chunk_counts_per_primitive * count / cell_count,
+                   std::size_t {1},
+                   num_bounds_chunks);
+    // Number of references of each chunk in each cell, turned into the index
+    // of the next reference of that chunk in that cell
+    std::vector<std::uint32_t> chunk_cells(num_chunks * cell_count);
+    parallel_for(pool,
+                 num_chunks,
+                 [&](std::size_t chunk)
+                 {
+                     auto *const counts = &chunk_cells[chunk * cell_count];
+                     for (auto i = chunk_begin(chunk, num_chunks);
+                          i < chunk_begin(chunk + 1, num_chunks);
+                          ++i)
+                     {
+                         const auto range = cell_range(grid, bounds[i]);
+                         for (auto y = range.y_min; y <= range.y_max; ++y)
+                         {
+                             for (auto x = range.x_min; x <= range.x_max; ++x)
+                             {
+                                 ++counts[y * grid.width + x];
+                             }
+                         }
+                     }
+                 });
+
+    grid.cell_offsets.resize(cell_count + 1);
+    std::uint32_t offset {0};
+    for (std::size_t cell {0}; cell < cell_count; ++cell)
+    {
+        grid.cell_offsets[cell] = offset;
+        for (std::size_t chunk {0}; chunk < num_chunks; ++chunk)
+        {
+            auto &chunk_cell = chunk_cells[chunk * cell_count + cell];
+            const auto chunk_count = chunk_cell;
+            chunk_cell = offset;
+            offset += chunk_count;
+        }
+    }
+    grid.cell_offsets.back() = offset;
+
+    grid.primitives.resize(offset);
+    parallel_for(pool,
+                 num_chunks,
+                 [&](std::size_t chunk)
+                 {
+                     auto *const next = &chunk_cells[chunk * cell_count];
+                     for (auto i = chunk_begin(chunk, num_chunks);
+                          i < chunk_begin(chunk + 1, num_chunks);
+                          ++i)
+                     {
+                         const auto ref = primitive_ref(scene, i);
+                         const auto range = cell_range(grid, bounds[i]);
+                         for (auto y = range.y_min; y <= range.y_max; ++y)
+                         {
+                             for (auto x = range.x_min; x <= range.x_max; ++x)
+                             {
+                                 grid.primitives[next[y * grid.width + x]++] =
+                                     ref;
+                             }
+                         }
+                     }
+                 });
+
+    return grid;
+}
+
+bool should_use_grid(const Compiled_scene &scene, const Grid &grid) noexcept
+{
+    // Clusters of primitives make their cells expensive to traverse
+    constexpr std::uint32_t max_cell_primitives {32};
+
+    if (primitive_count(scene) < grid_min_primitives ||
+        grid.cell_offsets.empty())
+    {
+        return false;
+    }
+    for (std::size_t i {0}; i + 1 < grid.cell_offsets.size(); ++i)
+    {
+        if (grid.cell_offsets[i + 1] - grid.cell_offsets[i] >
+            max_cell_primitives)
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include "bvh.hpp"
+#include "compiled_scene.hpp"
+#include "vec.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class Thread_pool;
+
+// Uniform grid over the bounds of the scene, with the references (see
+// make_primitive_ref) of the primitives overlapping each cell stored cell by
+// cell. A primitive is referenced by every cell its bounds overlap.
+struct Grid
+{
+    // Bottom left corner of the grid
+    vec2 origin;
+    vec2 cell_size;
+    std::uint32_t width;
+    std::uint32_t height;
+    // Index in primitives of the first reference of each cell, row by row
+    // starting from the bottom, followed by the total number of references
+    std::vector<std::uint32_t> cell_offsets;
+    std::vector<std::uint32_t> primitives;
+};
+
+// Below this number of primitives, a BVH is always preferred, so there is no
+// need to build a grid
+constexpr std::size_t grid_min_primitives {1024};
+
+// Builds the grid with a counting sort of the primitive references by cell:
+// chunks of primitives count their references per cell, a prefix sum over
+// cells and chunks gives each chunk its output ranges, and the chunks then
+// scatter their references. Both passes run on the pool if there is one. The
+// counts of each chunk span all cells, so their memory grows with the number
+// of threads, which is limited to keep it within a few counts per primitive.
+// The references of a cell are in the order of the compiled arrays, whatever
+// the number of threads. Returns an empty grid if the primitives are so big
+// compared to the cells that the grid would hold several times more
+// references than primitives.
+[[nodiscard]] Grid build_grid(const Compiled_scene &scene, Thread_pool *pool);
+
+// A grid beats a BVH when there are many primitives, small compared to the
+// cells and spread evenly, so that a ray steps through cells holding only a
+// few primitives each, whatever the density of the scene.
+[[nodiscard]] bool should_use_grid(const Compiled_scene &scene,
+                                   const Grid &grid) noexcept;
+
+#endif
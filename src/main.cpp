@@ -1,14 +1,349 @@
 #include "application.hpp"
 
+#include <charconv>
 #include <cstdlib>
 #include <iostream>
+#include <optional>
+#include <sstream>
 #include <stdexcept>
+#include <string_view>
 
-int main()
+namespace
+{
+
+constexpr auto usage =
+    "Usage: caustics [options]\n"
+    "\n"
+    "Without options, opens the interactive viewer. With any option, renders\n"
+    "headless and writes the result to --out.\n"
+    "\n"
+    "Options:\n"
+    "  --scene <file>     Scene to render (default: built-in scene)\n"
+    "  --out <file>       Output PNG image (default: image.png)\n"
+    "  --out-hdr <file>   Also write the accumulated radiance and sample\n"
+    "                     counts to an OpenEXR image\n"
+    "  --width <n>        Image width in pixels (default: 1920)\n"
+    "  --height <n>       Image height in pixels (default: 1080)\n"
+    "  --samples <n>      Samples per pixel (default: 1024)\n"
+    "  --error-threshold <x>\n"
+    "                     Stop sampling pixels once their relative error is\n"
+    "                     below x, making --samples a maximum\n"
+    "                     (default: 0, disabled; GPU only)\n"
+    "  --target-error <x>\n"
+    "                     Stop rendering once the mean relative error of all\n"
+    "                     pixels is below x, making --samples a maximum\n"
+    "                     (default: 0, disabled; GPU only)\n"
+    "  --light-tracing    Trace paths from the light sources, which converges\n"
+    "                     much faster for caustics (GPU only)\n"
+    "  --wavefront        Trace camera paths one bounce at a time, sorted by\n"
+    "                     material type (GPU only)\n"
+    "  --persistent-threads\n"
+    "                     Trace pixels pulled from a shared counter by a\n"
+    "                     fixed number of threads (GPU only)\n"
+    "  --tile-size <n>    Trace the image in tiles of n by n pixels, keeping\n"
+    "                     only one tile on the GPU (default: 0, whole image;\n"
+    "                     GPU only)\n"
+    "  --out-of-core <file>\n"
+    "                     Store the image in <file> while tracing tiles, so\n"
+    "                     that only the tiles in use are in memory (requires\n"
+    "                     --tile-size)\n"
+    "  --checkpoint <file>\n"
+    "                     Save the render state to <file> periodically\n"
+    "                     (GPU only, without --tile-size)\n"
+    "  --checkpoint-interval <s>\n"
+    "                     Seconds between checkpoints (default: 300)\n"
+    "  --resume           Continue the render saved in the --checkpoint file\n"
+    "  --worker-dir <dir> Render --samples samples not rendered by the other\n"
+    "                     workers sharing <dir>, and save them there (GPU\n"
+    "                     only, without --tile-size)\n"
+    "  --merge <dir>      Merge the renders of the workers that shared <dir>\n"
+    "                     into --out instead of rendering\n"
+    "  --cpu              Render on the CPU instead of the GPU\n"
+    "  --threads <n>      Number of CPU threads (default: all cores)\n"
+    "  --help             Show this message\n";
+
+template <typename T>
+[[nodiscard]] T parse_number(std::string_view option, std::string_view value)
+{
+    T result {};
+    const auto [ptr, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), result);
+    if (ec != std::errc {} || ptr != value.data() + value.size())
+    {
+        std::ostringstream message;
+        message << "Invalid value \"" << value << "\" for " << option;
+        throw std::runtime_error(message.str());
+    }
+    return result;
+}
+
+// Returns no options if --help was given
+[[nodiscard]] std::optional<Render_options> parse_options(int argc,
+                                                          char *argv[])
+{
+    Render_options options {.scene_path = {},
+                            .output_path = "image.png",
+                            .hdr_output_path = {},
+                            .width = 1920,
+                            .height = 1080,
+                            .samples = 1024,
+                            .error_threshold = 0.0f,
+                            .target_error = 0.0f,
+                            .light_tracing = false,
+                            .wavefront = false,
+                            .persistent_threads = false,
+                            .tile_size = 0,
+                            .out_of_core_path = {},
+                            .checkpoint_path = {},
+                            .checkpoint_interval = 300.0f,
+                            .resume = false,
+                            .worker_directory = {},
+                            .merge_directory = {},
+                            .cpu = false,
+                            .threads = 0,
+                            .count_rays = false};
+
+    for (int i {1}; i < argc; ++i)
+    {
+        const std::string_view option {argv[i]};
+
+        if (option == "--help")
+        {
+            return std::nullopt;
+        }
+        if (option == "--cpu")
+        {
+            options.cpu = true;
+            continue;
+        }
+        if (option == "--light-tracing")
+        {
+            options.light_tracing = true;
+            continue;
+        }
+        if (option == "--wavefront")
+        {
+            options.wavefront = true;
+            continue;
+        }
+        if (option == "--persistent-threads")
+        {
+            options.persistent_threads = true;
+            continue;
+        }
+        if (option == "--resume")
+        {
+            options.resume = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::ostringstream message;
+            message << "Unknown option or missing value: " << option << "\n\n"
+                    << usage;
+            throw std::runtime_error(message.str());
+        }
+        const std::string_view value {argv[++i]};
+
+        if (option == "--scene")
+        {
+            options.scene_path = value;
+        }
+        else if (option == "--out")
+        {
+            options.output_path = value;
+        }
+        else if (option == "--width")
+        {
+            options.width = parse_number<int>(option, value);
+        }
+        else if (option == "--height")
+        {
+            options.height = parse_number<int>(option, value);
+        }
+        else if (option == "--samples")
+        {
+            options.samples = parse_number<unsigned int>(option, value);
+        }
+        else if (option == "--error-threshold")
+        {
+            options.error_threshold = parse_number<float>(option, value);
+        }
+        else if (option == "--target-error")
+        {
+            options.target_error = parse_number<float>(option, value);
+        }
+        else if (option == "--out-hdr")
+        {
+            options.hdr_output_path = value;
+        }
+        else if (option == "--tile-size")
+        {
+            options.tile_size = parse_number<int>(option, value);
+        }
+        else if (option == "--out-of-core")
+        {
+            options.out_of_core_path = value;
+        }
+        else if (option == "--checkpoint")
+        {
+            options.checkpoint_path = value;
+        }
+        else if (option == "--worker-dir")
+        {
+            options.worker_directory = value;
+        }
+        else if (option == "--merge")
+        {
+            options.merge_directory = value;
+        }
+        else if (option == "--checkpoint-interval")
+        {
+            options.checkpoint_interval = parse_number<float>(option, value);
+        }
+        else if (option == "--threads")
+        {
+            options.threads = parse_number<unsigned int>(option, value);
+        }
+        else
+        {
+            std::ostringstream message;
+            message << "Unknown option: " << option << "\n\n" << usage;
+            throw std::runtime_error(message.str());
+        }
+    }
+
+    if (options.width <= 0 || options.height <= 0)
+    {
+        throw std::runtime_error("Image size must be positive");
+    }
+    if (options.tile_size < 0)
+    {
+        throw std::runtime_error("Tile size must not be negative");
+    }
+    if (options.error_threshold < 0.0f)
+    {
+        throw std::runtime_error("Error threshold must not be negative");
+    }
+    if (options.target_error < 0.0f)
+    {
+        throw std::runtime_error("Target error must not be negative");
+    }
+    if (options.cpu && options.error_threshold > 0.0f)
+    {
+        throw std::runtime_error(
+            "Adaptive sampling is only supported on the GPU");
+    }
+    if (options.cpu && options.target_error > 0.0f)
+    {
+        throw std::runtime_error(
+            "Convergence-based termination is only supported on the GPU");
+    }
+    if (options.cpu && options.light_tracing)
+    {
+        throw std::runtime_error("Light tracing is only supported on the GPU");
+    }
+    if (options.cpu && options.wavefront)
+    {
+        throw std::runtime_error(
+            "Wavefront path tracing is only supported on the GPU");
+    }
+    if (options.cpu && options.persistent_threads)
+    {
+        throw std::runtime_error(
+            "Persistent threads are only supported on the GPU");
+    }
+    if (options.cpu && options.tile_size > 0)
+    {
+        throw std::runtime_error(
+            "Tiled rendering is only supported on the GPU");
+    }
+    if (!options.out_of_core_path.empty() && options.tile_size == 0)
+    {
+        throw std::runtime_error("Out-of-core rendering needs --tile-size");
+    }
+    if (options.checkpoint_interval <= 0.0f)
+    {
+        throw std::runtime_error("Checkpoint interval must be positive");
+    }
+    if (options.resume && options.checkpoint_path.empty())
+    {
+        throw std::runtime_error("Resuming needs a --checkpoint file");
+    }
+    if (!options.checkpoint_path.empty() &&
+        (options.cpu || options.light_tracing || options.tile_size > 0))
+    {
+        throw std::runtime_error(
+            "Checkpoints are only supported when tracing the whole image from "
+            "the camera on the GPU");
+    }
+    if (!options.worker_directory.empty() &&
+        (!options.checkpoint_path.empty() || options.resume))
+    {
+        throw std::runtime_error(
+            "Workers save their checkpoints in the worker directory");
+    }
+    if (!options.worker_directory.empty() &&
+        (options.cpu || options.light_tracing || options.tile_size > 0))
+    {
+        throw std::runtime_error(
+            "Workers are only supported when tracing the whole image from the "
+            "camera on the GPU");
+    }
+    if (options.light_tracing && options.tile_size > 0)
+    {
+        throw std::runtime_error(
+            "Light tracing splats anywhere in the image and cannot be traced "
+            "in tiles");
+    }
+    if (options.light_tracing &&
+        (options.wavefront || options.persistent_threads))
+    {
+        throw std::runtime_error(
+            "Light tracing does not support wavefront path tracing or "
+            "persistent threads");
+    }
+    if (options.wavefront && options.persistent_threads)
+    {
+        throw std::runtime_error(
+            "Wavefront path tracing does not use persistent threads");
+    }
+    if (options.light_tracing &&
+        (options.error_threshold > 0.0f || options.target_error > 0.0f))
+    {
+        throw std::runtime_error(
+            "Light tracing does not estimate the error of pixels");
+    }
+
+    return options;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
 {
     try
     {
-        run();
+        if (argc <= 1)
+        {
+            run();
+            return EXIT_SUCCESS;
+        }
+
+        const auto options = parse_options(argc, argv);
+        if (!options.has_value())
+        {
+            std::cout << usage;
+            return EXIT_SUCCESS;
+        }
+
+#ifndef __EMSCRIPTEN__
+        run_headless(*options);
+#else
+        throw std::runtime_error("Headless rendering is not supported on the "
+                                 "web");
+#endif
 
         return EXIT_SUCCESS;
     }
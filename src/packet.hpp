@@ -0,0 +1,496 @@
+#ifndef PACKET_HPP
+#define PACKET_HPP
+
+// Packets of floats processed in lockstep by the CPU intersection kernels,
+// one ray per lane. The widest instruction set enabled at compile time is
+// used. Arithmetic is done in the same order as the scalar code, so that the
+// results are identical.
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#else
+#include <algorithm>
+#include <cmath>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#if defined(__AVX512F__)
+inline constexpr std::size_t packet_size {16};
+#elif defined(__AVX2__)
+inline constexpr std::size_t packet_size {8};
+#else
+// The rays of a packet are incoherent, they only pay off when tested with
+// vector instructions. Without them, rays are traced one at a time.
+inline constexpr std::size_t packet_size {1};
+#endif
+
+// Alignment of arrays of packet_size floats, for aligned loads and stores
+inline constexpr std::size_t packet_alignment {packet_size * sizeof(float)};
+
+#if defined(__AVX512F__)
+
+struct Float_packet
+{
+    __m512 v;
+};
+
+struct Mask_packet
+{
+    __mmask16 m;
+};
+
+[[nodiscard]] inline Float_packet broadcast(float f) noexcept
+{
+    return {_mm512_set1_ps(f)};
+}
+
+[[nodiscard]] inline Float_packet load(const float *p) noexcept
+{
+    return {_mm512_load_ps(p)};
+}
+
+inline void store(float *p, Float_packet a) noexcept
+{
+    _mm512_store_ps(p, a.v);
+}
+
+[[nodiscard]] inline Float_packet operator+(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm512_add_ps(a.v, b.v)};
+}
+
+[[nodiscard]] inline Float_packet operator-(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm512_sub_ps(a.v, b.v)};
+}
+
+[[nodiscard]] inline Float_packet operator*(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm512_mul_ps(a.v, b.v)};
+}
+
+[[nodiscard]] inline Float_packet operator/(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm512_div_ps(a.v, b.v)};
+}
+
+[[nodiscard]] inline Float_packet sqrt(Float_packet a) noexcept
+{
+    return {_mm512_sqrt_ps(a.v)};
+}
+
+[[nodiscard]] inline Float_packet abs(Float_packet a) noexcept
+{
+    return {_mm512_abs_ps(a.v)};
+}
+
+// Same as std::min and std::max, which return a if either is NaN
+[[nodiscard]] inline Float_packet min(Float_packet a, Float_packet b) noexcept
+{
+    return {_mm512_min_ps(b.v, a.v)};
+}
+
+[[nodiscard]] inline Float_packet max(Float_packet a, Float_packet b) noexcept
+{
+    return {_mm512_max_ps(b.v, a.v)};
+}
+
+[[nodiscard]] inline Mask_packet operator<(Float_packet a,
+                                           Float_packet b) noexcept
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)};
+}
+
+[[nodiscard]] inline Mask_packet operator<=(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)};
+}
+
+[[nodiscard]] inline Mask_packet operator>(Float_packet a,
+                                           Float_packet b) noexcept
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ)};
+}
+
+[[nodiscard]] inline Mask_packet operator>=(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)};
+}
+
+[[nodiscard]] inline Mask_packet operator&(Mask_packet a,
+                                           Mask_packet b) noexcept
+{
+    return {static_cast<__mmask16>(a.m & b.m)};
+}
+
+[[nodiscard]] inline Mask_packet operator|(Mask_packet a,
+                                           Mask_packet b) noexcept
+{
+    return {static_cast<__mmask16>(a.m | b.m)};
+}
+
+// Lanes of a where the mask is set, lanes of b elsewhere
+[[nodiscard]] inline Float_packet
+select(Mask_packet mask, Float_packet a, Float_packet b) noexcept
+{
+    return {_mm512_mask_blend_ps(mask.m, b.v, a.v)};
+}
+
+// Bit i is set if lane i of the mask is set
+[[nodiscard]] inline std::uint32_t bits(Mask_packet mask) noexcept
+{
+    return mask.m;
+}
+
+#elif defined(__AVX2__)
+
+struct Float_packet
+{
+    __m256 v;
+};
+
+// All bits of a lane are set if the lane is set
+struct Mask_packet
+{
+    __m256 m;
+};
+
+[[nodiscard]] inline Float_packet broadcast(float f) noexcept
+{
+    return {_mm256_set1_ps(f)};
+}
+
+[[nodiscard]] inline Float_packet load(const float *p) noexcept
+{
+    return {_mm256_load_ps(p)};
+}
+
+inline void store(float *p, Float_packet a) noexcept
+{
+    _mm256_store_ps(p, a.v);
+}
+
+[[nodiscard]] inline Float_packet operator+(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm256_add_ps(a.v, b.v)};
+}
+
+[[nodiscard]] inline Float_packet operator-(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm256_sub_ps(a.v, b.v)};
+}
+
+[[nodiscard]] inline Float_packet operator*(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm256_mul_ps(a.v, b.v)};
+}
+
+[[nodiscard]] inline Float_packet operator/(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm256_div_ps(a.v, b.v)};
+}
+
+[[nodiscard]] inline Float_packet sqrt(Float_packet a) noexcept
+{
+    return {_mm256_sqrt_ps(a.v)};
+}
+
+[[nodiscard]] inline Float_packet abs(Float_packet a) noexcept
+{
+    return {_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)};
+}
+
+// Same as std::min and std::max, which return a if either is NaN
+[[nodiscard]] inline Float_packet min(Float_packet a, Float_packet b) noexcept
+{
+    return {_mm256_min_ps(b.v, a.v)};
+}
+
+[[nodiscard]] inline Float_packet max(Float_packet a, Float_packet b) noexcept
+{
+    return {_mm256_max_ps(b.v, a.v)};
+}
+
+[[nodiscard]] inline Mask_packet operator<(Float_packet a,
+                                           Float_packet b) noexcept
+{
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)};
+}
+
+[[nodiscard]] inline Mask_packet operator<=(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)};
+}
+
+[[nodiscard]] inline Mask_packet operator>(Float_packet a,
+                                           Float_packet b) noexcept
+{
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)};
+}
+
+[[nodiscard]] inline Mask_packet operator>=(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)};
+}
+
+[[nodiscard]] inline Mask_packet operator&(Mask_packet a,
+                                           Mask_packet b) noexcept
+{
+    return {_mm256_and_ps(a.m, b.m)};
+}
+
+[[nodiscard]] inline Mask_packet operator|(Mask_packet a,
+                                           Mask_packet b) noexcept
+{
+    return {_mm256_or_ps(a.m, b.m)};
+}
+
+// Lanes of a where the mask is set, lanes of b elsewhere
+[[nodiscard]] inline Float_packet
+select(Mask_packet mask, Float_packet a, Float_packet b) noexcept
+{
+    return {_mm256_blendv_ps(b.v, a.v, mask.m)};
+}
+
+// Bit i is set if lane i of the mask is set
+[[nodiscard]] inline std::uint32_t bits(Mask_packet mask) noexcept
+{
+    return static_cast<std::uint32_t>(_mm256_movemask_ps(mask.m));
+}
+
+#else
+
+struct Float_packet
+{
+    float v[packet_size];
+};
+
+struct Mask_packet
+{
+    bool m[packet_size];
+};
+
+namespace packet_detail
+{
+
+template <typename F>
+[[nodiscard]] inline Float_packet
+map(Float_packet a, Float_packet b, F f) noexcept
+{
+    Float_packet result;
+    for (std::size_t i {0}; i < packet_size; ++i)
+    {
+        result.v[i] = f(a.v[i], b.v[i]);
+    }
+    return result;
+}
+
+template <typename F>
+[[nodiscard]] inline Mask_packet
+compare(Float_packet a, Float_packet b, F f) noexcept
+{
+    Mask_packet result;
+    for (std::size_t i {0}; i < packet_size; ++i)
+    {
+        result.m[i] = f(a.v[i], b.v[i]);
+    }
+    return result;
+}
+
+} // namespace packet_detail
+
+[[nodiscard]] inline Float_packet broadcast(float f) noexcept
+{
+    Float_packet result;
+    std::fill_n(result.v, packet_size, f);
+    return result;
+}
+
+[[nodiscard]] inline Float_packet load(const float *p) noexcept
+{
+    Float_packet result;
+    std::copy_n(p, packet_size, result.v);
+    return result;
+}
+
+inline void store(float *p, Float_packet a) noexcept
+{
+    std::copy_n(a.v, packet_size, p);
+}
+
+[[nodiscard]] inline Float_packet operator+(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return packet_detail::map(a, b, [](float x, float y) { return x + y; });
+}
+
+[[nodiscard]] inline Float_packet operator-(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return packet_detail::map(a, b, [](float x, float y) { return x - y; });
+}
+
+[[nodiscard]] inline Float_packet operator*(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return packet_detail::map(a, b, [](float x, float y) { return x * y; });
+}
+
+[[nodiscard]] inline Float_packet operator/(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return packet_detail::map(a, b, [](float x, float y) { return x / y; });
+}
+
+[[nodiscard]] inline Float_packet sqrt(Float_packet a) noexcept
+{
+    return packet_detail::map(
+        a, a, [](float x, float) { return std::sqrt(x); });
+}
+
+[[nodiscard]] inline Float_packet abs(Float_packet a) noexcept
+{
+    return packet_detail::map(
+        a, a, [](float x, float) { return std::abs(x); });
+}
+
+[[nodiscard]] inline Float_packet min(Float_packet a, Float_packet b) noexcept
+{
+    return packet_detail::map(
+        a, b, [](float x, float y) { return std::min(x, y); });
+}
+
+[[nodiscard]] inline Float_packet max(Float_packet a, Float_packet b) noexcept
+{
+    return packet_detail::map(
+        a, b, [](float x, float y) { return std::max(x, y); });
+}
+
+[[nodiscard]] inline Mask_packet operator<(Float_packet a,
+                                           Float_packet b) noexcept
+{
+    return packet_detail::compare(
+        a, b, [](float x, float y) { return x < y; });
+}
+
+[[nodiscard]] inline Mask_packet operator<=(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return packet_detail::compare(
+        a, b, [](float x, float y) { return x <= y; });
+}
+
+[[nodiscard]] inline Mask_packet operator>(Float_packet a,
+                                           Float_packet b) noexcept
+{
+    return packet_detail::compare(
+        a, b, [](float x, float y) { return x > y; });
+}
+
+[[nodiscard]] inline Mask_packet operator>=(Float_packet a,
+                                            Float_packet b) noexcept
+{
+    return packet_detail::compare(
+        a, b, [](float x, float y) { return x >= y; });
+}
+
+[[nodiscard]] inline Mask_packet operator&(Mask_packet a,
+                                           Mask_packet b) noexcept
+{
+    Mask_packet result;
+    for (std::size_t i {0}; i < packet_size; ++i)
+    {
+        result.m[i] = a.m[i] && b.m[i];
+    }
+    return result;
+}
+
+[[nodiscard]] inline Mask_packet operator|(Mask_packet a,
+                                           Mask_packet b) noexcept
+{
+    Mask_packet result;
+    for (std::size_t i {0}; i < packet_size; ++i)
+    {
+        result.m[i] = a.m[i] || b.m[i];
+    }
+    return result;
+}
+
+// Lanes of a where the mask is set, lanes of b elsewhere
+[[nodiscard]] inline Float_packet
+select(Mask_packet mask, Float_packet a, Float_packet b) noexcept
+{
+    Float_packet result;
+    for (std::size_t i {0}; i < packet_size; ++i)
+    {
+        result.v[i] = mask.m[i] ? a.v[i] : b.v[i];
+    }
+    return result;
+}
+
+// Bit i is set if lane i of the mask is set
+[[nodiscard]] inline std::uint32_t bits(Mask_packet mask) noexcept
+{
+    std::uint32_t result {0};
+    for (std::size_t i {0}; i < packet_size; ++i)
+    {
+        result |= static_cast<std::uint32_t>(mask.m[i]) << i;
+    }
+    return result;
+}
+
+#endif
+
+[[nodiscard]] inline bool any(Mask_packet mask) noexcept
+{
+    return bits(mask) != 0;
+}
+
+// Allocates arrays that start on a packet boundary
+template <typename T>
+struct Packet_allocator
+{
+    using value_type = T;
+
+    Packet_allocator() noexcept = default;
+
+    template <typename U>
+    constexpr Packet_allocator(const Packet_allocator<U> &) noexcept
+    {
+    }
+
+    [[nodiscard]] T *allocate(std::size_t n)
+    {
+        return static_cast<T *>(::operator new(
+            n * sizeof(T), std::align_val_t {packet_alignment}));
+    }
+
+    void deallocate(T *p, std::size_t) noexcept
+    {
+        ::operator delete(p, std::align_val_t {packet_alignment});
+    }
+
+    [[nodiscard]] constexpr bool
+    operator==(const Packet_allocator &) const noexcept = default;
+};
+
+template <typename T>
+using Packet_vector = std::vector<T, Packet_allocator<T>>;
+
+#endif
@@ -0,0 +1,333 @@
+#include "packet_intersect.hpp"
+
+#include <bit>
+#include <limits>
+
+namespace
+{
+
+// NOTE: the kernels below reproduce intersect_circle, intersect_line,
+// intersect_arc and intersect_aabb of shaders/trace.glsl, for one primitive
+// and a whole packet of rays at once.
+
+struct Packet_state
+{
+    Float_packet origin_x;
+    Float_packet origin_y;
+    Float_packet direction_x;
+    Float_packet direction_y;
+    Float_packet inv_direction_x;
+    Float_packet inv_direction_y;
+    Float_packet t;
+    Float_packet u;
+    std::array<std::uint32_t, packet_size> primitive;
+};
+
+inline void record_hits(Packet_state &state,
+                        Mask_packet hit,
+                        std::uint32_t ref) noexcept
+{
+    for (auto lanes = bits(hit); lanes != 0; lanes &= lanes - 1)
+    {
+        state.primitive[static_cast<std::size_t>(std::countr_zero(lanes))] =
+            ref;
+    }
+}
+
+inline void intersect_circle(Packet_state &state,
+                             float center_x,
+                             float center_y,
+                             float radius,
+                             std::uint32_t ref) noexcept
+{
+    const auto zero = broadcast(0.0f);
+    const auto oc_x = broadcast(center_x) - state.origin_x;
+    const auto oc_y = broadcast(center_y) - state.origin_y;
+    const auto oc_dot_dir =
+        oc_x * state.direction_x + oc_y * state.direction_y;
+    const auto discriminant = oc_dot_dir * oc_dot_dir -
+                              (oc_x * oc_x + oc_y * oc_y) +
+                              broadcast(radius) * broadcast(radius);
+
+    // A negative discriminant gives NaN distances, which never hit
+    const auto sqrt_discriminant = sqrt(discriminant);
+    const auto t1 = oc_dot_dir - sqrt_discriminant;
+    const auto t2 = oc_dot_dir + sqrt_discriminant;
+    // t2 is never closer than t1, so t1 is the hit whenever it is in front
+    const auto t_hit = select(t1 > zero, t1, t2);
+    const auto hit = (t_hit > zero) & (t_hit < state.t);
+
+    state.t = select(hit, t_hit, state.t);
+    record_hits(state, hit, ref);
+}
+
+inline void intersect_line(Packet_state &state,
+                           float a_x,
+                           float a_y,
+                           float b_x,
+                           float b_y,
+                           std::uint32_t ref) noexcept
+{
+    const auto zero = broadcast(0.0f);
+    const auto ab_x = broadcast(b_x) - broadcast(a_x);
+    const auto ab_y = broadcast(b_y) - broadcast(a_y);
+    const auto determinant =
+        state.direction_x * ab_y - state.direction_y * ab_x;
+    const auto ao_x = state.origin_x - broadcast(a_x);
+    const auto ao_y = state.origin_y - broadcast(a_y);
+    const auto intersection_u =
+        (state.direction_x * ao_y - state.direction_y * ao_x) / determinant;
+    const auto intersection_t = (ab_x * ao_y - ab_y * ao_x) / determinant;
+    // Parallel rays are excluded
+    const auto hit = (abs(determinant) >= broadcast(1e-6f)) &
+                     (intersection_t > zero) & (intersection_t < state.t) &
+                     (intersection_u >= zero) &
+                     (intersection_u <= broadcast(1.0f));
+
+    state.t = select(hit, intersection_t, state.t);
+    state.u = select(hit, intersection_u, state.u);
+    record_hits(state, hit, ref);
+}
+
+inline void intersect_arc(Packet_state &state,
+                          float center_x,
+                          float center_y,
+                          float radius,
+                          float a_x,
+                          float a_y,
+                          float b,
+                          std::uint32_t ref) noexcept
+{
+    const auto zero = broadcast(0.0f);
+    const auto oc_x = broadcast(center_x) - state.origin_x;
+    const auto oc_y = broadcast(center_y) - state.origin_y;
+    const auto oc_dot_dir =
+        oc_x * state.direction_x + oc_y * state.direction_y;
+    const auto discriminant = oc_dot_dir * oc_dot_dir -
+                              (oc_x * oc_x + oc_y * oc_y) +
+                              broadcast(radius) * broadcast(radius);
+
+    const auto sqrt_discriminant = sqrt(discriminant);
+    const auto on_arc = [&](Float_packet t)
+    {
+        const auto rel_hit_pos_x =
+            state.origin_x + t * state.direction_x - broadcast(center_x);
+        const auto rel_hit_pos_y =
+            state.origin_y + t * state.direction_y - broadcast(center_y);
+        return (t > zero) & (broadcast(a_x) * rel_hit_pos_x +
+                                 broadcast(a_y) * rel_hit_pos_y >=
+                             broadcast(b));
+    };
+    const auto t1 = oc_dot_dir - sqrt_discriminant;
+    const auto t2 = oc_dot_dir + sqrt_discriminant;
+    const auto t1_on_arc = on_arc(t1);
+    const auto t_hit = select(t1_on_arc, t1, t2);
+    const auto hit = (t1_on_arc | on_arc(t2)) & (t_hit < state.t);
+
+    state.t = select(hit, t_hit, state.t);
+    record_hits(state, hit, ref);
+}
+
+[[nodiscard]] inline Mask_packet intersect_aabb(const Packet_state &state,
+                                                const vec2 &aabb_min,
+                                                const vec2 &aabb_max,
+                                                Float_packet &t_entry) noexcept
+{
+    const auto zero = broadcast(0.0f);
+    const auto t1_x =
+        (broadcast(aabb_min.x) - state.origin_x) * state.inv_direction_x;
+    const auto t1_y =
+        (broadcast(aabb_min.y) - state.origin_y) * state.inv_direction_y;
+    const auto t2_x =
+        (broadcast(aabb_max.x) - state.origin_x) * state.inv_direction_x;
+    const auto t2_y =
+        (broadcast(aabb_max.y) - state.origin_y) * state.inv_direction_y;
+    const auto t_min = max(min(t1_x, t2_x), min(t1_y, t2_y));
+    const auto t_max = min(max(t1_x, t2_x), max(t1_y, t2_y));
+    t_entry = t_min;
+    // Inactive lanes are excluded to skip the subtrees only they would visit
+    return (zero < state.t) & (t_max >= max(t_min, zero)) &
+           (t_min < state.t);
+}
+
+void intersect_primitive(const Compiled_scene &scene,
+                         std::uint32_t ref,
+                         Packet_state &state) noexcept
+{
+    const auto i = primitive_ref_index(ref);
+    switch (primitive_ref_type(ref))
+    {
+    case Geometry_type::circle:
+        intersect_circle(state,
+                         scene.circle_center_x[i],
+                         scene.circle_center_y[i],
+                         scene.circle_radius[i],
+                         ref);
+        break;
+    case Geometry_type::line:
+        intersect_line(state,
+                       scene.line_a_x[i],
+                       scene.line_a_y[i],
+                       scene.line_b_x[i],
+                       scene.line_b_y[i],
+                       ref);
+        break;
+    case Geometry_type::arc:
+        intersect_arc(state,
+                      scene.arc_center_x[i],
+                      scene.arc_center_y[i],
+                      scene.arc_radius[i],
+                      scene.arc_a_x[i],
+                      scene.arc_a_y[i],
+                      scene.arc_b[i],
+                      ref);
+        break;
+    case Geometry_type::none: break;
+    }
+}
+
+// Smallest entry distance of the lanes that hit a node
+[[nodiscard]] float min_entry(Mask_packet hit, Float_packet t_entry) noexcept
+{
+    alignas(packet_alignment) std::array<float, packet_size> lanes;
+    store(lanes.data(),
+          select(hit,
+                 t_entry,
+                 broadcast(std::numeric_limits<float>::infinity())));
+    auto result = lanes[0];
+    for (std::size_t i {1}; i < packet_size; ++i)
+    {
+        result = std::min(result, lanes[i]);
+    }
+    return result;
+}
+
+void intersect_bvh(const Compiled_scene &scene,
+                   const Bvh &bvh,
+                   Packet_state &state) noexcept
+{
+    Float_packet t_entry {};
+    if (!any(intersect_aabb(
+            state, bvh.nodes[0].aabb_min, bvh.nodes[0].aabb_max, t_entry)))
+    {
+        return;
+    }
+
+    // A node is visited if any ray of the packet hits it
+    std::uint32_t stack[bvh_max_depth];
+    std::uint32_t stack_size {0};
+    std::uint32_t node_index {0};
+
+    for (;;)
+    {
+        const auto &node = bvh.nodes[node_index];
+        if (node.count > 0)
+        {
+            for (auto i = node.offset; i < node.offset + node.count; ++i)
+            {
+                intersect_primitive(scene, bvh.primitives[i], state);
+            }
+        }
+        else
+        {
+            const auto left = node_index + 1;
+            const auto right = node.offset;
+            Float_packet t_left {};
+            Float_packet t_right {};
+            const auto hit_left = intersect_aabb(state,
+                                                 bvh.nodes[left].aabb_min,
+                                                 bvh.nodes[left].aabb_max,
+                                                 t_left);
+            const auto hit_right = intersect_aabb(state,
+                                                  bvh.nodes[right].aabb_min,
+                                                  bvh.nodes[right].aabb_max,
+                                                  t_right);
+            const auto any_left = any(hit_left);
+            const auto any_right = any(hit_right);
+            if (any_left && any_right)
+            {
+                // Nearest child first, as seen by the closest ray
+                const auto left_first = min_entry(hit_left, t_left) <=
+                                        min_entry(hit_right, t_right);
+                stack[stack_size++] = left_first ? right : left;
+                node_index = left_first ? left : right;
+                continue;
+            }
+            if (any_left || any_right)
+            {
+                node_index = any_left ? left : right;
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+        {
+            return;
+        }
+        node_index = stack[--stack_size];
+    }
+}
+
+void intersect_all(const Compiled_scene &scene,
+                   Packet_state &state) noexcept
+{
+    for (std::size_t i {0}; i < scene.circle_radius.size(); ++i)
+    {
+        intersect_circle(state,
+                         scene.circle_center_x[i],
+                         scene.circle_center_y[i],
+                         scene.circle_radius[i],
+                         make_primitive_ref(Geometry_type::circle, i));
+    }
+    for (std::size_t i {0}; i < scene.line_a_x.size(); ++i)
+    {
+        intersect_line(state,
+                       scene.line_a_x[i],
+                       scene.line_a_y[i],
+                       scene.line_b_x[i],
+                       scene.line_b_y[i],
+                       make_primitive_ref(Geometry_type::line, i));
+    }
+    for (std::size_t i {0}; i < scene.arc_radius.size(); ++i)
+    {
+        intersect_arc(state,
+                      scene.arc_center_x[i],
+                      scene.arc_center_y[i],
+                      scene.arc_radius[i],
+                      scene.arc_a_x[i],
+                      scene.arc_a_y[i],
+                      scene.arc_b[i],
+                      make_primitive_ref(Geometry_type::arc, i));
+    }
+}
+
+} // namespace
+
+void intersect(const Compiled_scene &scene,
+               const Bvh &bvh,
+               Ray_packet &rays) noexcept
+{
+    Packet_state state {};
+    state.origin_x = load(rays.origin_x.data());
+    state.origin_y = load(rays.origin_y.data());
+    state.direction_x = load(rays.direction_x.data());
+    state.direction_y = load(rays.direction_y.data());
+    state.inv_direction_x = broadcast(1.0f) / state.direction_x;
+    state.inv_direction_y = broadcast(1.0f) / state.direction_y;
+    state.t = load(rays.t.data());
+    state.u = load(rays.u.data());
+    state.primitive = rays.primitive;
+
+    if (!bvh.nodes.empty())
+    {
+        intersect_bvh(scene, bvh, state);
+    }
+    else
+    {
+        intersect_all(scene, state);
+    }
+
+    store(rays.t.data(), state.t);
+    store(rays.u.data(), state.u);
+    rays.primitive = state.primitive;
+}
@@ -0,0 +1,32 @@
+#ifndef PACKET_INTERSECT_HPP
+#define PACKET_INTERSECT_HPP
+
+#include "bvh.hpp"
+#include "compiled_scene.hpp"
+#include "packet.hpp"
+
+#include <array>
+#include <cstdint>
+
+// One ray per lane
+struct Ray_packet
+{
+    alignas(packet_alignment) std::array<float, packet_size> origin_x;
+    alignas(packet_alignment) std::array<float, packet_size> origin_y;
+    alignas(packet_alignment) std::array<float, packet_size> direction_x;
+    alignas(packet_alignment) std::array<float, packet_size> direction_y;
+    // Distance to the closest hit found so far, lanes at 0 are inactive
+    alignas(packet_alignment) std::array<float, packet_size> t;
+    // Position of the hit along a line
+    alignas(packet_alignment) std::array<float, packet_size> u;
+    // Reference of the primitive hit, as in Bvh::primitives, 0 for none
+    std::array<std::uint32_t, packet_size> primitive;
+};
+
+// Finds the closest hit of every active ray that is closer than its t. If the
+// BVH is empty, all primitives are tested.
+void intersect(const Compiled_scene &scene,
+               const Bvh &bvh,
+               Ray_packet &rays) noexcept;
+
+#endif
@@ -16,6 +16,16 @@ enum struct Material_type : std::uint32_t
     dielectric
 };
 
+// Kind of primitive referenced by a hit or an acceleration structure. The
+// values match the GEOMETRY_* constants of trace.glsl.
+enum struct Geometry_type : std::uint32_t
+{
+    none,
+    circle,
+    line,
+    arc
+};
+
 struct alignas(16) Material
 {
     alignas(16) vec3 color;
@@ -23,25 +33,25 @@ struct alignas(16) Material
     Material_type type;
 };
 
-struct alignas(16) Circle
+struct Circle
 {
-    alignas(8) vec2 center;
+    vec2 center;
     float radius;
     std::uint32_t material_id;
 };
 
-struct alignas(16) Line
+struct Line
 {
-    alignas(8) vec2 a;
-    alignas(8) vec2 b;
+    vec2 a;
+    vec2 b;
     std::uint32_t material_id;
 };
 
-struct alignas(16) Arc
+struct Arc
 {
-    alignas(8) vec2 center;
+    vec2 center;
     float radius;
-    alignas(8) vec2 a;
+    vec2 a;
     float b;
     std::uint32_t material_id;
 };
@@ -0,0 +1,33 @@
+
+precision highp float;
+
+layout (location = 0) in vec2 instance_center;
+layout (location = 1) in float instance_radius;
+layout (location = 2) in float instance_b;
+layout (location = 3) in vec2 instance_a;
+layout (location = 4) in vec3 instance_color;
+
+uniform vec2 view_position;
+uniform vec2 view_size;
+uniform float thickness; // In fraction of the view height
+
+out vec4 local;
+out vec3 color;
+
+void main()
+{
+    // Corners of the quad as a triangle strip
+    vec2 corner = vec2((gl_VertexID & 1) == 0 ? -1.0 : 1.0, gl_VertexID < 2 ? -1.0 : 1.0);
+    vec2 dir = instance_a;
+    vec2 left = vec2(-dir.y, dir.x);
+    float world_thickness = thickness * view_size.y;
+    float half_side = instance_radius + 0.5 * world_thickness;
+
+    // The bottom of the quad is at the cutoff line of the arc
+    float bottom_coord = (instance_b - 0.5 * world_thickness) / half_side;
+    vec2 local_position = vec2(corner.x, corner.y > 0.0 ? 1.0 : bottom_coord);
+    vec2 world_position = instance_center + (dir * local_position.y - left * local_position.x) * half_side;
+    gl_Position = vec4((world_position - view_position) / (0.5 * view_size), 0.0, 1.0);
+    local = vec4(local_position, world_thickness / half_side, instance_b / half_side);
+    color = instance_color;
+}
@@ -0,0 +1,26 @@
+
+precision highp float;
+
+layout (location = 0) in vec2 instance_center;
+layout (location = 1) in float instance_radius;
+layout (location = 2) in vec3 instance_color;
+
+uniform vec2 view_position;
+uniform vec2 view_size;
+uniform float thickness; // In fraction of the view height
+
+out vec4 local;
+out vec3 color;
+
+void main()
+{
+    // Corners of the quad as a triangle strip
+    vec2 corner = vec2((gl_VertexID & 1) == 0 ? -1.0 : 1.0, gl_VertexID < 2 ? -1.0 : 1.0);
+    float world_thickness = thickness * view_size.y;
+    float half_side = instance_radius + 0.5 * world_thickness;
+
+    vec2 world_position = instance_center + corner * half_side;
+    gl_Position = vec4((world_position - view_position) / (0.5 * view_size), 0.0, 1.0);
+    local = vec4(corner, world_thickness / half_side, 0.0);
+    color = instance_color;
+}
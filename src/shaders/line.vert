@@ -0,0 +1,37 @@
+
+precision highp float;
+
+layout (location = 0) in vec2 instance_a;
+layout (location = 1) in vec2 instance_b;
+layout (location = 2) in vec3 instance_color;
+
+uniform vec2 view_position;
+uniform vec2 view_size;
+uniform float thickness; // In fraction of the view height
+
+out vec4 local;
+out vec3 color;
+
+void main()
+{
+    // Corners of the quad as a triangle strip
+    vec2 corner = vec2((gl_VertexID & 1) == 0 ? -1.0 : 1.0, gl_VertexID < 2 ? -1.0 : 1.0);
+    vec2 a = instance_a;
+    vec2 b = instance_b;
+    float world_thickness = thickness * view_size.y;
+    float line_length = length(b - a);
+    vec2 line_dir = (b - a) / line_length;
+    vec2 delta_left = vec2(-line_dir.y, line_dir.x) * (0.5 * world_thickness);
+    vec2 delta_up = line_dir * (0.5 * world_thickness);
+    float aspect_ratio = line_length / world_thickness;
+
+    // Corner x: left (-1) or right (1) side, corner y: start (-1) or end (1)
+    bool is_end = corner.y > 0.0;
+    vec2 world_position = (is_end ? b : a) - corner.x * delta_left + corner.y * delta_up;
+    gl_Position = vec4((world_position - view_position) / (0.5 * view_size), 0.0, 1.0);
+    local = vec4(0.5 * corner.x,
+                 is_end ? -aspect_ratio - 0.5 : 0.5,
+                 is_end ? 0.5 : -aspect_ratio - 0.5,
+                 0.0);
+    color = instance_color;
+}
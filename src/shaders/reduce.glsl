@@ -0,0 +1,91 @@
+precision highp float;
+
+// The first pass sums the relative error of the pixels of each work group, the
+// final pass sums these partial sums with a single work group.
+#ifndef FINAL_PASS
+
+layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
+
+layout(rgba32f, binding = 0) uniform readonly restrict image2D accumulation_image;
+layout(r32f, binding = 1) uniform readonly restrict image2D moment_image;
+
+// Size of the part of the images that holds the traced pixels
+uniform uvec2 tile_size;
+
+#else
+
+layout(local_size_x = 256, local_size_y = 1, local_size_z = 1) in;
+
+uniform uint num_partial_sums;
+
+#endif
+
+layout(std430, binding = 0) restrict buffer Partial_sums
+{
+    float partial_sums[];
+};
+
+shared float sums[256];
+
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+#ifndef FINAL_PASS
+// Relative standard error of the mean luminance of a pixel, clamped to 1 so
+// that a few dark pixels with rare bright samples cannot dominate the average
+float relative_error(ivec2 pixel)
+{
+    vec4 average_color = imageLoad(accumulation_image, pixel);
+    float n = average_color.a;
+    if (n < 2.0)
+    {
+        return 1.0;
+    }
+    float mean = luminance(average_color.rgb);
+    float second_moment = imageLoad(moment_image, pixel).r;
+    float variance = max(second_moment - mean * mean, 0.0) * n / (n - 1.0);
+    return min(sqrt(variance / n) / max(mean, 1.0e-3), 1.0);
+}
+#endif
+
+void main()
+{
+    float sum = 0.0;
+#ifndef FINAL_PASS
+    if (gl_GlobalInvocationID.x < tile_size.x && gl_GlobalInvocationID.y < tile_size.y)
+    {
+        sum = relative_error(ivec2(gl_GlobalInvocationID.xy));
+    }
+#else
+    for (uint i = gl_LocalInvocationIndex; i < num_partial_sums; i += 256u)
+    {
+        sum += partial_sums[i];
+    }
+#endif
+
+    sums[gl_LocalInvocationIndex] = sum;
+    memoryBarrierShared();
+    barrier();
+
+    for (uint stride = 128u; stride > 0u; stride >>= 1)
+    {
+        if (gl_LocalInvocationIndex < stride)
+        {
+            sums[gl_LocalInvocationIndex] += sums[gl_LocalInvocationIndex + stride];
+        }
+        memoryBarrierShared();
+        barrier();
+    }
+
+    if (gl_LocalInvocationIndex == 0u)
+    {
+#ifndef FINAL_PASS
+        partial_sums[gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x] = sums[0];
+#else
+        partial_sums[0] = sums[0];
+#endif
+    }
+}
@@ -0,0 +1,28 @@
+precision highp float;
+
+// Converts the sums splatted by light tracing into the average stored in the
+// accumulation image, which is then post-processed as for path tracing.
+
+layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
+
+layout(rgba32f, binding = 0) uniform writeonly restrict image2D accumulation_image;
+
+layout(std430, binding = 0) readonly restrict buffer Light_sums { float light_sums[]; };
+
+// Number of samples of every pixel, including the last dispatch
+uniform int sample_index;
+
+
+void main()
+{
+    uvec2 image_size = imageSize(accumulation_image);
+    if (gl_GlobalInvocationID.x >= image_size.x || gl_GlobalInvocationID.y >= image_size.y)
+    {
+        return;
+    }
+
+    uint index = 3u * (gl_GlobalInvocationID.y * image_size.x + gl_GlobalInvocationID.x);
+    vec3 sum = vec3(light_sums[index], light_sums[index + 1u], light_sums[index + 2u]);
+    float num_samples = float(sample_index);
+    imageStore(accumulation_image, ivec2(gl_GlobalInvocationID.xy), vec4(sum / num_samples, num_samples));
+}
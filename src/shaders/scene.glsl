@@ -0,0 +1,90 @@
+// Scene data shared by the tracing shaders. The structs match the C++ ones in
+// scene.hpp, gpu_scene.hpp, bvh.hpp and grid.hpp, and every array is read through a
+// get_* accessor.
+
+precision highp float;
+
+
+struct Material
+{
+    vec3 color;
+    vec3 emissivity;
+    int type;
+};
+
+// A circle, a line or an arc, depending on its GEOMETRY_* type:
+// - circle: center in shape.xy, radius in shape.z
+// - line: a in shape.xy, b in shape.zw
+// - arc: center in shape.xy, radius in shape.z, b in shape.w, a in axis
+struct Primitive
+{
+    vec4 shape;
+    vec2 axis;
+    uint type;
+    uint material_id;
+};
+
+struct Bvh_node
+{
+    vec2 aabb_min;
+    vec2 aabb_max;
+    // Interior node: index of the second child (the first one immediately follows)
+    // Leaf: index of the first primitive, the primitives of a leaf are contiguous
+    uint offset;
+    // Number of primitives of a leaf, 0 for an interior node
+    uint count;
+};
+
+struct Emitter
+{
+    // Index of the primitive
+    uint primitive;
+    // Alias table entry: the primitive is kept with this probability, and
+    // replaced by the alias primitive otherwise
+    float threshold;
+    uint alias;
+};
+
+
+#ifndef NO_STORAGE_BUFFER
+
+layout(std140) readonly restrict buffer Materials { Material materials[]; };
+layout(std140) readonly restrict buffer Primitives { Primitive primitives[]; };
+#ifdef USE_BVH
+layout(std140) readonly restrict buffer Bvh_nodes { Bvh_node bvh_nodes[]; };
+#endif
+#ifdef USE_GRID
+// Cell offsets and primitive indices are packed four per uvec4 to avoid the 16 byte std140 array stride
+layout(std140) readonly restrict buffer Grid_cells { uvec4 grid_cells[]; };
+layout(std140) readonly restrict buffer Grid_primitives { uvec4 grid_primitives[]; };
+#endif
+layout(std140) readonly restrict buffer Emitters { Emitter emitters[]; };
+
+#define PRIMITIVE_COUNT primitives.length()
+#define EMITTER_COUNT emitters.length()
+
+Material get_material(int i) { return materials[i]; }
+Primitive get_primitive(int i) { return primitives[i]; }
+#ifdef USE_BVH
+Bvh_node get_bvh_node(int i) { return bvh_nodes[i]; }
+#endif
+#ifdef USE_GRID
+uvec4 get_grid_cells(int i) { return grid_cells[i]; }
+uvec4 get_grid_primitives(int i) { return grid_primitives[i]; }
+#endif
+Emitter get_emitter(int i) { return emitters[i]; }
+
+#else
+
+// WebGL has no storage buffers. The application appends the uniform blocks,
+// split in chunks if an array does not fit in a single block, along with their
+// accessors. The blocks are usually bigger than the arrays, so that the same
+// program can be reused for similar scenes.
+
+uniform int primitive_count;
+uniform int emitter_count;
+
+#define PRIMITIVE_COUNT primitive_count
+#define EMITTER_COUNT emitter_count
+
+#endif
@@ -1,41 +1,12 @@
-
-precision highp float;
-
-#ifdef COMPUTE_SHADER
+// Persistent threads are not tied to pixels, and the wavefront kernels of
+// wavefront.glsl declare their own work group size
+#if defined(PERSISTENT_THREADS)
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+#elif defined(COMPUTE_SHADER) && !defined(WAVEFRONT)
 layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
 #endif
 
 
-struct Material
-{
-    vec3 color;
-    vec3 emissivity;
-    int type;
-};
-
-struct Circle
-{
-    vec2 center;
-    float radius;
-    uint material_id;
-};
-
-struct Line
-{
-    vec2 a;
-    vec2 b;
-    uint material_id;
-};
-
-struct Arc
-{
-    vec2 center;
-    float radius;
-    vec2 a;
-    float b;
-    uint material_id;
-};
-
 struct Hit
 {
     vec2 position;
@@ -45,24 +16,67 @@ struct Hit
 
 
 #ifdef COMPUTE_SHADER
+// The alpha channel holds the number of samples of each pixel, which is lower
+// than sample_index for pixels that stopped sampling early
 layout(rgba32f, binding = 0) uniform restrict image2D accumulation_image;
+// Average of the squared luminance of the samples of each pixel
+layout(r32f, binding = 1) uniform restrict image2D moment_image;
 #endif
 
-layout(std140) uniform Materials { Material materials[MATERIAL_COUNT]; };
-layout(std140) uniform Circles { Circle circles[CIRCLE_COUNT]; };
-layout(std140) uniform Lines { Line lines[LINE_COUNT]; };
-layout(std140) uniform Arcs { Arc arcs[ARC_COUNT]; };
+#ifdef PERSISTENT_THREADS
+// Index of the next pixel to trace, shared by all invocations
+layout(std430, binding = 0) restrict buffer Work_counter { uint next_pixel; };
+#endif
+
+#ifdef LIGHT_TRACING
+// Sums of the contributions of all light paths to each pixel, as RGB triplets
+// of floats updated with atomicCompSwap since there are no float atomics
+layout(std430, binding = 0) coherent restrict buffer Light_sums { uint light_sums[]; };
+#endif
+
+#ifdef COUNT_RAYS
+// Pairs of counters of the path and shadow rays traced, summed and cleared by
+// the host after every dispatch. Work groups add to the pair of their index
+// modulo the number of pairs, so that no counter overflows within a dispatch.
+layout(std430, binding = 7) restrict buffer Ray_counts { uint ray_counts[]; };
+
+// Rays traced by the invocation, see add_ray_counts()
+uint traced_path_rays = 0u;
+uint traced_shadow_rays = 0u;
+#endif
 
 
 uniform int sample_index;
 uniform int samples_per_frame;
+// Position of the first sample of the render in the sequence of samples of
+// every pixel, so that independent renders can trace disjoint samples
+uniform uint first_sample;
 uniform vec2 view_position;
 uniform vec2 view_size;
+// Luminance of the total power emitted by the scene
+uniform float total_power;
+#ifdef USE_GRID
+// Bottom left corner of the grid, size of its cells, and number of cells along
+// each axis
+uniform vec2 grid_origin;
+uniform vec2 grid_cell_size;
+uniform uvec2 grid_size;
+#endif
 
-#ifndef COMPUTE_SHADER
-uniform uvec2 image_size;
+#ifdef COMPUTE_SHADER
+// Pixels stop sampling once the relative standard error of their luminance is
+// below this threshold, 0 disables adaptive sampling
+uniform float error_threshold;
+// Size of the part of the accumulation image that is traced, which only holds
+// one tile of the image when rendering very large images
+uniform uvec2 tile_size;
+#else
 out vec4 out_color;
 #endif
+// Size of the whole image, and pixel of the image stored at the origin of the
+// accumulation image
+uniform uvec2 image_size;
+uniform uvec2 tile_offset;
 
 
 #define PI 3.1415926535897931
@@ -76,6 +90,15 @@ out vec4 out_color;
 #define GEOMETRY_LINE 2
 #define GEOMETRY_ARC 3
 
+// Below this number of samples, the variance estimate is too unreliable to
+// stop sampling a pixel
+#define MIN_ADAPTIVE_SAMPLES 64.0
+
+#define BVH_MAX_DEPTH 32
+
+// Maximum number of bounces of a path
+#define MAX_DEPTH 32
+
 
 uint hash(uint x)
 {
@@ -87,6 +110,13 @@ uint hash(uint x)
     return x;
 }
 
+// Initial state of the random numbers of the samples of the current dispatch
+// through a pixel
+uint pixel_seed(uint pixel_index)
+{
+    return hash(pixel_index) + hash(first_sample + uint(sample_index));
+}
+
 float random(inout uint rng_state)
 {
     // Returns a value uniformly sampled from [0.0, 1.0]
@@ -184,39 +214,202 @@ bool intersect_arc(vec2 origin, vec2 direction, vec2 center, float radius, vec2
     return false;
 }
 
-bool intersect(vec2 origin, vec2 direction, out float t, out float u, out int geometry_type, out int geometry_index)
+// Fetches the primitive of the given index once, and tests it depending on its
+// type
+void intersect_primitive(int index, vec2 origin, vec2 direction, inout float t, inout float u, inout int primitive_index)
 {
-    t = 1e6;
-    u = 0.0;
-    geometry_type = GEOMETRY_NONE;
-    geometry_index = -1;
+    Primitive primitive = get_primitive(index);
+    bool is_hit = false;
 
-    for (int i = 0; i < CIRCLE_COUNT; ++i)
+    switch (int(primitive.type))
     {
-        if (intersect_circle(origin, direction, circles[i].center, circles[i].radius, t))
-        {
-            geometry_type = GEOMETRY_CIRCLE;
-            geometry_index = i;
-        }
+    case GEOMETRY_CIRCLE:
+        is_hit = intersect_circle(origin, direction, primitive.shape.xy, primitive.shape.z, t);
+        break;
+    case GEOMETRY_LINE:
+        is_hit = intersect_line(origin, direction, primitive.shape.xy, primitive.shape.zw, t, u);
+        break;
+    case GEOMETRY_ARC:
+        is_hit = intersect_arc(origin, direction, primitive.shape.xy, primitive.shape.z, primitive.axis, primitive.shape.w, t);
+        break;
     }
-    for (int i = 0; i < LINE_COUNT; ++i)
+
+    if (is_hit)
     {
-        if (intersect_line(origin, direction, lines[i].a, lines[i].b, t, u))
+        primitive_index = index;
+    }
+}
+
+#ifdef USE_BVH
+bool intersect_aabb(vec2 origin, vec2 inv_direction, vec2 aabb_min, vec2 aabb_max, float t, out float t_entry)
+{
+    vec2 t1 = (aabb_min - origin) * inv_direction;
+    vec2 t2 = (aabb_max - origin) * inv_direction;
+    vec2 t_near = min(t1, t2);
+    vec2 t_far = max(t1, t2);
+    float t_min = max(t_near.x, t_near.y);
+    float t_max = min(t_far.x, t_far.y);
+    t_entry = t_min;
+    return t_max >= max(t_min, 0.0) && t_min < t;
+}
+
+void intersect_bvh(vec2 origin, vec2 direction, inout float t, inout float u, inout int primitive_index)
+{
+    vec2 inv_direction = 1.0 / direction;
+
+    float t_entry;
+    Bvh_node root = get_bvh_node(0);
+    if (!intersect_aabb(origin, inv_direction, root.aabb_min, root.aabb_max, t, t_entry))
+    {
+        return;
+    }
+
+    uint stack[BVH_MAX_DEPTH];
+    int stack_size = 0;
+    uint node_index = 0u;
+
+    while (true)
+    {
+        Bvh_node node = get_bvh_node(int(node_index));
+        if (node.count > 0u)
+        {
+            for (uint i = node.offset; i < node.offset + node.count; ++i)
+            {
+                intersect_primitive(int(i), origin, direction, t, u, primitive_index);
+            }
+        }
+        else
         {
-            geometry_type = GEOMETRY_LINE;
-            geometry_index = i;
+            // Visit the nearest child first, so that the other one can
+            // hopefully be culled with a shorter t once we get back to it
+            uint left = node_index + 1u;
+            uint right = node.offset;
+            Bvh_node left_node = get_bvh_node(int(left));
+            Bvh_node right_node = get_bvh_node(int(right));
+            float t_left;
+            float t_right;
+            bool hit_left = intersect_aabb(origin, inv_direction, left_node.aabb_min, left_node.aabb_max, t, t_left);
+            bool hit_right = intersect_aabb(origin, inv_direction, right_node.aabb_min, right_node.aabb_max, t, t_right);
+            if (hit_left && hit_right)
+            {
+                bool left_first = t_left <= t_right;
+                stack[stack_size++] = left_first ? right : left;
+                node_index = left_first ? left : right;
+                continue;
+            }
+            if (hit_left || hit_right)
+            {
+                node_index = hit_left ? left : right;
+                continue;
+            }
         }
+
+        if (stack_size == 0)
+        {
+            return;
+        }
+        node_index = stack[--stack_size];
+    }
+}
+#endif
+
+#ifdef USE_GRID
+uint grid_cell_offset(int i)
+{
+    return get_grid_cells(i >> 2)[i & 3];
+}
+
+int grid_primitive(int i)
+{
+    return int(get_grid_primitives(i >> 2)[i & 3]);
+}
+
+// Walks the cells pierced by the ray with a 2D DDA, from the point where it
+// enters the grid. Once the closest hit so far lies within the current cell, no
+// later cell can hold a closer one, since every primitive overlapping the
+// current cell is referenced by it. Primitives overlapping several cells may be
+// tested more than once, which cannot change the closest hit.
+void intersect_grid(vec2 origin, vec2 direction, inout float t, inout float u, inout int primitive_index)
+{
+    ivec2 size = ivec2(grid_size);
+    vec2 inv_direction = 1.0 / direction;
+    vec2 grid_max = grid_origin + vec2(size) * grid_cell_size;
+    vec2 t1 = (grid_origin - origin) * inv_direction;
+    vec2 t2 = (grid_max - origin) * inv_direction;
+    vec2 t_near = min(t1, t2);
+    vec2 t_far = max(t1, t2);
+    float t_enter = max(max(t_near.x, t_near.y), 0.0);
+    float t_exit = min(min(t_far.x, t_far.y), t);
+    if (t_enter > t_exit)
+    {
+        return;
     }
-    for (int i = 0; i < ARC_COUNT; ++i)
+
+    vec2 entry = (origin + direction * t_enter - grid_origin) / grid_cell_size;
+    ivec2 cell = clamp(ivec2(floor(entry)), ivec2(0), size - 1);
+    ivec2 cell_step = ivec2(sign(direction));
+    // Distance along the ray between two cell boundaries, and to the next
+    // boundary, on each axis
+    vec2 next_boundary = grid_origin + (vec2(cell) + step(0.0, direction)) * grid_cell_size;
+    vec2 t_delta = abs(grid_cell_size * inv_direction);
+    vec2 t_next = (next_boundary - origin) * inv_direction;
+    bvec2 is_parallel = equal(direction, vec2(0.0));
+    t_delta = mix(t_delta, vec2(1e30), is_parallel);
+    t_next = mix(t_next, vec2(1e30), is_parallel);
+
+    // A ray crosses at most this many cells, which also bounds the loop for
+    // degenerate directions
+    for (int remaining = size.x + size.y; remaining > 0; --remaining)
     {
-        if (intersect_arc(origin, direction, arcs[i].center, arcs[i].radius, arcs[i].a, arcs[i].b, t))
+        int cell_index = cell.y * size.x + cell.x;
+        int end = int(grid_cell_offset(cell_index + 1));
+        for (int i = int(grid_cell_offset(cell_index)); i < end; ++i)
+        {
+            intersect_primitive(grid_primitive(i), origin, direction, t, u, primitive_index);
+        }
+
+        if (t <= min(t_next.x, t_next.y))
+        {
+            return;
+        }
+        if (t_next.x < t_next.y)
+        {
+            cell.x += cell_step.x;
+            t_next.x += t_delta.x;
+        }
+        else
+        {
+            cell.y += cell_step.y;
+            t_next.y += t_delta.y;
+        }
+        if (any(lessThan(cell, ivec2(0))) || any(greaterThanEqual(cell, size)))
         {
-            geometry_type = GEOMETRY_ARC;
-            geometry_index = i;
+            return;
         }
     }
+}
+#endif
 
-    return geometry_type != GEOMETRY_NONE;
+// Finds the closest primitive hit by the ray, and returns its index in
+// primitive_index, or -1 if there is none
+bool intersect(vec2 origin, vec2 direction, out float t, out float u, out int primitive_index)
+{
+    t = 1e6;
+    u = 0.0;
+    primitive_index = -1;
+
+#if defined(USE_BVH)
+    intersect_bvh(origin, direction, t, u, primitive_index);
+#elif defined(USE_GRID)
+    intersect_grid(origin, direction, t, u, primitive_index);
+#else
+    for (int i = 0; i < PRIMITIVE_COUNT; ++i)
+    {
+        intersect_primitive(i, origin, direction, t, u, primitive_index);
+    }
+#endif
+
+    return primitive_index >= 0;
 }
 
 // This uses the technique by Carsten Wächter and
@@ -240,45 +433,31 @@ vec2 offset_position_along_normal(vec2 position, vec2 normal)
         abs(position.y) < origin ? position.y + float_scale * normal.y : p_i.y);
 }
 
-Hit get_hit(vec2 origin, vec2 direction, float t, float u, int geometry_type, int geometry_index)
+Hit get_hit(vec2 origin, vec2 direction, float t, float u, int primitive_index)
 {
+    Primitive primitive = get_primitive(primitive_index);
     Hit hit;
+    hit.material_id = primitive.material_id;
 
-    switch(geometry_type)
+    if (int(primitive.type) == GEOMETRY_LINE)
     {
-    case GEOMETRY_CIRCLE:
-    {
-        Circle circle = circles[geometry_index];
-        hit.position = origin + t * direction;
-        // A negative radius means the object normal (defining the
-        // "outside" of solid objects) points towards the center
-        hit.normal = sign(circle.radius) * normalize(hit.position - circle.center);
-        // Re-project the hit position onto the circle
-        hit.position = circle.center + hit.normal * circle.radius;
-        hit.material_id = circle.material_id;
-        break;
-    }
-    case GEOMETRY_LINE:
-    {
-        Line line = lines[geometry_index];
-        hit.position = line.a + u * (line.b - line.a);
-        vec2 line_dir = normalize(line.b - line.a);
+        vec2 a = primitive.shape.xy;
+        vec2 b = primitive.shape.zw;
+        hit.position = a + u * (b - a);
+        vec2 line_dir = normalize(b - a);
         hit.normal = vec2(line_dir.y, -line_dir.x);
-        hit.material_id = line.material_id;
-        break;
     }
-    case GEOMETRY_ARC:
+    else
     {
-        Arc arc = arcs[geometry_index];
+        // Circles and arcs
+        vec2 center = primitive.shape.xy;
+        float radius = primitive.shape.z;
         hit.position = origin + t * direction;
         // A negative radius means the object normal (defining the
         // "outside" of solid objects) points towards the center
-        hit.normal = sign(arc.radius) * normalize(hit.position - arc.center);
-        // Re-project the hit position onto the arc
-        hit.position = arc.center + hit.normal * arc.radius;
-        hit.material_id = arc.material_id;
-        break;
-    }
+        hit.normal = sign(radius) * normalize(hit.position - center);
+        // Re-project the hit position onto the circle
+        hit.position = center + hit.normal * radius;
     }
 
     return hit;
@@ -298,148 +477,553 @@ vec2 reflect_diffuse(vec2 normal, inout uint rng_state)
 #endif
 }
 
+// Applies Russian roulette, then samples the direction of the next segment of
+// a path after a hit and updates its throughput. Camera and light paths
+// scatter in the same way. Returns false if the path is terminated.
+bool scatter(Hit hit, Material material, bool can_continue, inout vec2 origin, inout vec2 direction, inout vec3 throughput, inout uint rng_state)
+{
+    vec3 color = material.color;
+    float max_color = max(color.r, max(color.g, color.b));
+    // Russian Roulette ray termination
+    if (random(rng_state) < max_color && can_continue)
+    {
+        color /= max_color;
+    }
+    else
+    {
+        return false;
+    }
+
+    throughput *= color;
+
+    // hit.normal: object normal, defining "inside" and "outside" for relevant
+    //             primitives (circles and dielectric primitives)
+    // normal:     front-facing normal as seen by the incoming ray
+    bool into = dot(direction, hit.normal) < 0.0;
+    vec2 normal = into ? hit.normal : -hit.normal;
+    
+    switch (material.type)
+    {
+    case DIFFUSE:
+    {
+        origin = offset_position_along_normal(hit.position, normal);
+        direction = reflect_diffuse(normal, rng_state);
+        break;
+    }
+    case SPECULAR:
+    {
+        origin = offset_position_along_normal(hit.position, normal);
+        direction = reflect(direction, normal);
+        break;
+    }
+    case DIELECTRIC:
+    {
+        vec2 reflected_dir = reflect(direction, hit.normal);
+
+        const float n_air = 1.0;
+        const float n_glass = 1.5;
+        float n_ratio = into ? n_air / n_glass : n_glass / n_air;
+        float dir_dot_normal = dot(direction, normal);
+        float cos2t = 1.0 - n_ratio * n_ratio * (1.0 - dir_dot_normal * dir_dot_normal);
+        // Total internal reflection
+        if (cos2t < 0.0)
+        {
+            origin = offset_position_along_normal(hit.position, normal);
+            direction = reflected_dir;
+            return true;
+        }
+
+        vec2 transmitted_dir = normalize(direction * n_ratio - hit.normal *
+            ((into ? 1.0 : -1.0) * (dir_dot_normal * n_ratio + sqrt(cos2t))));
+
+        float a = n_glass - n_air;
+        float b = n_glass + n_air;
+        float R0 = a * a / (b * b);
+        float c = 1.0 - (into ? -dir_dot_normal : dot(transmitted_dir, hit.normal));
+        float Re = R0 + (1.0 - R0) * c * c * c * c * c;
+        float Tr = 1.0 - Re;
+        float P = 0.25 + 0.5 * Re;
+        float RP = Re / P;
+        float TP = Tr / (1.0 - P);
+        if (random(rng_state) < P)
+        {
+            throughput *= RP;
+            // FIXME: I feel like we should be using hit.normal here.
+            // We should really double check the entire refraction code.
+            origin = offset_position_along_normal(hit.position, normal);
+            direction = reflected_dir;
+        }
+        else
+        {
+            throughput *= TP;
+            origin = offset_position_along_normal(hit.position, -normal);
+            direction = transmitted_dir;
+        }
+        break;
+    }
+    }
+
+    return true;
+}
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Samples a point uniformly on an emitter chosen in proportion to its power,
+// with the alias method
+void sample_emitter(inout uint rng_state, out vec2 position, out vec2 normal, out uint material_id, out int primitive_index)
+{
+    float x = random(rng_state) * float(EMITTER_COUNT);
+    int i = min(int(x), EMITTER_COUNT - 1);
+    Emitter emitter = get_emitter(i);
+    primitive_index = int(x - float(i) < emitter.threshold ? emitter.primitive : emitter.alias);
+    Primitive primitive = get_primitive(primitive_index);
+    material_id = primitive.material_id;
+
+    float v = random(rng_state);
+    switch (int(primitive.type))
+    {
+    case GEOMETRY_CIRCLE:
+    {
+        float angle = 2.0 * PI * v;
+        normal = vec2(cos(angle), sin(angle));
+        position = primitive.shape.xy + normal * abs(primitive.shape.z);
+        break;
+    }
+    case GEOMETRY_LINE:
+    {
+        vec2 a = primitive.shape.xy;
+        vec2 b = primitive.shape.zw;
+        position = mix(a, b, v);
+        vec2 line_dir = normalize(b - a);
+        normal = vec2(line_dir.y, -line_dir.x);
+        break;
+    }
+    case GEOMETRY_ARC:
+    {
+        float radius = abs(primitive.shape.z);
+        float half_angle = acos(clamp(primitive.shape.w / radius, -1.0, 1.0));
+        float angle = atan(primitive.axis.y, primitive.axis.x) + (2.0 * v - 1.0) * half_angle;
+        normal = vec2(cos(angle), sin(angle));
+        position = primitive.shape.xy + normal * radius;
+        break;
+    }
+    }
+}
+
+// Density per unit length of the points sampled by sample_emitter() on an
+// emitter with the given emissivity
+float emitter_density(vec3 emissivity)
+{
+    return total_power > 0.0 ? 4.0 * luminance(emissivity) / total_power : 0.0;
+}
+
+// Power heuristic for multiple importance sampling
+float mis_weight(float pdf, float other_pdf)
+{
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// Next event estimation: samples a point on an emitter and returns the
+// radiance it sends to position, multiplied by the BSDF and cosine over the
+// sampling density and weighted against BSDF sampling. The vertex is either a
+// diffuse surface with the given front-facing normal, or the camera vertex,
+// which averages the radiance over all directions.
+vec3 sample_direct_light(vec2 position, vec2 normal, bool on_surface, inout uint rng_state)
+{
+    if (EMITTER_COUNT == 0)
+    {
+        return vec3(0.0);
+    }
+
+    vec2 light_position;
+    vec2 light_normal;
+    uint material_id;
+    int light_index;
+    sample_emitter(rng_state, light_position, light_normal, material_id, light_index);
+
+    vec2 to_light = light_position - position;
+    float light_distance = length(to_light);
+    vec2 direction = to_light / light_distance;
+    float cos_light = abs(dot(direction, light_normal));
+    // For a diffuse BSDF, the BSDF times the cosine is the cosine-weighted
+    // density of reflect_diffuse()
+    float bsdf_pdf = on_surface ? 0.5 * dot(direction, normal) : 0.5 / PI;
+    if (bsdf_pdf <= 0.0 || cos_light <= 0.0)
+    {
+        return vec3(0.0);
+    }
+
+    // The sampled point must be the first one hit in its direction
+    float t;
+    float u;
+    int primitive_index;
+#ifdef COUNT_RAYS
+    ++traced_shadow_rays;
+#endif
+    bool is_hit = intersect(position, direction, t, u, primitive_index);
+    if (!is_hit || primitive_index != light_index || t < 0.999 * light_distance)
+    {
+        return vec3(0.0);
+    }
+
+    vec3 emissivity = get_material(int(material_id)).emissivity;
+    // Density per unit angle
+    float light_pdf = emitter_density(emissivity) * light_distance / cos_light;
+    return emissivity * (mis_weight(light_pdf, bsdf_pdf) * bsdf_pdf / light_pdf);
+}
+
+// Emission of the material hit by a ray, weighted against next event estimation
+// unless it could not have sampled the emitter (direction_pdf is 0)
+vec3 hit_emission(Material material, Hit hit, vec2 direction, float t, float direction_pdf)
+{
+    vec3 emissivity = material.emissivity;
+    if (direction_pdf > 0.0 && luminance(emissivity) > 0.0)
+    {
+        float light_pdf = emitter_density(emissivity) * t / abs(dot(direction, hit.normal));
+        emissivity *= mis_weight(direction_pdf, light_pdf);
+    }
+    return emissivity;
+}
+
 vec3 radiance(vec2 origin, vec2 direction, inout uint rng_state)
 {
-    vec3 accumulated_color = vec3(0.0);
+    vec3 accumulated_color = sample_direct_light(origin, vec2(0.0), false, rng_state);
     vec3 accumulated_reflectance = vec3(1.0);
+    // Density of the direction of the current ray, or 0 if next event
+    // estimation could not have sampled the emitter it hits
+    float direction_pdf = 0.5 / PI;
 
-    const int max_depth = 32;
-    for (int depth = 0; depth <= max_depth; ++depth)
+    for (int depth = 0; depth <= MAX_DEPTH; ++depth)
     {
         float t;
         float u;
-        int geometry_type;
-        int geometry_index;
-        bool is_hit = intersect(origin, direction, t, u, geometry_type, geometry_index);
+        int primitive_index;
+#ifdef COUNT_RAYS
+        ++traced_path_rays;
+#endif
+        bool is_hit = intersect(origin, direction, t, u, primitive_index);
 
         if (!is_hit)
         {
             return accumulated_color;
         }
 
-        Hit hit = get_hit(origin, direction, t, u, geometry_type, geometry_index);
-        Material material = materials[hit.material_id];
-        
-        accumulated_color += accumulated_reflectance * material.emissivity;
+        Hit hit = get_hit(origin, direction, t, u, primitive_index);
+        Material material = get_material(int(hit.material_id));
+
+        accumulated_color += accumulated_reflectance * hit_emission(material, hit, direction, t, direction_pdf);
 
-        vec3 color = material.color;
-        float max_color = max(color.r, max(color.g, color.b));
-        // Russian Roulette ray termination
-        if (random(rng_state) < max_color && depth < max_depth)
+        vec2 normal = dot(direction, hit.normal) < 0.0 ? hit.normal : -hit.normal;
+        if (!scatter(hit, material, depth < MAX_DEPTH, origin, direction, accumulated_reflectance, rng_state))
         {
-            color /= max_color;
+            return accumulated_color;
+        }
+
+        if (material.type == DIFFUSE)
+        {
+            accumulated_color += accumulated_reflectance * sample_direct_light(origin, normal, true, rng_state);
+            direction_pdf = 0.5 * dot(direction, normal);
         }
         else
         {
-            return accumulated_color;
+            direction_pdf = 0.0;
         }
+    }
+
+    // NOTE: this is unreachable. If we reach the last iteration,
+    // we will return before computing a new ray.
+    return accumulated_color;
+}
+
+#ifdef COMPUTE_SHADER
+bool has_converged(vec4 average_color, float second_moment)
+{
+    float n = average_color.a;
+    if (error_threshold <= 0.0 || n < MIN_ADAPTIVE_SAMPLES)
+    {
+        return false;
+    }
+    float mean = luminance(average_color.rgb);
+    float variance = max(second_moment - mean * mean, 0.0) * n / (n - 1.0);
+    float standard_error = sqrt(variance / n);
+    return standard_error < error_threshold * max(mean, 1.0e-3);
+}
+
+// Reads the running averages of a pixel, and returns false if the pixel has
+// converged and should not be sampled anymore
+bool read_pixel(ivec2 pixel, out vec4 average_color, out float second_moment)
+{
+    // The previous content of the images is meaningless for the first samples
+    average_color = vec4(0.0);
+    second_moment = 0.0;
+    if (sample_index > 0)
+    {
+        average_color = imageLoad(accumulation_image, pixel);
+        second_moment = imageLoad(moment_image, pixel).r;
+        return !has_converged(average_color, second_moment);
+    }
+    return true;
+}
+
+// Adds new samples, given by the sums of their colors and of their squared
+// luminances, to the running averages of a pixel
+void write_pixel(ivec2 pixel, vec4 average_color, float second_moment, vec3 color_sum, float moment_sum, int num_new_samples)
+{
+    float previous_samples = average_color.a;
+    float num_samples = previous_samples + float(num_new_samples);
+    average_color.rgb = (average_color.rgb * previous_samples + color_sum) / num_samples;
+    average_color.a = num_samples;
+    second_moment = (second_moment * previous_samples + moment_sum) / num_samples;
+    imageStore(accumulation_image, pixel, average_color);
+    imageStore(moment_image, pixel, vec4(second_moment));
+}
+#endif
 
-        accumulated_reflectance *= color;
+// Samples a ray starting at a random point of the pixel, in a uniformly
+// distributed direction
+void camera_ray(uvec2 pixel, uvec2 image_size, inout uint rng_state, out vec2 origin, out vec2 direction)
+{
+    vec2 uv = (vec2(pixel) + vec2(random(rng_state), random(rng_state))) / vec2(image_size);
+    origin = view_position + (uv - 0.5) * view_size;
+    float angle = 2.0 * PI * random(rng_state);
+    direction = vec2(cos(angle), sin(angle));
+}
 
-        // hit.normal: object normal, defining "inside" and "outside" for relevant
-        //             primitives (circles and dielectric primitives)
-        // normal:     front-facing normal as seen by the incoming ray
-        bool into = dot(direction, hit.normal) < 0.0;
-        vec2 normal = into ? hit.normal : -hit.normal;
-        
-        switch (material.type)
+#ifdef LIGHT_TRACING
+void atomic_add(uint index, float value)
+{
+    uint expected = light_sums[index];
+    while (true)
+    {
+        uint previous = atomicCompSwap(light_sums[index], expected, floatBitsToUint(uintBitsToFloat(expected) + value));
+        if (previous == expected)
         {
-        case DIFFUSE:
+            return;
+        }
+        expected = previous;
+    }
+}
+
+// Adds the contribution of a segment of a light path to every pixel it
+// crosses, in proportion to the length of the segment inside the pixel. This
+// track length estimator gives the fluence, which camera paths estimate by
+// averaging the radiance over all directions, hence the division by 2 * PI.
+void splat_segment(uvec2 image_size, vec2 origin, vec2 direction, float t, vec3 power)
+{
+    // Pixel coordinates along the segment are start + t * pixel_direction
+    vec2 pixels_per_unit = vec2(image_size) / view_size;
+    vec2 start = ((origin - view_position) / view_size + 0.5) * vec2(image_size);
+    vec2 pixel_direction = direction * pixels_per_unit;
+    vec2 inv_direction = 1.0 / pixel_direction;
+
+    // Clip the segment to the image
+    vec2 t1 = -start * inv_direction;
+    vec2 t2 = (vec2(image_size) - start) * inv_direction;
+    float t_begin = max(max(min(t1.x, t2.x), min(t1.y, t2.y)), 0.0);
+    float t_end = min(min(max(t1.x, t2.x), max(t1.y, t2.y)), t);
+    if (!(t_begin < t_end))
+    {
+        return;
+    }
+
+    vec3 weight = power / (2.0 * PI * view_size.x * view_size.y);
+
+    // Grid traversal from "A Fast Voxel Traversal Algorithm for Ray Tracing"
+    // by John Amanatides and Andrew Woo
+    ivec2 pixel = clamp(ivec2(floor(start + t_begin * pixel_direction)), ivec2(0), ivec2(image_size) - 1);
+    ivec2 pixel_step = ivec2(sign(pixel_direction));
+    vec2 t_delta = abs(inv_direction);
+    vec2 t_next = (vec2(pixel) + step(0.0, pixel_direction) - start) * inv_direction;
+    float t_current = t_begin;
+    uint max_steps = image_size.x + image_size.y + 1u;
+    for (uint i = 0u; i < max_steps && t_current < t_end; ++i)
+    {
+        float t_exit = min(min(t_next.x, t_next.y), t_end);
+        if (t_exit > t_current)
         {
-            origin = offset_position_along_normal(hit.position, normal);
-            direction = reflect_diffuse(normal, rng_state);
-            break;
+            uint index = 3u * (uint(pixel.y) * image_size.x + uint(pixel.x));
+            vec3 contribution = weight * (t_exit - t_current);
+            atomic_add(index, contribution.r);
+            atomic_add(index + 1u, contribution.g);
+            atomic_add(index + 2u, contribution.b);
+            t_current = t_exit;
         }
-        case SPECULAR:
+
+        if (t_next.x < t_next.y)
         {
-            origin = offset_position_along_normal(hit.position, normal);
-            direction = reflect(direction, normal);
-            break;
+            pixel.x += pixel_step.x;
+            t_next.x += t_delta.x;
         }
-        case DIELECTRIC:
+        else
         {
-            vec2 reflected_dir = reflect(direction, hit.normal);
-
-            const float n_air = 1.0;
-            const float n_glass = 1.5;
-            float n_ratio = into ? n_air / n_glass : n_glass / n_air;
-            float dir_dot_normal = dot(direction, normal);
-            float cos2t = 1.0 - n_ratio * n_ratio * (1.0 - dir_dot_normal * dir_dot_normal);
-            // Total internal reflection
-            if (cos2t < 0.0)
-            {
-                origin = offset_position_along_normal(hit.position, normal);
-                direction = reflected_dir;
-                continue;
-            }
+            pixel.y += pixel_step.y;
+            t_next.y += t_delta.y;
+        }
+        if (any(lessThan(pixel, ivec2(0))) || any(greaterThanEqual(pixel, ivec2(image_size))))
+        {
+            return;
+        }
+    }
+}
 
-            vec2 transmitted_dir = normalize(direction * n_ratio - hit.normal *
-                ((into ? 1.0 : -1.0) * (dir_dot_normal * n_ratio + sqrt(cos2t))));
-
-            float a = n_glass - n_air;
-            float b = n_glass + n_air;
-            float R0 = a * a / (b * b);
-            float c = 1.0 - (into ? -dir_dot_normal : dot(transmitted_dir, hit.normal));
-            float Re = R0 + (1.0 - R0) * c * c * c * c * c;
-            float Tr = 1.0 - Re;
-            float P = 0.25 + 0.5 * Re;
-            float RP = Re / P;
-            float TP = Tr / (1.0 - P);
-            if (random(rng_state) < P)
-            {
-                accumulated_reflectance *= RP;
-                // FIXME: I feel like we should be using hit.normal here.
-                // We should really double check the entire refraction code.
-                origin = offset_position_along_normal(hit.position, normal);
-                direction = reflected_dir;
-            }
-            else
-            {
-                accumulated_reflectance *= TP;
-                origin = offset_position_along_normal(hit.position, -normal);
-                direction = transmitted_dir;
-            }
-            break;
+// Samples an emitted ray from a point on an emitter, on either side of it with
+// a cosine distribution
+void sample_emission(inout uint rng_state, out vec2 origin, out vec2 direction, out vec3 power)
+{
+    vec2 position;
+    vec2 normal;
+    uint material_id;
+    int primitive_index;
+    sample_emitter(rng_state, position, normal, material_id, primitive_index);
+
+    if (random(rng_state) < 0.5)
+    {
+        normal = -normal;
+    }
+    origin = offset_position_along_normal(position, normal);
+    direction = reflect_diffuse(normal, rng_state);
+
+    // With emitters sampled in proportion to their power, all paths start with
+    // the same luminance
+    vec3 emissivity = get_material(int(material_id)).emissivity;
+    power = emissivity * (total_power / luminance(emissivity));
+}
+
+void trace_light_path(uvec2 image_size, inout uint rng_state)
+{
+    vec2 origin;
+    vec2 direction;
+    vec3 power;
+    sample_emission(rng_state, origin, direction, power);
+
+    for (int depth = 0; depth <= MAX_DEPTH; ++depth)
+    {
+        float t;
+        float u;
+        int primitive_index;
+#ifdef COUNT_RAYS
+        ++traced_path_rays;
+#endif
+        bool is_hit = intersect(origin, direction, t, u, primitive_index);
+
+        splat_segment(image_size, origin, direction, t, power);
+
+        if (!is_hit)
+        {
+            return;
         }
+
+        Hit hit = get_hit(origin, direction, t, u, primitive_index);
+        Material material = get_material(int(hit.material_id));
+        if (!scatter(hit, material, depth < MAX_DEPTH, origin, direction, power, rng_state))
+        {
+            return;
         }
     }
+}
+#endif
 
-    // NOTE: this is unreachable. If we reach the last iteration,
-    // we will return before computing a new ray.
-    return accumulated_color;
+#ifdef COUNT_RAYS
+// Adds the rays traced by the invocation to the counters of its work group
+void add_ray_counts()
+{
+    uint group = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+    uint pair = group % (uint(ray_counts.length()) / 2u);
+    if (traced_path_rays > 0u)
+    {
+        atomicAdd(ray_counts[2u * pair], traced_path_rays);
+    }
+    if (traced_shadow_rays > 0u)
+    {
+        atomicAdd(ray_counts[2u * pair + 1u], traced_shadow_rays);
+    }
 }
+#endif
 
-void main()
+#ifndef WAVEFRONT
+// Traces samples_per_frame camera paths through a pixel of the accumulation
+// image. The samples of a pixel of the image do not depend on the tiles.
+void trace_pixel(uvec2 pixel)
 {
+    uvec2 image_pixel = tile_offset + pixel;
+    uint pixel_index = image_pixel.y * image_size.x + image_pixel.x;
+    uint rng_state = pixel_seed(pixel_index);
+
 #ifdef COMPUTE_SHADER
-    uvec2 image_size = imageSize(accumulation_image);
-    if (gl_GlobalInvocationID.x >= image_size.x || gl_GlobalInvocationID.y >= image_size.y)
+    vec4 average_color;
+    float second_moment;
+    if (!read_pixel(ivec2(pixel), average_color, second_moment))
     {
         return;
     }
-    uvec2 pixel = gl_GlobalInvocationID.xy;
-#else
-    uvec2 pixel = uvec2(gl_FragCoord.xy);
 #endif
 
-    uint pixel_index = pixel.y * image_size.x + pixel.x;
-    uint rng_state = hash(pixel_index) + hash(uint(sample_index));
-
     vec4 accumulated_color = vec4(0.0);
+#ifdef COMPUTE_SHADER
+    float accumulated_moment = 0.0;
+#endif
     for (int i = 0; i < samples_per_frame; ++i)
     {
-        vec2 uv = (vec2(pixel) + vec2(random(rng_state), random(rng_state))) / vec2(image_size);
-        vec2 ray_origin = view_position + (uv - 0.5) * view_size;
-        float angle = 2.0 * PI * random(rng_state);
-        vec2 ray_direction = vec2(cos(angle), sin(angle));
-        accumulated_color += vec4(radiance(ray_origin, ray_direction, rng_state), 1.0);
+        vec2 ray_origin;
+        vec2 ray_direction;
+        camera_ray(image_pixel, image_size, rng_state, ray_origin, ray_direction);
+        vec3 sample_color = radiance(ray_origin, ray_direction, rng_state);
+        accumulated_color += vec4(sample_color, 1.0);
+#ifdef COMPUTE_SHADER
+        float sample_luminance = luminance(sample_color);
+        accumulated_moment += sample_luminance * sample_luminance;
+#endif
     }
     
 #ifdef COMPUTE_SHADER
-    vec4 average_color = imageLoad(accumulation_image, ivec2(gl_GlobalInvocationID.xy));
-    average_color = (average_color * sample_index + accumulated_color) / (sample_index + samples_per_frame);
-    imageStore(accumulation_image, ivec2(gl_GlobalInvocationID.xy), average_color);
+    write_pixel(ivec2(pixel), average_color, second_moment, accumulated_color.rgb, accumulated_moment, samples_per_frame);
 #else
     out_color = accumulated_color / float(samples_per_frame);
 #endif
 }
+
+void main()
+{
+#ifdef PERSISTENT_THREADS
+    // Invocations keep pulling the next pixel until all of them are traced, so
+    // that none of them idles while the others finish long paths
+    uint num_pixels = tile_size.x * tile_size.y;
+    for (uint i = atomicAdd(next_pixel, 1u); i < num_pixels; i = atomicAdd(next_pixel, 1u))
+    {
+        trace_pixel(uvec2(i % tile_size.x, i / tile_size.x));
+    }
+#else
+#ifdef COMPUTE_SHADER
+    if (gl_GlobalInvocationID.x >= tile_size.x || gl_GlobalInvocationID.y >= tile_size.y)
+    {
+        return;
+    }
+    uvec2 pixel = gl_GlobalInvocationID.xy;
+#else
+    uvec2 pixel = uvec2(gl_FragCoord.xy);
+#endif
+
+#ifdef LIGHT_TRACING
+    // Light paths are not tied to the pixel of their invocation, which only
+    // seeds their random numbers
+    uint rng_state = pixel_seed(pixel.y * image_size.x + pixel.x);
+    if (EMITTER_COUNT > 0)
+    {
+        for (int i = 0; i < samples_per_frame; ++i)
+        {
+            trace_light_path(image_size, rng_state);
+        }
+    }
+#else
+    trace_pixel(pixel);
+#endif
+#endif
+
+#ifdef COUNT_RAYS
+    add_ray_counts();
+#endif
+}
+#endif
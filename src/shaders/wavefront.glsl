@@ -0,0 +1,290 @@
+// Wavefront path tracer. Instead of tracing whole paths in a single invocation
+// as the main() of trace.glsl does, camera paths advance one bounce at a time
+// through a sequence of kernels that communicate through queues of path
+// indices. Each kernel is compiled from this file, appended to scene.glsl and
+// trace.glsl, with one of the following stages defined:
+// - WAVEFRONT_GENERATE starts one path per pixel that has not converged.
+// - WAVEFRONT_INTERSECT finds the next hit of every path and sorts the paths
+//   into one queue per material type.
+// - WAVEFRONT_SHADE scatters the paths of the queue of SHADE_MATERIAL, so that
+//   all invocations of a work group run the same branch of scatter().
+// - WAVEFRONT_ACCUMULATE adds the samples of the frame to the images.
+// - WAVEFRONT_PREPARE turns the queue sizes into indirect dispatch arguments.
+// Terminated paths are not appended to the next queue, which keeps the queues
+// compact.
+
+#if defined(WAVEFRONT_GENERATE) || defined(WAVEFRONT_ACCUMULATE)
+layout(local_size_x = 16, local_size_y = 16, local_size_z = 1) in;
+#else
+layout(local_size_x = 64, local_size_y = 1, local_size_z = 1) in;
+#endif
+
+
+struct Path
+{
+    vec2 origin;
+    vec2 direction;
+    vec3 throughput;
+    // Density of direction, 0 if next event estimation could not have sampled
+    // the emitter it hits
+    float direction_pdf;
+    // Radiance of the current sample
+    vec3 color;
+    uint rng_state;
+    // Sums of the colors of the samples of the frame and of their squared
+    // luminances
+    vec3 color_sum;
+    float moment_sum;
+    // Last hit found by the intersect stage
+    float t;
+    float u;
+    uint primitive;
+    int depth;
+};
+
+struct Queue
+{
+    // Arguments of glDispatchComputeIndirect for the stage consuming the queue
+    uint num_groups_x;
+    uint num_groups_y;
+    uint num_groups_z;
+    uint count;
+};
+
+
+// The two ray queues alternate between bounces, the queue of the paths that hit
+// a material of type t is MATERIAL_QUEUE + t
+#define RAY_QUEUE 0u
+#define MATERIAL_QUEUE 2u
+#define NUM_QUEUES 5u
+#define NO_QUEUE 0xFFFFFFFFu
+
+#define QUEUE_GROUP_SIZE 64u
+
+
+// Binding 0 is shared with the reduction and light tracing, the scene buffers
+// use the following ones
+layout(std430, binding = 0) restrict buffer Queues
+{
+    Queue queues[NUM_QUEUES];
+    // Each queue can hold one path per pixel
+    uint queue_items[];
+};
+// One path per pixel
+layout(std430, binding = 8) restrict buffer Paths { Path paths[]; };
+
+
+// Index of the sample of the frame traced by the current paths
+uniform int wave_index;
+// Ray queue consumed by the intersect stage, the shade stages append to the
+// other one
+uniform uint ray_queue;
+// Queues whose paths have all been consumed, emptied by the prepare stage
+uniform uint consumed_queues;
+
+
+shared uint group_counts[NUM_QUEUES];
+shared uint group_offsets[NUM_QUEUES];
+
+// Appends a path to a queue, or nothing for NO_QUEUE. This must be called by
+// all invocations of the work group, which reserve their slots with a single
+// global atomic per queue.
+void push(uint queue, uint path_index)
+{
+    if (gl_LocalInvocationIndex < NUM_QUEUES)
+    {
+        group_counts[gl_LocalInvocationIndex] = 0u;
+    }
+    memoryBarrierShared();
+    barrier();
+
+    uint local_index = 0u;
+    if (queue != NO_QUEUE)
+    {
+        local_index = atomicAdd(group_counts[queue], 1u);
+    }
+    memoryBarrierShared();
+    barrier();
+
+    if (gl_LocalInvocationIndex < NUM_QUEUES && group_counts[gl_LocalInvocationIndex] > 0u)
+    {
+        group_offsets[gl_LocalInvocationIndex] = atomicAdd(queues[gl_LocalInvocationIndex].count, group_counts[gl_LocalInvocationIndex]);
+    }
+    memoryBarrierShared();
+    barrier();
+
+    if (queue != NO_QUEUE)
+    {
+        queue_items[queue * uint(paths.length()) + group_offsets[queue] + local_index] = path_index;
+    }
+}
+
+// Adds the current sample of a terminated path to the sums of the frame
+void finish_path(inout Path path)
+{
+    float sample_luminance = luminance(path.color);
+    path.color_sum += path.color;
+    path.moment_sum += sample_luminance * sample_luminance;
+}
+
+
+#if defined(WAVEFRONT_GENERATE)
+void main()
+{
+    uvec2 pixel = gl_GlobalInvocationID.xy;
+    uvec2 image_pixel = tile_offset + pixel;
+    uint path_index = pixel.y * tile_size.x + pixel.x;
+
+    uint queue = NO_QUEUE;
+    vec4 average_color;
+    float second_moment;
+    if (pixel.x < tile_size.x && pixel.y < tile_size.y && read_pixel(ivec2(pixel), average_color, second_moment))
+    {
+        // The random numbers of a pixel follow the same sequence as in
+        // trace_pixel() of trace.glsl
+        Path path;
+        if (wave_index == 0)
+        {
+            path.rng_state = pixel_seed(image_pixel.y * image_size.x + image_pixel.x);
+            path.color_sum = vec3(0.0);
+            path.moment_sum = 0.0;
+        }
+        else
+        {
+            path = paths[path_index];
+        }
+
+        camera_ray(image_pixel, image_size, path.rng_state, path.origin, path.direction);
+        path.color = sample_direct_light(path.origin, vec2(0.0), false, path.rng_state);
+        path.throughput = vec3(1.0);
+        path.direction_pdf = 0.5 / PI;
+        path.depth = 0;
+        paths[path_index] = path;
+        queue = RAY_QUEUE;
+    }
+
+    push(queue, path_index);
+#ifdef COUNT_RAYS
+    add_ray_counts();
+#endif
+}
+
+#elif defined(WAVEFRONT_INTERSECT)
+void main()
+{
+    uint queue = NO_QUEUE;
+    uint path_index = 0u;
+    if (gl_GlobalInvocationID.x < queues[ray_queue].count)
+    {
+        path_index = queue_items[ray_queue * uint(paths.length()) + gl_GlobalInvocationID.x];
+        Path path = paths[path_index];
+
+        float t;
+        float u;
+        int primitive_index;
+#ifdef COUNT_RAYS
+        ++traced_path_rays;
+#endif
+        if (intersect(path.origin, path.direction, t, u, primitive_index))
+        {
+            Hit hit = get_hit(path.origin, path.direction, t, u, primitive_index);
+            paths[path_index].t = t;
+            paths[path_index].u = u;
+            paths[path_index].primitive = uint(primitive_index);
+            queue = MATERIAL_QUEUE + uint(get_material(int(hit.material_id)).type);
+        }
+        else
+        {
+            finish_path(path);
+            paths[path_index].color_sum = path.color_sum;
+            paths[path_index].moment_sum = path.moment_sum;
+        }
+    }
+
+    push(queue, path_index);
+#ifdef COUNT_RAYS
+    add_ray_counts();
+#endif
+}
+
+#elif defined(WAVEFRONT_SHADE)
+void main()
+{
+    const uint shade_queue = MATERIAL_QUEUE + uint(SHADE_MATERIAL);
+
+    uint queue = NO_QUEUE;
+    uint path_index = 0u;
+    if (gl_GlobalInvocationID.x < queues[shade_queue].count)
+    {
+        path_index = queue_items[shade_queue * uint(paths.length()) + gl_GlobalInvocationID.x];
+        Path path = paths[path_index];
+
+        Hit hit = get_hit(path.origin, path.direction, path.t, path.u, int(path.primitive));
+        Material material = get_material(int(hit.material_id));
+        // Known for the whole queue, which lets the compiler remove the
+        // branches of scatter() for the other material types
+        material.type = SHADE_MATERIAL;
+
+        path.color += path.throughput * hit_emission(material, hit, path.direction, path.t, path.direction_pdf);
+
+        vec2 normal = dot(path.direction, hit.normal) < 0.0 ? hit.normal : -hit.normal;
+        if (scatter(hit, material, path.depth < MAX_DEPTH, path.origin, path.direction, path.throughput, path.rng_state))
+        {
+#if SHADE_MATERIAL == DIFFUSE
+            path.color += path.throughput * sample_direct_light(path.origin, normal, true, path.rng_state);
+            path.direction_pdf = 0.5 * dot(path.direction, normal);
+#else
+            path.direction_pdf = 0.0;
+#endif
+            ++path.depth;
+            queue = RAY_QUEUE + (ray_queue ^ 1u);
+        }
+        else
+        {
+            finish_path(path);
+        }
+        paths[path_index] = path;
+    }
+
+    push(queue, path_index);
+#ifdef COUNT_RAYS
+    add_ray_counts();
+#endif
+}
+
+#elif defined(WAVEFRONT_ACCUMULATE)
+void main()
+{
+    uvec2 pixel = gl_GlobalInvocationID.xy;
+    if (pixel.x >= tile_size.x || pixel.y >= tile_size.y)
+    {
+        return;
+    }
+
+    vec4 average_color;
+    float second_moment;
+    if (!read_pixel(ivec2(pixel), average_color, second_moment))
+    {
+        return;
+    }
+
+    Path path = paths[pixel.y * tile_size.x + pixel.x];
+    write_pixel(ivec2(pixel), average_color, second_moment, path.color_sum, path.moment_sum, samples_per_frame);
+}
+
+#elif defined(WAVEFRONT_PREPARE)
+void main()
+{
+    uint i = gl_LocalInvocationIndex;
+    if (i < NUM_QUEUES)
+    {
+        if ((consumed_queues & (1u << i)) != 0u)
+        {
+            queues[i].count = 0u;
+        }
+        queues[i].num_groups_x = (queues[i].count + QUEUE_GROUP_SIZE - 1u) / QUEUE_GROUP_SIZE;
+        queues[i].num_groups_y = 1u;
+        queues[i].num_groups_z = 1u;
+    }
+}
+#endif
@@ -0,0 +1,166 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <utility>
+
+Thread_pool::Thread_pool(unsigned int num_threads)
+{
+    if (num_threads == 0)
+    {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    m_queues.reserve(num_threads);
+    for (unsigned int i {0}; i < num_threads; ++i)
+    {
+        m_queues.push_back(std::make_unique<Worker_queue>());
+    }
+
+    // Worker 0 is the thread calling parallel_for()
+    m_threads.reserve(num_threads - 1);
+    for (unsigned int i {1}; i < num_threads; ++i)
+    {
+        m_threads.emplace_back([this, i] { worker_loop(i); });
+    }
+}
+
+Thread_pool::~Thread_pool() noexcept
+{
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_stop = true;
+    }
+    m_start_condition.notify_all();
+
+    for (auto &thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+unsigned int Thread_pool::size() const noexcept
+{
+    return static_cast<unsigned int>(m_queues.size());
+}
+
+void Thread_pool::parallel_for(std::size_t count,
+                               const std::function<void(std::size_t)> &task)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    // Give each worker a contiguous range of tasks, which keeps neighbouring
+    // tiles on the same core as long as no stealing is needed.
+    const auto num_queues = m_queues.size();
+    for (std::size_t i {0}; i < num_queues; ++i)
+    {
+        const auto begin = count * i / num_queues;
+        const auto end = count * (i + 1) / num_queues;
+        const std::scoped_lock lock(m_queues[i]->mutex);
+        for (auto j = begin; j < end; ++j)
+        {
+            m_queues[i]->tasks.push_back(j);
+        }
+    }
+
+    {
+        const std::scoped_lock lock(m_mutex);
+        m_task = &task;
+        m_exception = nullptr;
+        m_busy_workers = static_cast<unsigned int>(m_threads.size());
+        ++m_generation;
+    }
+    m_start_condition.notify_all();
+
+    run_tasks(0);
+
+    std::unique_lock lock(m_mutex);
+    m_done_condition.wait(lock, [this] { return m_busy_workers == 0; });
+    m_task = nullptr;
+
+    if (m_exception)
+    {
+        std::rethrow_exception(std::exchange(m_exception, nullptr));
+    }
+}
+
+void Thread_pool::worker_loop(unsigned int worker_index)
+{
+    unsigned long long generation {0};
+
+    for (;;)
+    {
+        {
+            std::unique_lock lock(m_mutex);
+            m_start_condition.wait(
+                lock,
+                [this, generation]
+                { return m_stop || m_generation != generation; });
+            if (m_stop)
+            {
+                return;
+            }
+            generation = m_generation;
+        }
+
+        run_tasks(worker_index);
+
+        {
+            const std::scoped_lock lock(m_mutex);
+            --m_busy_workers;
+        }
+        m_done_condition.notify_one();
+    }
+}
+
+void Thread_pool::run_tasks(unsigned int worker_index)
+{
+    std::size_t task {};
+    while (pop_task(worker_index, task))
+    {
+        try
+        {
+            (*m_task)(task);
+        }
+        catch (...)
+        {
+            const std::scoped_lock lock(m_mutex);
+            if (!m_exception)
+            {
+                m_exception = std::current_exception();
+            }
+        }
+    }
+}
+
+bool Thread_pool::pop_task(unsigned int worker_index, std::size_t &task)
+{
+    {
+        auto &queue = *m_queues[worker_index];
+        const std::scoped_lock lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+            return true;
+        }
+    }
+
+    // Steal from the back of the other queues, starting with our neighbour
+    const auto num_queues = m_queues.size();
+    for (std::size_t i {1}; i < num_queues; ++i)
+    {
+        auto &queue = *m_queues[(worker_index + i) % num_queues];
+        const std::scoped_lock lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,62 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads executing index-based parallel loops.
+// Each worker owns a queue of task indices and steals from the back of the
+// other queues once its own is empty, so that uneven per-task costs (e.g.
+// tiles containing caustics versus empty tiles) are balanced automatically.
+class Thread_pool
+{
+public:
+    // The calling thread participates in the work, so a pool of size N spawns
+    // N - 1 threads. A size of 0 selects the hardware concurrency.
+    explicit Thread_pool(unsigned int num_threads = 0);
+
+    Thread_pool(const Thread_pool &) = delete;
+    Thread_pool &operator=(const Thread_pool &) = delete;
+
+    ~Thread_pool() noexcept;
+
+    [[nodiscard]] unsigned int size() const noexcept;
+
+    // Calls task(i) for every i in [0, count) and blocks until all calls have
+    // returned. If a task throws, the first exception is rethrown here once
+    // all workers are done.
+    void parallel_for(std::size_t count,
+                      const std::function<void(std::size_t)> &task);
+
+private:
+    struct Worker_queue
+    {
+        std::mutex mutex;
+        std::deque<std::size_t> tasks;
+    };
+
+    void worker_loop(unsigned int worker_index);
+    void run_tasks(unsigned int worker_index);
+    [[nodiscard]] bool pop_task(unsigned int worker_index, std::size_t &task);
+
+    std::vector<std::unique_ptr<Worker_queue>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_start_condition;
+    std::condition_variable m_done_condition;
+    const std::function<void(std::size_t)> *m_task {nullptr};
+    unsigned int m_busy_workers {0};
+    unsigned long long m_generation {0};
+    bool m_stop {false};
+    std::exception_ptr m_exception {};
+};
+
+#endif
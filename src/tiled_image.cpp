@@ -0,0 +1,219 @@
+#include "tiled_image.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace
+{
+
+// Tiles start on a multiple of the largest common page size, so that they can
+// be paged in and out independently
+constexpr std::size_t tile_alignment {65536};
+
+[[nodiscard]] constexpr std::size_t align_up(std::size_t value,
+                                             std::size_t alignment) noexcept
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+[[noreturn]] void throw_mapping_error(const std::filesystem::path &path,
+                                      const std::string &error)
+{
+    std::ostringstream message;
+    message << "Failed to map tiled image";
+    if (!path.empty())
+    {
+        message << " \"" << path.string() << '\"';
+    }
+    message << ": " << error;
+    throw std::runtime_error(message.str());
+}
+
+} // namespace
+
+Tiled_image::Tiled_image(int width,
+                         int height,
+                         int tile_size,
+                         const std::filesystem::path &path)
+    : m_tile_size {tile_size},
+      m_num_tiles_x {(width + tile_size - 1) / tile_size},
+      m_tile_pixels {static_cast<std::size_t>(tile_size) *
+                     static_cast<std::size_t>(tile_size)},
+      m_tile_bytes {align_up(m_tile_pixels * (sizeof(vec4) + sizeof(float)),
+                             tile_alignment)},
+      m_size {m_tile_bytes * static_cast<std::size_t>(m_num_tiles_x) *
+              static_cast<std::size_t>((height + tile_size - 1) / tile_size)},
+      m_file_backed {!path.empty()}
+{
+#ifdef _WIN32
+    auto file = INVALID_HANDLE_VALUE;
+    if (m_file_backed)
+    {
+        file = CreateFileW(path.c_str(),
+                           GENERIC_READ | GENERIC_WRITE,
+                           0,
+                           nullptr,
+                           CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL,
+                           nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            throw_mapping_error(
+                path,
+                std::system_category().message(
+                    static_cast<int>(GetLastError())));
+        }
+        m_file = file;
+    }
+
+    // Mapping a file beyond its end extends it with zeros
+    m_mapping =
+        CreateFileMappingW(file,
+                           nullptr,
+                           PAGE_READWRITE,
+                           static_cast<DWORD>(m_size >> 32),
+                           static_cast<DWORD>(m_size & 0xFFFFFFFF),
+                           nullptr);
+    if (m_mapping != nullptr)
+    {
+        m_data = static_cast<std::byte *>(
+            MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, m_size));
+    }
+    if (m_data == nullptr)
+    {
+        const auto error = static_cast<int>(GetLastError());
+        if (m_mapping != nullptr)
+        {
+            CloseHandle(m_mapping);
+        }
+        if (m_file != nullptr)
+        {
+            CloseHandle(m_file);
+        }
+        throw_mapping_error(path, std::system_category().message(error));
+    }
+#else
+    auto flags = MAP_SHARED;
+    if (m_file_backed)
+    {
+        m_file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_file < 0)
+        {
+            throw_mapping_error(path, std::generic_category().message(errno));
+        }
+        // The file is sparse, the tiles read as zeros until written
+        if (ftruncate(m_file, static_cast<off_t>(m_size)) != 0)
+        {
+            const auto error = errno;
+            close(m_file);
+            throw_mapping_error(path, std::generic_category().message(error));
+        }
+    }
+    else
+    {
+        flags |= MAP_ANONYMOUS;
+    }
+
+    auto *const data =
+        mmap(nullptr, m_size, PROT_READ | PROT_WRITE, flags, m_file, 0);
+    if (data == MAP_FAILED)
+    {
+        const auto error = errno;
+        if (m_file >= 0)
+        {
+            close(m_file);
+        }
+        throw_mapping_error(path, std::generic_category().message(error));
+    }
+    m_data = static_cast<std::byte *>(data);
+#endif
+}
+
+Tiled_image::~Tiled_image() noexcept
+{
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+    if (m_file != nullptr)
+    {
+        CloseHandle(m_file);
+    }
+#else
+    munmap(m_data, m_size);
+    if (m_file >= 0)
+    {
+        close(m_file);
+    }
+#endif
+}
+
+int Tiled_image::tile_size() const noexcept
+{
+    return m_tile_size;
+}
+
+std::span<vec4> Tiled_image::accumulation(const Tile &tile) const noexcept
+{
+    return {reinterpret_cast<vec4 *>(tile_data(tile)), m_tile_pixels};
+}
+
+std::span<float> Tiled_image::moments(const Tile &tile) const noexcept
+{
+    return {reinterpret_cast<float *>(tile_data(tile) +
+                                      m_tile_pixels * sizeof(vec4)),
+            m_tile_pixels};
+}
+
+void Tiled_image::prefetch(const Tile &tile) const noexcept
+{
+    if (!m_file_backed)
+    {
+        return;
+    }
+#ifdef _WIN32
+    WIN32_MEMORY_RANGE_ENTRY range {tile_data(tile), m_tile_bytes};
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    madvise(tile_data(tile), m_tile_bytes, MADV_WILLNEED);
+#endif
+}
+
+void Tiled_image::evict(const Tile &tile) const noexcept
+{
+    // Anonymous memory would be lost
+    if (!m_file_backed)
+    {
+        return;
+    }
+#ifdef _WIN32
+    FlushViewOfFile(tile_data(tile), m_tile_bytes);
+    // Unlocking pages that are not locked removes them from the working set
+    VirtualUnlock(tile_data(tile), m_tile_bytes);
+#else
+    // Dirty pages of a shared file mapping stay in the page cache until they
+    // are written, dropping them from the process is safe
+    msync(tile_data(tile), m_tile_bytes, MS_ASYNC);
+    madvise(tile_data(tile), m_tile_bytes, MADV_DONTNEED);
+#endif
+}
+
+std::byte *Tiled_image::tile_data(const Tile &tile) const noexcept
+{
+    const auto index = static_cast<std::size_t>(tile.y / m_tile_size) *
+                           static_cast<std::size_t>(m_num_tiles_x) +
+                       static_cast<std::size_t>(tile.x / m_tile_size);
+    return m_data + index * m_tile_bytes;
+}
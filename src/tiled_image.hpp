@@ -0,0 +1,65 @@
+#ifndef TILED_IMAGE_HPP
+#define TILED_IMAGE_HPP
+
+#include "tiles.hpp"
+#include "vec.hpp"
+
+#include <cstddef>
+#include <filesystem>
+#include <span>
+
+// Accumulation and moment images of a render traced in tiles, stored tile by
+// tile in a memory mapping. Each tile is a contiguous range holding
+// tile_size by tile_size pixels, which a texture of the same size uploads or
+// reads back directly. For out-of-core rendering the mapping is backed by a
+// file, and the operating system pages the tiles in and out of memory as they
+// are traced. Otherwise it is backed by anonymous memory.
+class Tiled_image
+{
+public:
+    // An empty path selects anonymous memory. An existing file is
+    // overwritten.
+    Tiled_image(int width,
+                int height,
+                int tile_size,
+                const std::filesystem::path &path);
+
+    Tiled_image(const Tiled_image &) = delete;
+    Tiled_image &operator=(const Tiled_image &) = delete;
+
+    ~Tiled_image() noexcept;
+
+    [[nodiscard]] int tile_size() const noexcept;
+
+    // Rows of tile_size pixels, starting from the bottom of the tile. Only the
+    // first tile.width pixels of the first tile.height rows are part of the
+    // image.
+    [[nodiscard]] std::span<vec4> accumulation(const Tile &tile) const noexcept;
+    [[nodiscard]] std::span<float> moments(const Tile &tile) const noexcept;
+
+    // Asks the operating system to read the tile from the file in the
+    // background, while the GPU is busy with another tile.
+    void prefetch(const Tile &tile) const noexcept;
+
+    // Starts writing the tile back to the file and releases its memory.
+    void evict(const Tile &tile) const noexcept;
+
+private:
+    [[nodiscard]] std::byte *tile_data(const Tile &tile) const noexcept;
+
+    int m_tile_size;
+    int m_num_tiles_x;
+    std::size_t m_tile_pixels;
+    std::size_t m_tile_bytes;
+    std::size_t m_size;
+    bool m_file_backed;
+    std::byte *m_data {nullptr};
+#ifdef _WIN32
+    void *m_file {nullptr};
+    void *m_mapping {nullptr};
+#else
+    int m_file {-1};
+#endif
+};
+
+#endif
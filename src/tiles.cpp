@@ -0,0 +1,65 @@
+#include "tiles.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+
+std::vector<Tile> create_tiles(int width, int height, int tile_size)
+{
+    std::vector<Tile> tiles;
+    for (int y {0}; y < height; y += tile_size)
+    {
+        for (int x {0}; x < width; x += tile_size)
+        {
+            tiles.push_back({.x = x,
+                             .y = y,
+                             .width = std::min(tile_size, width - x),
+                             .height = std::min(tile_size, height - y),
+                             .sample_index = 0,
+                             .error = std::numeric_limits<float>::infinity()});
+        }
+    }
+    return tiles;
+}
+
+std::optional<std::size_t> next_tile(const std::vector<Tile> &tiles,
+                                     unsigned int max_samples,
+                                     float target_error,
+                                     std::optional<std::size_t> skipped_tile)
+{
+    std::optional<std::size_t> result {};
+    float max_noise {0.0f};
+    for (std::size_t i {0}; i < tiles.size(); ++i)
+    {
+        const auto &tile = tiles[i];
+        if (i == skipped_tile || tile.sample_index >= max_samples ||
+            (target_error > 0.0f && tile.error <= target_error))
+        {
+            continue;
+        }
+        // Unmeasured tiles come first, in scan order
+        const auto noise =
+            tile.error * static_cast<float>(tile.width * tile.height);
+        if (!result.has_value() || noise > max_noise)
+        {
+            result = i;
+            max_noise = noise;
+        }
+    }
+    return result;
+}
+
+float mean_error(const std::vector<Tile> &tiles)
+{
+    double sum {0.0};
+    std::size_t num_pixels {0};
+    for (const auto &tile : tiles)
+    {
+        const auto tile_pixels = static_cast<std::size_t>(tile.width) *
+                                 static_cast<std::size_t>(tile.height);
+        sum += static_cast<double>(tile.error) *
+               static_cast<double>(tile_pixels);
+        num_pixels += tile_pixels;
+    }
+    return static_cast<float>(sum / static_cast<double>(num_pixels));
+}
@@ -0,0 +1,41 @@
+#ifndef TILES_HPP
+#define TILES_HPP
+
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+// Rectangle of an image rendered in tiles, in pixels from the bottom left
+// corner of the image, with the progress of its pixels
+struct Tile
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    // Number of samples of the pixels that did not stop sampling early
+    unsigned int sample_index;
+    // Mean relative error of the pixels, infinite until first measured
+    float error;
+};
+
+// Splits an image into tiles of at most tile_size by tile_size pixels.
+[[nodiscard]] std::vector<Tile>
+create_tiles(int width, int height, int tile_size);
+
+// Returns the tile with the most estimated remaining noise, which is its mean
+// error weighted by its number of pixels, among those that have fewer than
+// max_samples samples and an error above target_error, if positive. Returns
+// nothing once all tiles are done. Skipping the tile being traced gives the
+// tile most likely to be traced after it.
+[[nodiscard]] std::optional<std::size_t>
+next_tile(const std::vector<Tile> &tiles,
+          unsigned int max_samples,
+          float target_error,
+          std::optional<std::size_t> skipped_tile = std::nullopt);
+
+// Mean relative error of all pixels of the image, infinite while some tile has
+// not been measured.
+[[nodiscard]] float mean_error(const std::vector<Tile> &tiles);
+
+#endif
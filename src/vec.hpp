@@ -157,6 +157,65 @@ constexpr vec2 &operator/=(vec2 &v, float f) noexcept
     return v;
 }
 
+[[nodiscard]] constexpr vec3 operator+(const vec3 &u, const vec3 &v) noexcept
+{
+    return {u.x + v.x, u.y + v.y, u.z + v.z};
+}
+
+[[nodiscard]] constexpr vec3 operator-(const vec3 &u, const vec3 &v) noexcept
+{
+    return {u.x - v.x, u.y - v.y, u.z - v.z};
+}
+
+[[nodiscard]] constexpr vec3 operator*(const vec3 &u, const vec3 &v) noexcept
+{
+    return {u.x * v.x, u.y * v.y, u.z * v.z};
+}
+
+[[nodiscard]] constexpr vec3 operator/(const vec3 &u, const vec3 &v) noexcept
+{
+    return {u.x / v.x, u.y / v.y, u.z / v.z};
+}
+
+[[nodiscard]] constexpr vec3 operator*(const vec3 &v, float f) noexcept
+{
+    return {v.x * f, v.y * f, v.z * f};
+}
+
+[[nodiscard]] constexpr vec3 operator/(const vec3 &v, float f) noexcept
+{
+    return {v.x / f, v.y / f, v.z / f};
+}
+
+[[nodiscard]] constexpr vec3 operator*(float f, const vec3 &v) noexcept
+{
+    return {f * v.x, f * v.y, f * v.z};
+}
+
+constexpr vec3 &operator+=(vec3 &u, const vec3 &v) noexcept
+{
+    u = u + v;
+    return u;
+}
+
+constexpr vec3 &operator*=(vec3 &u, const vec3 &v) noexcept
+{
+    u = u * v;
+    return u;
+}
+
+constexpr vec3 &operator*=(vec3 &v, float f) noexcept
+{
+    v = v * f;
+    return v;
+}
+
+constexpr vec3 &operator/=(vec3 &v, float f) noexcept
+{
+    v = v / f;
+    return v;
+}
+
 [[nodiscard]] constexpr float dot(const vec2 &u, const vec2 &v) noexcept
 {
     return u.x * v.x + u.y * v.y;